@@ -6,7 +6,7 @@ echo '                 Running example operations on horizontal image'
 echo
 echo '------------------------------------------------------------------------------------------'
 echo
-echo '  1. Resize proportionally to 230px width w/ prefiltering & sharpening (beautiful, but slow)'
+echo '  1. Resize proportionally to 230px width w/ prefiltering & sharpening'
 echo '  2. Resize proportionally to 640px width'
 echo '  3. Resize proportionally to 800px width and preserve original metadata'
 echo '  4. Read the photos original metadata'
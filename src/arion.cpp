@@ -45,7 +45,13 @@
 #include "models/read_meta.hpp"
 #include "models/copy.hpp"
 #include "models/fingerprint.hpp"
+#include "codecs/image_format.hpp"
+#include "codecs/jpeg_decoder.hpp"
+#include "codecs/restart_jpeg_decoder.hpp"
+#include "codecs/tiff_reader.hpp"
+#include "imgproc/stream_resizer.hpp"
 #include "utils/utils.hpp"
+#include "utils/executor.hpp"
 #include "arion.hpp"
 
 // Local Third party
@@ -61,6 +67,7 @@
 #include <boost/exception/all.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
 #include <boost/program_options.hpp>
 #include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
@@ -79,6 +86,12 @@
 // Stdlib
 #include <iostream>
 #include <string>
+#include <limits>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <thread>
 
 using namespace boost::program_options;
 using namespace boost::filesystem;
@@ -101,6 +114,33 @@ class ArionOperationNotSupportedException : public exception {
   }
 } operationNotSupportedException;
 
+namespace {
+
+// Operations write metadata from several threads, which the XMP toolkit
+// behind Exiv2 only allows with a lock
+recursive_mutex xmpMutex;
+once_flag xmpOnce;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void lockXmp(void *pLockData, bool lockUnlock) {
+  recursive_mutex *pMutex = (recursive_mutex *) pLockData;
+
+  if (lockUnlock) {
+    pMutex->lock();
+  } else {
+    pMutex->unlock();
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void initializeXmp() {
+  Exiv2::XmpParser::initialize(lockXmp, &xmpMutex);
+}
+
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 Arion::Arion() :
@@ -114,7 +154,25 @@ Arion::Arion() :
     mFailedOperations(0),
     mResult(false),
     mDecodeImage(true),
-    mIgnoreMetadata(false) {
+    mIgnoreMetadata(false),
+    mDecodeScale(1),
+    mOrientation(1),
+    mUseEmbeddedPreview(false),
+    mEmbeddedPreview(false),
+    mRawProfile(RawProfileAuto),
+    mRawProfileUsed(RawProfileAuto),
+    mStreamMinPixels(ARION_STREAM_MIN_PIXELS),
+    mStreamed(false),
+    mRestartSlices(0),
+    mThreads(ARION_THREADS),
+    mThreadsUsed(1),
+    mFormat(ImageFormatUnknown),
+    mGrayscale(false),
+    mDecoded(false),
+    mPendingOrientation(1) {
+  // Before anything reads metadata, since the XMP toolkit keeps whichever lock
+  // it was first initialized with (none when Exiv2 initializes it itself)
+  call_once(xmpOnce, initializeXmp);
 }
 
 //------------------------------------------------------------------------------
@@ -181,11 +239,48 @@ bool Arion::setup(const string &inputJson) {
   //--------------------------------
   //   Allow Skip decode image
   //--------------------------------
+  // Pixels are only decoded when an operation needs them, so this now just
+  // skips reading the dimensions for jobs that don't
   boost::optional<bool> allow_skip_decode_image = mInputTree.get_optional<bool>("allow_skip_decode_image");
   if (allow_skip_decode_image && allow_skip_decode_image == true) {//Not required
     mDecodeImage = false;
   }
 
+  //--------------------------------
+  //   Use embedded preview
+  //--------------------------------
+  boost::optional<bool> use_embedded_preview = mInputTree.get_optional<bool>("use_embedded_preview");
+  if (use_embedded_preview && use_embedded_preview == true) {//Not required
+    mUseEmbeddedPreview = true;
+  }
+
+  //--------------------------------
+  //   RAW processing profile
+  //--------------------------------
+  boost::optional<std::string> raw_profile = mInputTree.get_optional<std::string>("raw_profile");
+  if (raw_profile) {//Not required
+    string rawProfile = *raw_profile;
+    // Make sure it's lowercase
+    transform(rawProfile.begin(), rawProfile.end(), rawProfile.begin(), ::tolower);
+    setRawProfile(rawProfile);
+  }
+
+  //--------------------------------
+  //   Streaming threshold
+  //--------------------------------
+  boost::optional<unsigned long> stream_min_pixels = mInputTree.get_optional<unsigned long>("stream_min_pixels");
+  if (stream_min_pixels) {//Not required
+    setStreamMinPixels(*stream_min_pixels);
+  }
+
+  //--------------------------------
+  //   Thread cap
+  //--------------------------------
+  boost::optional<unsigned> threads = mInputTree.get_optional<unsigned>("threads");
+  if (threads) {//Not required
+    setThreads(*threads);
+  }
+
   return true;
 }
 
@@ -193,6 +288,9 @@ bool Arion::setup(const string &inputJson) {
 //------------------------------------------------------------------------------
 void Arion::setSourceImage(cv::Mat &sourceImage) {
   mSourceImage = sourceImage;
+  mSourceSize = sourceImage.size();
+  mSourceRegion = cv::Rect(cv::Point(0, 0), mSourceSize);
+  mPyramid.clear();
 }
 
 //------------------------------------------------------------------------------
@@ -207,6 +305,44 @@ void Arion::setDecodeImage(bool decodeImage) {
   mDecodeImage = decodeImage;
 }
 
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Arion::setUseEmbeddedPreview(bool useEmbeddedPreview) {
+  mUseEmbeddedPreview = useEmbeddedPreview;
+}
+
+//------------------------------------------------------------------------------
+// Unknown profiles fall back to picking one automatically
+//------------------------------------------------------------------------------
+void Arion::setRawProfile(const std::string &rawProfile) {
+  if (rawProfile == "fast") {
+    mRawProfile = RawProfileFast;
+  } else if (rawProfile == "balanced") {
+    mRawProfile = RawProfileBalanced;
+  } else if (rawProfile == "full") {
+    mRawProfile = RawProfileFull;
+  } else {
+    mRawProfile = RawProfileAuto;
+  }
+}
+
+//------------------------------------------------------------------------------
+// A value of 0 disables streaming
+//------------------------------------------------------------------------------
+void Arion::setStreamMinPixels(unsigned long streamMinPixels) {
+  mStreamMinPixels = streamMinPixels;
+}
+
+//------------------------------------------------------------------------------
+// More threads than cores only adds overhead, so the count is capped to the
+// number of cores. 0 is ignored
+//------------------------------------------------------------------------------
+void Arion::setThreads(unsigned threads) {
+  if (threads > 0) {
+    mThreads = min(threads, max(std::thread::hardware_concurrency(), 1u));
+  }
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 cv::Mat &Arion::getSourceImage() {
@@ -320,88 +456,26 @@ void Arion::parseInputUrl(std::string inputUrl) {
 }
 
 //------------------------------------------------------------------------------
-// Return true if image was rotated, false otherwise
+// Returns the EXIF orientation flag or 1 (normal) if it is not present
 //------------------------------------------------------------------------------
-bool Arion::handleOrientation(Exiv2::ExifData &exifData, cv::Mat &image) {
+long Arion::readOrientation(Exiv2::ExifData &exifData) const {
 
   Exiv2::ExifKey key("Exif.Image.Orientation");
 
   Exiv2::ExifData::iterator pos = exifData.findKey(key);
 
   if (pos == exifData.end()) {
-    return false;
-  }
-
-  long orientation = pos->toLong();
-
-  switch (orientation) {
-    case 1: // normal (do nothing)
-      break;
-
-    case 2: // horizontal flip
-    {
-      cv::flip(image, image, 1);
-
-      return true;
-    }
-
-    case 3: // 180 rotate left (two left rotations)
-    {
-      // TODO: even though this is rare it needs to be more efficient
-      cv::transpose(image, image);
-      cv::flip(image, image, 0);
-      cv::transpose(image, image);
-      cv::flip(image, image, 0);
-
-      return true;
-    }
-
-    case 4: // vertical flip
-    {
-      cv::flip(image, image, 0);
-
-      return true;
-    }
-
-    case 5: // vertical flip + 90 rotate right
-    {
-      cv::flip(image, image, 0);
-      cv::transpose(image, image);
-      cv::flip(image, image, 1);
-
-      return true;
-    }
-
-    case 6: // 90 rotate right x
-    {
-      cv::transpose(image, image);
-      cv::flip(image, image, 1);
-
-      return true;
-    }
-
-    case 7: // horizontal flip + 90 rotate right
-    {
-      cv::flip(image, image, 1);
-      cv::transpose(image, image);
-      cv::flip(image, image, 1);
-
-      return true;
-    }
-
-    case 8: // 90 rotate left
-    {
-      cv::transpose(image, image);
-      cv::flip(image, image, 0);
-
-      return true;
-    }
-
-    default:break;
+    return 1;
   }
 
-  return false;
+  return pos->toLong();
+}
 
+//------------------------------------------------------------------------------
+// Return true if image was rotated, false otherwise
+//------------------------------------------------------------------------------
+bool Arion::handleOrientation(long orientation, cv::Mat &image) {
+  return Utils::orientImage(image, orientation);
 }
 
 //------------------------------------------------------------------------------
@@ -560,7 +634,6 @@ bool Arion::parseOperations(const ptree &pt) {
       if (type == "resize") {
         // This is a resize operation so create the corresponding object
         operation = new Resize();
-        mDecodeImage = true;//wee need to decode image
       } else if (type == "read_meta") {
         // This is a read_meta operation so create the corresponding object
         operation = new Read_meta();
@@ -570,7 +643,6 @@ bool Arion::parseOperations(const ptree &pt) {
       } else if (type == "fingerprint") {
         // This is a copy operation so create the corresponding object
         operation = new Fingerprint();
-        mDecodeImage = true;//wee need to decode image
       } else {
         throw operationNotSupportedException;
       }
@@ -601,234 +673,1190 @@ bool Arion::parseOperations(const ptree &pt) {
 }
 
 //------------------------------------------------------------------------------
+// The largest factor the source can be reduced by without affecting any
+// operation
 //------------------------------------------------------------------------------
-void Arion::extractImageData(const string &imageFilePath) {
-  // If we are taking metadata into account first read the image into memory
-  // and then extract pixel and metadata from memory...
-  std::ifstream input(imageFilePath.c_str(), std::ios::binary);
-
-  // copies all data into buffer
-  std::vector<char> buffer((std::istreambuf_iterator<char>(input)), (std::istreambuf_iterator<char>()));
+double Arion::getMaxSourceReduction(const cv::Size &sourceSize) const {
+  double reduction = std::numeric_limits<double>::max();
 
-  if (buffer.empty()) {
-    throw extractException;
+  BOOST_FOREACH(const Operation &operation, mOperations)
+  {
+    reduction = std::min(reduction, operation.getMaxSourceReduction(sourceSize));
   }
 
-  if (mDecodeImage) {//only read pixels if required by operations
-    LibRaw libRaw;
-    int status = libRaw.open_buffer(static_cast<void *>(buffer.data()), buffer.size());
-    if (status == LIBRAW_SUCCESS) {//only 0 is success
-
-//   libRaw.imgdata.idata.raw_count; //TODO support multiple images
-      libRaw.imgdata.params.use_camera_wb = 1;
-      libRaw.unpack();// decode bayer data
-
-      libRaw.dcraw_process();// white balance, color interpolation, color space conversion
-      // gamma correction, image rotation, 3-component RGB bitmap creation
-      libraw_processed_image_t *rawImage = libRaw.dcraw_make_mem_image();
-
-      // rawImage->type; //TODO ?
+  return reduction;
+}
 
-      mSourceImage = cv::Mat(
-          rawImage->height,
-          rawImage->width,
-          CV_8UC3,
-          rawImage->data
-      );
-      cv::cvtColor(mSourceImage, mSourceImage, CV_RGB2BGR);    //Convert RGB to BGR
-    } else {
-      // Now actually decode the bytes
-      cv::InputArray buf(buffer);
+//------------------------------------------------------------------------------
+// Pick the largest libjpeg DCT scale factor (1/2, 1/4 or 1/8) that still
+// covers what every operation needs from the source
+//------------------------------------------------------------------------------
+unsigned Arion::planDecodeScale(const cv::Size &sourceSize) const {
+  const double reduction = getMaxSourceReduction(sourceSize);
 
-      mSourceImage = cv::imdecode(buf, cv::IMREAD_COLOR);
-    }
+  static const unsigned scales[] = {8, 4, 2};
 
-    if (mSourceImage.empty()) {
-      throw extractException;
+  for (unsigned i = 0; i < (sizeof(scales) / sizeof(scales[0])); i++) {
+    if ((double) scales[i] <= reduction) {
+      return scales[i];
     }
   }
 
-  if (!mIgnoreMetadata) {
+  return 1;
+}
 
-    try {
-      mExivImage = Exiv2::ImageFactory::open((const Exiv2::byte *) &buffer.front(), (long) buffer.size());
+//------------------------------------------------------------------------------
+// The union of the source regions read by the operations. This is the whole
+// source unless every operation crops (e.g. fill or square resizes)
+//------------------------------------------------------------------------------
+cv::Rect Arion::planDecodeRegion(const cv::Size &sourceSize) const {
+  const cv::Rect full(cv::Point(0, 0), sourceSize);
 
-      if (mExivImage.get() != 0) {
-        mExivImage->readMetadata();
+  cv::Rect region;
 
-        Exiv2::ExifData &exifData = mExivImage->exifData();
+  BOOST_FOREACH(const Operation &operation, mOperations)
+  {
+    const cv::Rect operationRegion = operation.getSourceRegion(sourceSize) & full;
 
-        if (!exifData.empty()) {
-          mpExifData = &exifData;
+    if (operationRegion.area() <= 0) {
+      continue;
+    }
 
-#if DEBUG
-          Utils::exifDebug(exifData);
-#endif
+    region = (region.area() > 0) ? (region | operationRegion) : operationRegion;
+  }
 
-          if (mCorrectOrientation) {
-            handleOrientation(exifData, mSourceImage);
-          }
-        }
+  // Nothing reads pixels, decode everything to keep the reported dimensions
+  if (region.area() <= 0) {
+    return full;
+  }
 
-        Exiv2::XmpData &xmpData = mExivImage->xmpData();
+  return region;
+}
 
-        if (!xmpData.empty()) {
-          mpXmpData = &xmpData;
+//------------------------------------------------------------------------------
+// Decode only the part of a JPEG that covers region (in oriented, full
+// resolution coordinates). The region is widened by a margin so that iMCU
+// alignment and chroma upsampling at its edges don't change any pixel the
+// operations read, which keeps the output identical to a full decode
+//------------------------------------------------------------------------------
+bool Arion::decodeJpegRegion(const InputBuffer &buffer, const cv::Size &storedSize, const cv::Rect &region) {
+  static const int margin = 16;
 
-#if DEBUG
-          Utils::xmpDebug(xmpData);
-#endif
-        }
+  const int scale = (int) mDecodeScale;
 
-        Exiv2::IptcData &iptcData = mExivImage->iptcData();
+  // libjpeg works on the stored image at the decode scale
+  const cv::Rect stored = Utils::unorientRect(region, storedSize, mOrientation);
 
-        if (!iptcData.empty()) {
-          mpIptcData = &iptcData;
+  const int x0 = stored.x / scale - margin;
+  const int y0 = stored.y / scale - margin;
+  const int x1 = (stored.x + stored.width + scale - 1) / scale + margin;
+  const int y1 = (stored.y + stored.height + scale - 1) / scale + margin;
 
-#if DEBUG
-          Utils::iptcDebug(iptcData);
-#endif
-        }
-      }
-    }
-    catch (Exiv2::AnyError &e) {
-      // Not the end of the world if reading EXIF data failed
-    }
+  JpegDecoder decoder;
+  cv::Rect decodedRegion;
 
-    if (mExivImage->iccProfileDefined()) {
-      mpIccProfile = mExivImage->iccProfile();
-    }
+  if (!decoder.open(buffer.data(), buffer.size()) ||
+      !decoder.decode(scale, cv::Rect(x0, y0, x1 - x0, y1 - y0), mSourceImage, decodedRegion)) {
+    mSourceImage.release();
+    return false;
   }
 
+  // Back to full resolution coordinates
+  cv::Rect decodedStored(decodedRegion.x * scale,
+                         decodedRegion.y * scale,
+                         decodedRegion.width * scale,
+                         decodedRegion.height * scale);
+
+  decodedStored &= cv::Rect(cv::Point(0, 0), storedSize);
+
+  mSourceRegion = Utils::orientRect(decodedStored, storedSize, mOrientation);
+
+  return true;
 }
 
 //------------------------------------------------------------------------------
+// Read the smallest pyramid level that still satisfies every operation and
+// only the tiles (or strips) covering the region they read. Returns false,
+// leaving the TIFF to OpenCV, when neither helps or libtiff can't read it
 //------------------------------------------------------------------------------
-bool Arion::run() {
+bool Arion::decodeTiff(const InputBuffer &buffer) {
+  TiffReader reader;
 
-  //----------------------------------
-  //        Preprocessing
-  //----------------------------------
-  if (mInputFile.length()) {
-    try {
-      // We have an input file, so lets read it
-      extractImageData(mInputFile);
-    }
-    catch (boost::exception &e) {
+  if (!reader.open(buffer.data(), buffer.size())) {
+    return false;
+  }
 
-      mResult = false;
-      mErrorMessage = "Error extracting image";
-      constructErrorJson();
+  const cv::Size storedSize = reader.getLevelSize(0);
+  const cv::Size sourceSize = orientSize(storedSize);
 
-      return false;
-    }
-    catch (std::exception &e) {
-      mResult = false;
-      mErrorMessage = e.what();;
-      constructErrorJson();
+  const unsigned level = reader.selectLevel(getMaxSourceReduction(sourceSize));
+  const cv::Rect region = planDecodeRegion(sourceSize);
 
-      return false;
-    }
+  if (level == 0 && region.size() == sourceSize) {
+    return false;
   }
 
-  //----------------------------------
-  //        Write metadata
-  //----------------------------------
-  if (!mInputTree.empty()) {
-    overrideMeta(mInputTree);
-  }
+  const cv::Size levelSize = reader.getLevelSize(level);
 
-  // Make sure we have image data to work with
-  if (mDecodeImage && mSourceImage.empty()) {
-    mResult = false;
-    mErrorMessage = "Input image data is empty";
-    constructErrorJson();
+  const double sx = (double) levelSize.width / (double) storedSize.width;
+  const double sy = (double) levelSize.height / (double) storedSize.height;
+
+  // Round outwards so the level region covers the whole stored region
+  const cv::Rect stored = Utils::unorientRect(region, storedSize, mOrientation);
 
+  const int x0 = std::max((int) floor(stored.x * sx), 0);
+  const int y0 = std::max((int) floor(stored.y * sy), 0);
+  const int x1 = std::min((int) ceil((stored.x + stored.width) * sx), levelSize.width);
+  const int y1 = std::min((int) ceil((stored.y + stored.height) * sy), levelSize.height);
+
+  if (!reader.read(level, cv::Rect(x0, y0, x1 - x0, y1 - y0), mSourceImage)) {
+    mSourceImage.release();
     return false;
   }
 
-  StringBuffer s;
+  // The part of the source that was read, in full resolution coordinates
+  const int sourceX0 = (int) round(x0 / sx);
+  const int sourceY0 = (int) round(y0 / sy);
 
-#ifdef JSON_PRETTY_OUTPUT
-  PrettyWriter<StringBuffer> writer(s);
-#else
-  Writer<StringBuffer> writer(s);
-#endif
+  cv::Rect covered(sourceX0,
+                   sourceY0,
+                   (int) round(x1 / sx) - sourceX0,
+                   (int) round(y1 / sy) - sourceY0);
 
-  writer.StartObject();
-  if (mDecodeImage) {
-    // Dimensions
-    writer.String("height");
-    writer.Uint(mSourceImage.rows);
+  covered &= cv::Rect(cv::Point(0, 0), storedSize);
 
-    writer.String("width");
-    writer.Uint(mSourceImage.cols);
-  }
+  mSourceSize = sourceSize;
+  mSourceRegion = Utils::orientRect(covered, storedSize, mOrientation);
+  mDecodeScale = (unsigned) round(1.0 / sx);
 
+  return true;
+}
 
-  //----------------------------------
-  //       Execute operations
-  //----------------------------------
-  writer.String("info");
-  writer.StartArray();
+//------------------------------------------------------------------------------
+// Stream large sources when no operation needs the decoded image. Whether
+// the JPEG has a single scan, which streaming needs, is only known once
+// streamImage has read the header
+//------------------------------------------------------------------------------
+bool Arion::planStreaming(const cv::Size &sourceSize) const {
+  // JPEGs can be up to 65535x65535 which overflows cv::Size::area()
+  const unsigned long pixels = (unsigned long) sourceSize.width * (unsigned long) sourceSize.height;
 
-  mTotalOperations = mOperations.size();
+  if (mStreamMinPixels == 0 || pixels <= mStreamMinPixels) {
+    return false;
+  }
 
-  BOOST_FOREACH(Operation & operation, mOperations)
+  BOOST_FOREACH(const Operation &operation, mOperations)
   {
-    try {
+    if (!operation.canStream(sourceSize)) {
+      return false;
+    }
+  }
 
-      operation.setImage(mSourceImage);
+  return true;
+}
 
-      // Give operations meta data if it exists
-      if (mpExifData) {
-        operation.setExifData(mpExifData);
-      }
+//------------------------------------------------------------------------------
+// Decode the JPEG a band of rows at a time and feed each band to a streaming
+// resizer per resize operation, so memory use depends on the output sizes
+// rather than the source. Everything happens in stored (not oriented)
+// coordinates at the decode scale and the small outputs are oriented at the
+// end. Returns false, before any rows are read, when the JPEG can't be
+// streamed in bounded memory, in which case it is decoded the usual way
+//------------------------------------------------------------------------------
+bool Arion::streamImage(const InputBuffer &buffer, const cv::Size &storedSize) {
+  static const int bandHeight = 16;
 
-      if (mpXmpData) {
-        operation.setXmpData(mpXmpData);
-      }
+  const int scale = (int) mDecodeScale;
 
-      if (mpIptcData) {
-        operation.setIptcData(mpIptcData);
-      }
-      if (mpIccProfile) {
-        operation.setIccProfile(mpIccProfile);
-      }
+  // libjpeg rounds scaled dimensions up
+  const cv::Size scaledSize((storedSize.width + scale - 1) / scale,
+                            (storedSize.height + scale - 1) / scale);
 
-      if (!operation.run()) {
-        mFailedOperations++;
-      }
+  const double sx = (double) scaledSize.width / (double) storedSize.width;
+  const double sy = (double) scaledSize.height / (double) storedSize.height;
 
-      operation.serialize(writer);
+  JpegDecoder decoder;
+
+  if (!decoder.open(buffer.data(), buffer.size()) || decoder.hasMultipleScans()) {
+    return false;
+  }
+
+  boost::ptr_vector<StreamResizer> resizers;
+  std::vector<Resize *> resizes;
+  cv::Rect region;
+
+  BOOST_FOREACH(Operation &operation, mOperations)
+  {
+    Resize *resize = dynamic_cast<Resize *>(&operation);
+
+    if (!resize) {
+      continue;
     }
-    catch (std::exception &e) {
-      mFailedOperations++;
-      mErrorMessage = e.what();
-      constructErrorJson();
-      return mResult;
+
+    cv::Rect cropRegion;
+    cv::Size size;
+
+    if (!resize->computeGeometry(mSourceSize, cropRegion, size)) {
+      return false;
     }
+
+    const cv::Rect stored = Utils::unorientRect(cropRegion, storedSize, mOrientation);
+
+    const int x0 = std::min((int) round(stored.x * sx), scaledSize.width - 1);
+    const int y0 = std::min((int) round(stored.y * sy), scaledSize.height - 1);
+    const int x1 = std::min(std::max((int) round((stored.x + stored.width) * sx), x0 + 1), scaledSize.width);
+    const int y1 = std::min(std::max((int) round((stored.y + stored.height) * sy), y0 + 1), scaledSize.height);
+
+    const cv::Rect crop(x0, y0, x1 - x0, y1 - y0);
+
+    resizers.push_back(new StreamResizer(crop, orientSize(size), decoder.getChannels()));
+    resizes.push_back(resize);
+
+    region = (region.area() > 0) ? (region | crop) : crop;
   }
 
-  writer.EndArray();
+  // Nothing needs pixels
+  if (resizers.empty()) {
+    return true;
+  }
 
-  // Result of command (all operations must succeed to get true)
-  if (mFailedOperations == 0) {
-    mResult = true;
-  } else {
-    mResult = false;
+  cv::Rect decodedRegion;
+
+  if (!decoder.start(scale, region, decodedRegion)) {
+    return false;
   }
 
-  writer.String("result");
-  writer.Bool(mResult);
+  cv::Mat band(bandHeight, decodedRegion.width, CV_8UC(decoder.getChannels()));
 
-  // Operation stats
-  writer.String("total_operations");
-  writer.Uint(mTotalOperations);
+  int y = decodedRegion.y;
+  int count = 0;
+
+  while ((count = decoder.readRows(band)) > 0) {
+    const cv::Mat rows = band.rowRange(0, count);
+
+    BOOST_FOREACH(StreamResizer &resizer, resizers)
+    {
+      resizer.push(rows, y, decodedRegion.x);
+    }
+
+    y += count;
+  }
+
+  if (count < 0) {
+    throw extractException;
+  }
+
+  for (size_t i = 0; i < resizers.size(); i++) {
+    cv::Mat image = resizers[i].getImage();
+
+    handleOrientation(mOrientation, image);
+
+    resizes[i]->setResizedImage(image);
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Metadata and copy only jobs never decode the source
+//------------------------------------------------------------------------------
+bool Arion::requiresPixels() const {
+  BOOST_FOREACH(const Operation &operation, mOperations)
+  {
+    if (operation.getRequirements() & OperationRequiresPixels) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// The source can be left in its stored orientation when every operation that
+// reads pixels applies the orientation to its own output
+//------------------------------------------------------------------------------
+bool Arion::planOrientation() const {
+  BOOST_FOREACH(const Operation &operation, mOperations)
+  {
+    if ((operation.getRequirements() & OperationRequiresPixels) && !operation.canApplyOrientation()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// JPEGs can be decoded to planes and resized without going through BGR when
+// every operation works on planes and at least one of them is a resize
+//------------------------------------------------------------------------------
+bool Arion::planPlanes() const {
+  bool resizes = false;
+
+  BOOST_FOREACH(const Operation &operation, mOperations)
+  {
+    if (!operation.canUsePlanes()) {
+      return false;
+    }
+
+    if (dynamic_cast<const Resize *>(&operation)) {
+      resizes = true;
+    }
+  }
+
+  return resizes;
+}
+
+//------------------------------------------------------------------------------
+// Decode the Y, Cb and Cr planes at the decode scale. Each plane is oriented
+// on its own (by the resizes, see planOrientation), which keeps the chroma
+// layout since only 4:2:0 and 4:4:4 are decoded this way
+//------------------------------------------------------------------------------
+bool Arion::decodeJpegPlanes(const InputBuffer &buffer) {
+  JpegDecoder decoder;
+
+  if (!decoder.open(buffer.data(), buffer.size()) ||
+      !decoder.decodePlanes(mDecodeScale, mSourcePlanes)) {
+    mSourcePlanes.clear();
+    return false;
+  }
+
+  if (planOrientation()) {
+    mPendingOrientation = mOrientation;
+  } else {
+    BOOST_FOREACH(cv::Mat &plane, mSourcePlanes)
+    {
+      handleOrientation(mOrientation, plane);
+    }
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Half size decoding is used when every output is at most half the source,
+// cheaper demosaicing when the source is being reduced at all and full AHD
+// demosaicing otherwise
+//------------------------------------------------------------------------------
+int Arion::planRawProfile(const cv::Size &sourceSize) const {
+  const double reduction = getMaxSourceReduction(sourceSize);
+
+  if (reduction >= 2.0) {
+    return RawProfileFast;
+  } else if (reduction > 1.0) {
+    return RawProfileBalanced;
+  }
+
+  return RawProfileFull;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Arion::extractImageData(const string &imageFilePath) {
+  // Map the file (or read it if it can't be mapped) and then extract pixel
+  // and metadata from memory. The buffer is kept for the lifetime of Arion
+  // since Exiv2 reads from it without copying
+  if (!mInputBuffer.open(imageFilePath)) {
+    throw extractException;
+  }
+
+  mFormat = ImageFormat::detect(mInputBuffer.data(), mInputBuffer.size());
+  mGrayscale = ImageFormat::isGrayscale(mInputBuffer.data(), mInputBuffer.size(), mFormat);
+
+  // Metadata is read first since the orientation is needed to plan the decode
+  if (!mIgnoreMetadata) {
+    extractMetadata(mInputBuffer);
+  }
+
+  // Pixels are decoded when the first operation that needs them runs (see
+  // decodeOnDemand). Until then the dimensions come from the header. If it
+  // can't be parsed they are only decoded for jobs that need the pixels
+  // anyway, everything else leaves them out
+  if (mDecodeImage && !readSourceSize(mInputBuffer) && requiresPixels()) {
+    mDecoded = true;
+    decodeImage(mInputBuffer);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Read the source dimensions from the file header. Anything that isn't a
+// JPEG, PNG or WebP may be a RAW (see decodeImage), whose real size only
+// LibRaw knows
+//------------------------------------------------------------------------------
+bool Arion::readSourceSize(const InputBuffer &buffer) {
+  if (mFormat != ImageFormatJpeg && mFormat != ImageFormatPng && mFormat != ImageFormatWebp) {
+    LibRaw libRaw;
+
+    // Opening only parses the header, nothing is unpacked
+    if (libRaw.open_buffer(const_cast<char *>(buffer.data()), buffer.size()) == LIBRAW_SUCCESS) {
+      cv::Size rawSize(libRaw.imgdata.sizes.width, libRaw.imgdata.sizes.height);
+
+      if (libRaw.imgdata.sizes.flip & 4) {
+        rawSize = cv::Size(rawSize.height, rawSize.width);
+      }
+
+      mFormat = ImageFormatRaw;
+      mSourceSize = orientSize(rawSize);
+
+      return true;
+    }
+  }
+
+  unsigned width = 0;
+  unsigned height = 0;
+
+  if (!ImageFormat::readSize(buffer.data(), buffer.size(), mFormat, width, height)) {
+    return false;
+  }
+
+  mSourceSize = orientSize(cv::Size(width, height));
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Decode the source the first time an operation needs its pixels. Returns
+// false, with the reason in mErrorMessage, if there are no pixels to work with
+//------------------------------------------------------------------------------
+bool Arion::decodeOnDemand() {
+  if (!mDecoded && !mInputBuffer.empty()) {
+    mDecoded = true;
+
+    try {
+      decodeImage(mInputBuffer);
+    }
+    catch (boost::exception &e) {
+      mErrorMessage = "Error extracting image";
+      return false;
+    }
+    catch (std::exception &e) {
+      mErrorMessage = e.what();
+      return false;
+    }
+  }
+
+  // Streamed sources never have any, their resizes already hold the output,
+  // and planar sources only have planes
+  if (mSourceImage.empty() && !mStreamed && mSourcePlanes.empty()) {
+    mErrorMessage = "Input image data is empty";
+    return false;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Tasks for the executor (see Arion::run)
+//------------------------------------------------------------------------------
+void Arion::runDecode(bool &decoded) {
+  decoded = decodeOnDemand();
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Arion::runOperation(Operation &operation, unsigned char &succeeded, string &error) {
+  try {
+    succeeded = operation.run();
+  }
+  catch (std::exception &e) {
+    error = e.what();
+
+    if (error.empty()) {
+      error = "Operation failed";
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Operations of a chain run one after another, the later ones reuse the
+// pixels of the first (see Arion::shareOperations)
+//------------------------------------------------------------------------------
+void Arion::runChain(const vector<size_t> &chain, vector<unsigned char> &succeeded, vector<string> &errors) {
+  for (size_t i = 0; i < chain.size(); i++) {
+    runOperation(mOperations[chain[i]], succeeded[chain[i]], errors[chain[i]]);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Group operations that produce identical pixels (the same pipeline key) into
+// chains. Only the first operation of a chain computes the pixels, the others
+// just encode and write them. Every other operation is a chain of its own
+//------------------------------------------------------------------------------
+void Arion::shareOperations(vector<vector<size_t> > &chains) {
+  map<string, size_t> chainOfKey;
+
+  chains.clear();
+
+  for (size_t i = 0; i < mOperations.size(); i++) {
+    const string key = mOperations[i].getPipelineKey();
+    map<string, size_t>::const_iterator found = key.empty() ? chainOfKey.end() : chainOfKey.find(key);
+
+    mOperations[i].setPixelSource(0);
+
+    if (found == chainOfKey.end()) {
+      if (!key.empty()) {
+        chainOfKey[key] = chains.size();
+      }
+
+      chains.push_back(vector<size_t>(1, i));
+      continue;
+    }
+
+    vector<size_t> &chain = chains[found->second];
+
+    mOperations[i].setPixelSource(&mOperations[chain[0]]);
+    chain.push_back(i);
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Arion::decodeImage(const InputBuffer &buffer) {
+  bool decoded = false;
+
+  // JPEG, PNG and WebP go straight to OpenCV. Anything else may be a RAW (most
+  // RAW formats are TIFF containers) so let LibRaw look at it first
+  if (mFormat != ImageFormatJpeg && mFormat != ImageFormatPng && mFormat != ImageFormatWebp) {
+    decoded = openRaw(buffer);
+  }
+
+  // Use the EXIF preview instead of the full image if it is large enough
+  if (!decoded && mUseEmbeddedPreview) {
+    decoded = decodeExifPreview();
+  }
+
+  // Pyramidal and tiled TIFFs only read what the operations need
+  if (!decoded && mFormat == ImageFormatTiff) {
+    decoded = decodeTiff(buffer);
+  }
+
+  if (!decoded) {
+    unsigned width = 0;
+    unsigned height = 0;
+
+    // Only JPEGs can be decoded at a reduced scale (libjpeg does this in the
+    // IDCT) or partially
+    if (mFormat == ImageFormatJpeg &&
+        Utils::readJpegSize((const unsigned char *) buffer.data(), buffer.size(), width, height)) {
+      const cv::Size storedSize(width, height);
+
+      mSourceSize = orientSize(storedSize);
+      mDecodeScale = planDecodeScale(mSourceSize);
+
+      // Large sources are not decoded into memory when they can be streamed
+      if (planStreaming(mSourceSize) && streamImage(buffer, storedSize)) {
+        mStreamed = true;
+        mSourceRegion = cv::Rect(cv::Point(0, 0), mSourceSize);
+
+        return;
+      }
+
+      const cv::Rect region = planDecodeRegion(mSourceSize);
+
+      if (region.size() != mSourceSize) {
+        decoded = decodeJpegRegion(buffer, storedSize, region);
+      } else if (planPlanes() && decodeJpegPlanes(buffer)) {
+        // The resizes read the planes, there is no BGR image
+        mSourceRegion = cv::Rect(cv::Point(0, 0), mSourceSize);
+
+        return;
+      } else {
+        // Baseline JPEGs with restart markers can be decoded on every core
+        RestartJpegDecoder restartDecoder;
+
+        decoded = restartDecoder.open(buffer.data(), buffer.size()) &&
+                  restartDecoder.decode(mDecodeScale, mSourceImage);
+
+        if (decoded) {
+          mRestartSlices = restartDecoder.getSliceCount();
+        }
+      }
+    }
+  }
+
+  if (!decoded) {
+    int flags = mGrayscale ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR;
+
+    switch (mDecodeScale) {
+      case 2: flags = mGrayscale ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_REDUCED_COLOR_2;
+        break;
+      case 4: flags = mGrayscale ? cv::IMREAD_REDUCED_GRAYSCALE_4 : cv::IMREAD_REDUCED_COLOR_4;
+        break;
+      case 8: flags = mGrayscale ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8;
+        break;
+      default:break;
+    }
+
+    // Now actually decode the bytes (wrapped, not copied)
+    cv::Mat buf(1, (int) buffer.size(), CV_8UC1, const_cast<char *>(buffer.data()));
+
+    mSourceImage = cv::imdecode(buf, flags);
+  }
+
+  if (mSourceImage.empty()) {
+    throw extractException;
+  }
+
+  // Rotating the full size source is only needed when some operation can't
+  // orient its own output
+  if (planOrientation()) {
+    mPendingOrientation = mOrientation;
+  } else {
+    handleOrientation(mOrientation, mSourceImage);
+  }
+
+  // Embedded previews and RAWs always decode to color
+  mGrayscale = (mSourceImage.channels() == 1);
+
+  // Unless only a region was decoded the image covers the whole source
+  if (mSourceRegion.area() <= 0) {
+    if (mDecodeScale == 1 && !mEmbeddedPreview) {
+      mSourceSize = (mPendingOrientation == 1) ? mSourceImage.size() : orientSize(mSourceImage.size());
+    }
+
+    mSourceRegion = cv::Rect(cv::Point(0, 0), mSourceSize);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Returns false if LibRaw does not recognize the data
+//------------------------------------------------------------------------------
+bool Arion::openRaw(const InputBuffer &buffer) {
+  LibRaw libRaw;
+
+  // LibRaw only reads from the buffer even though it takes a non-const pointer
+  int status = libRaw.open_buffer(const_cast<char *>(buffer.data()), buffer.size());
+
+  if (status != LIBRAW_SUCCESS) {//only 0 is success
+    return false;
+  }
+
+  mFormat = ImageFormatRaw;
+
+  if (!(mUseEmbeddedPreview && decodeRawPreview(libRaw))) {
+    decodeRaw(libRaw);
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Process the RAW sensor data using the requested (or automatically picked)
+// LibRaw profile
+//------------------------------------------------------------------------------
+void Arion::decodeRaw(LibRaw &libRaw) {
+  // LibRaw flip: 0 - none, 3 - 180 degrees, 5 - 90 CCW, 6 - 90 CW
+  cv::Size rawSize(libRaw.imgdata.sizes.width, libRaw.imgdata.sizes.height);
+
+  if (libRaw.imgdata.sizes.flip & 4) {
+    rawSize = cv::Size(rawSize.height, rawSize.width);
+  }
+
+  mSourceSize = orientSize(rawSize);
+
+  mRawProfileUsed = mRawProfile;
+
+  if (mRawProfileUsed == RawProfileAuto) {
+    mRawProfileUsed = planRawProfile(mSourceSize);
+  }
+
+  libraw_output_params_t &params = libRaw.imgdata.params;
+
+  params.use_camera_wb = 1;
+
+  switch (mRawProfileUsed) {
+    case RawProfileFast:
+      // Each 2x2 bayer block becomes one pixel so no demosaicing is needed
+      params.half_size = 1;
+      mDecodeScale = 2;
+      break;
+
+    case RawProfileBalanced:
+      // PPG demosaicing
+      params.user_qual = 2;
+      break;
+
+    default:
+      // AHD demosaicing
+      params.user_qual = 3;
+      break;
+  }
+
+//   libRaw.imgdata.idata.raw_count; //TODO support multiple images
+  if (libRaw.unpack() != LIBRAW_SUCCESS) {// decode bayer data
+    throw extractException;
+  }
+
+  // white balance, color interpolation, color space conversion,
+  // gamma correction, image rotation
+  if (libRaw.dcraw_process() != LIBRAW_SUCCESS) {
+    throw extractException;
+  }
+
+  int width = 0;
+  int height = 0;
+  int colors = 0;
+  int bps = 0;
+
+  libRaw.get_mem_image_format(&width, &height, &colors, &bps);
+
+  if (bps != 8 || (colors != 1 && colors != 3)) {
+    throw extractException;
+  }
+
+  // LibRaw writes BGR rows straight into the Mat (using its stride) so there
+  // is no intermediate libraw_processed_image_t and no color conversion pass
+  mSourceImage.create(height, width, CV_8UC(colors));
+
+  if (libRaw.copy_mem_image(mSourceImage.data, (int) mSourceImage.step, 1) != LIBRAW_SUCCESS) {
+    throw extractException;
+  }
+
+  // Release LibRaw's working buffers now instead of when it goes out of scope
+  libRaw.recycle();
+}
+
+//------------------------------------------------------------------------------
+// Orientations 5-8 swap width and height
+//------------------------------------------------------------------------------
+cv::Size Arion::orientSize(const cv::Size &size) const {
+  if (mOrientation >= 5 && mOrientation <= 8) {
+    return cv::Size(size.height, size.width);
+  }
+
+  return size;
+}
+
+//------------------------------------------------------------------------------
+// Returns true if a preview of the given (oriented) size is at least as large
+// as what every operation needs from the source
+//------------------------------------------------------------------------------
+bool Arion::previewCovers(const cv::Size &sourceSize, const cv::Size &previewSize) const {
+  if (previewSize.width <= 0 || previewSize.height <= 0) {
+    return false;
+  }
+
+  const double reductionX = (double) sourceSize.width / (double) previewSize.width;
+  const double reductionY = (double) sourceSize.height / (double) previewSize.height;
+
+  BOOST_FOREACH(const Operation &operation, mOperations)
+  {
+    const double reduction = operation.getMaxSourceReduction(sourceSize);
+
+    if (reductionX > reduction || reductionY > reduction) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Decode the thumbnail embedded in a RAW file instead of processing the
+// sensor data. Returns false if there is no usable preview
+//------------------------------------------------------------------------------
+bool Arion::decodeRawPreview(LibRaw &libRaw) {
+  const libraw_thumbnail_t &thumbnail = libRaw.imgdata.thumbnail;
+
+  // LibRaw flip: 0 - none, 3 - 180 degrees, 5 - 90 CCW, 6 - 90 CW
+  const int flip = libRaw.imgdata.sizes.flip;
+
+  cv::Size rawSize(libRaw.imgdata.sizes.width, libRaw.imgdata.sizes.height);
+  cv::Size previewSize(thumbnail.twidth, thumbnail.theight);
+
+  if (flip & 4) {
+    rawSize = cv::Size(rawSize.height, rawSize.width);
+    previewSize = cv::Size(previewSize.height, previewSize.width);
+  }
+
+  // Skip unpacking if the preview dimensions are known to be too small
+  if (previewSize.area() > 0 && !previewCovers(orientSize(rawSize), orientSize(previewSize))) {
+    return false;
+  }
+
+  if (libRaw.unpack_thumb() != LIBRAW_SUCCESS) {
+    return false;
+  }
+
+  cv::Mat preview;
+
+  if (thumbnail.tformat == LIBRAW_THUMBNAIL_JPEG) {
+    cv::Mat data(1, thumbnail.tlength, CV_8UC1, thumbnail.thumb);
+
+    preview = cv::imdecode(data, cv::IMREAD_COLOR);
+  } else if (thumbnail.tformat == LIBRAW_THUMBNAIL_BITMAP && thumbnail.tcolors == 3) {
+    cv::Mat rgb(thumbnail.theight, thumbnail.twidth, CV_8UC3, thumbnail.thumb);
+
+    cv::cvtColor(rgb, preview, CV_RGB2BGR);
+  }
+
+  if (preview.empty()) {
+    return false;
+  }
+
+  // Match the rotation LibRaw applies when processing the full image
+  switch (flip) {
+    case 3: cv::rotate(preview, preview, cv::ROTATE_180);
+      break;
+    case 5: cv::rotate(preview, preview, cv::ROTATE_90_COUNTERCLOCKWISE);
+      break;
+    case 6: cv::rotate(preview, preview, cv::ROTATE_90_CLOCKWISE);
+      break;
+    default:break;
+  }
+
+  // Now check the actual decoded dimensions
+  if (!previewCovers(orientSize(rawSize), orientSize(preview.size()))) {
+    return false;
+  }
+
+  mSourceImage = preview;
+  mSourceSize = orientSize(rawSize);
+  mEmbeddedPreview = true;
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Decode the smallest EXIF preview (as parsed by Exiv2) that is large enough
+// for every operation. Returns false if there is no usable preview
+//------------------------------------------------------------------------------
+bool Arion::decodeExifPreview() {
+  if (mExivImage.get() == 0) {
+    return false;
+  }
+
+  const cv::Size sourceSize(mExivImage->pixelWidth(), mExivImage->pixelHeight());
+
+  if (sourceSize.area() <= 0) {
+    return false;
+  }
+
+  try {
+    Exiv2::PreviewManager previewManager(*mExivImage);
+
+    // Sorted by size, smallest first
+    Exiv2::PreviewPropertiesList properties = previewManager.getPreviewProperties();
+
+    BOOST_FOREACH(const Exiv2::PreviewProperties &property, properties)
+    {
+      const cv::Size previewSize(property.width_, property.height_);
+
+      if (!previewCovers(orientSize(sourceSize), orientSize(previewSize))) {
+        continue;
+      }
+
+      Exiv2::PreviewImage previewImage = previewManager.getPreviewImage(property);
+
+      cv::Mat data(1, (int) previewImage.size(), CV_8UC1, (void *) previewImage.pData());
+
+      cv::Mat preview = cv::imdecode(data, cv::IMREAD_COLOR);
+
+      if (preview.empty()) {
+        continue;
+      }
+
+      mSourceImage = preview;
+      mSourceSize = orientSize(sourceSize);
+      mEmbeddedPreview = true;
+
+      return true;
+    }
+  }
+  catch (Exiv2::AnyError &e) {
+    // Fall back to decoding the full image
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Arion::extractMetadata(const InputBuffer &buffer) {
+  try {
+    mExivImage = Exiv2::ImageFactory::open((const Exiv2::byte *) buffer.data(), (long) buffer.size());
+
+    if (mExivImage.get() != 0) {
+      mExivImage->readMetadata();
+
+      Exiv2::ExifData &exifData = mExivImage->exifData();
+
+      if (!exifData.empty()) {
+        mpExifData = &exifData;
+
+#if DEBUG
+        Utils::exifDebug(exifData);
+#endif
+
+        if (mCorrectOrientation) {
+          mOrientation = readOrientation(exifData);
+        }
+      }
+
+      Exiv2::XmpData &xmpData = mExivImage->xmpData();
+
+      if (!xmpData.empty()) {
+        mpXmpData = &xmpData;
+
+#if DEBUG
+        Utils::xmpDebug(xmpData);
+#endif
+      }
+
+      Exiv2::IptcData &iptcData = mExivImage->iptcData();
+
+      if (!iptcData.empty()) {
+        mpIptcData = &iptcData;
+
+#if DEBUG
+        Utils::iptcDebug(iptcData);
+#endif
+      }
+    }
+  }
+  catch (Exiv2::AnyError &e) {
+    // Not the end of the world if reading EXIF data failed
+  }
+
+  if (mExivImage.get() != 0 && mExivImage->iccProfileDefined()) {
+    mpIccProfile = mExivImage->iccProfile();
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Arion::run() {
+
+  //----------------------------------
+  //        Preprocessing
+  //----------------------------------
+  if (mInputFile.length()) {
+    try {
+      // We have an input file, so lets read it
+      extractImageData(mInputFile);
+    }
+    catch (boost::exception &e) {
+
+      mResult = false;
+      mErrorMessage = "Error extracting image";
+      constructErrorJson();
+
+      return false;
+    }
+    catch (std::exception &e) {
+      mResult = false;
+      mErrorMessage = e.what();;
+      constructErrorJson();
+
+      return false;
+    }
+  }
+
+  //----------------------------------
+  //        Write metadata
+  //----------------------------------
+  if (!mInputTree.empty()) {
+    overrideMeta(mInputTree);
+  }
+
+  StringBuffer s;
+
+#ifdef JSON_PRETTY_OUTPUT
+  PrettyWriter<StringBuffer> writer(s);
+#else
+  Writer<StringBuffer> writer(s);
+#endif
+
+  writer.StartObject();
+
+  // Container format of the input file
+  if (mInputFile.length()) {
+    writer.String("format");
+    writer.String(ImageFormat::name(mFormat));
+  }
+
+  //----------------------------------
+  //       Execute operations
+  //----------------------------------
+  writer.String("info");
+  writer.StartArray();
+
+  mTotalOperations = mOperations.size();
+
+  Executor executor(mThreads ? mThreads : (unsigned) max(cv::getNumThreads(), 1));
+
+  mThreadsUsed = executor.getThreadCount();
+
+  // Every operation sees the same source, so the pixels are decoded (on the
+  // pool, which the restart decoder splits its slices over) before any of
+  // them start
+  if (requiresPixels()) {
+    bool decoded = false;
+
+    executor.run(vector<Executor::Task>(1, boost::bind(&Arion::runDecode, this, boost::ref(decoded))));
+
+    if (!decoded) {
+      mResult = false;
+      constructErrorJson();
+
+      return false;
+    }
+
+    // Level 0 of the pyramid is whatever was decoded
+    if (mPyramid.empty() && !(mSourceImage.empty() && mSourcePlanes.empty())) {
+      mPyramid.setImages(mSourcePlanes.empty() ? std::vector<cv::Mat>(1, mSourceImage) : mSourcePlanes);
+    }
+  }
+
+  // Operations only read the shared inputs, so the chains all run at once
+  // and the results are written in order afterwards
+  vector<vector<size_t> > chains;
+  vector<Executor::Task> tasks;
+  vector<unsigned char> succeeded(mOperations.size(), 0);
+  vector<string> errors(mOperations.size());
+
+  try {
+    for (size_t i = 0; i < mOperations.size(); i++) {
+      Operation &operation = mOperations[i];
+
+      operation.setImage(mSourceImage);
+      operation.setSourceSize(mSourceSize);
+      operation.setSourceRegion(mSourceRegion);
+      operation.setSourcePlanes(mSourcePlanes);
+      operation.setOrientation(mPendingOrientation);
+      operation.setPyramid(&mPyramid);
+
+      if (operation.getRequirements() & OperationRequiresSourceBytes) {
+        operation.setSourceBytes(mInputBuffer.data(), mInputBuffer.size());
+      }
+
+      // Give operations meta data if it exists
+      if (mpExifData) {
+        operation.setExifData(mpExifData);
+      }
+
+      if (mpXmpData) {
+        operation.setXmpData(mpXmpData);
+      }
+
+      if (mpIptcData) {
+        operation.setIptcData(mpIptcData);
+      }
+      if (mpIccProfile) {
+        operation.setIccProfile(mpIccProfile);
+      }
+    }
+
+    shareOperations(chains);
+
+    for (size_t i = 0; i < chains.size(); i++) {
+      tasks.push_back(boost::bind(&Arion::runChain,
+                                  this,
+                                  boost::cref(chains[i]),
+                                  boost::ref(succeeded),
+                                  boost::ref(errors)));
+    }
+
+    executor.run(tasks);
+
+    for (size_t i = 0; i < mOperations.size(); i++) {
+      // The first operation that threw fails the whole job
+      if (!errors[i].empty()) {
+        mFailedOperations++;
+        mErrorMessage = errors[i];
+        constructErrorJson();
+        return mResult;
+      }
+
+      if (!succeeded[i]) {
+        mFailedOperations++;
+      }
+
+      mOperations[i].serialize(writer);
+    }
+  }
+  catch (std::exception &e) {
+    mFailedOperations++;
+    mErrorMessage = e.what();
+    constructErrorJson();
+    return mResult;
+  }
+
+  writer.EndArray();
+
+  // Written after the operations since the pixels are decoded on demand. Left
+  // out when the header couldn't be parsed and nothing was decoded
+  if ((mDecodeImage || mDecoded) && mSourceSize.area() > 0) {
+    // Dimensions
+    writer.String("height");
+    writer.Uint(mSourceSize.height);
+
+    writer.String("width");
+    writer.Uint(mSourceSize.width);
+  }
+
+  if (mDecoded) {
+    // Reduction factor used while decoding (1 means full resolution)
+    writer.String("decode_scale");
+    writer.Uint(mDecodeScale);
+
+    // True if only the part of the source covered by the crops was decoded
+    writer.String("region_decode");
+    writer.Bool(mSourceRegion.size() != mSourceSize);
+
+    // True if the source was streamed through the resizes without decoding
+    // it into memory
+    writer.String("streamed");
+    writer.Bool(mStreamed);
+
+    // Slices a JPEG with restart markers was decoded in on the thread pool
+    // (0 when it was decoded in one go)
+    writer.String("restart_slices");
+    writer.Uint(mRestartSlices);
+
+    // True if a JPEG was resized as Y, Cb and Cr planes without converting
+    // to BGR
+    writer.String("planar");
+    writer.Bool(!mSourcePlanes.empty());
+
+    // True if the source is processed as a single channel
+    writer.String("grayscale");
+    writer.Bool(mGrayscale);
+
+    // True if an embedded preview was decoded instead of the full image
+    writer.String("embedded_preview");
+    writer.Bool(mEmbeddedPreview);
+
+    // LibRaw profile (only for RAW inputs)
+    if (mRawProfileUsed != RawProfileAuto) {
+      static const char *rawProfileNames[] = {"auto", "fast", "balanced", "full"};
+
+      writer.String("raw_profile");
+      writer.String(rawProfileNames[mRawProfileUsed]);
+    }
+  }
+
+  // Result of command (all operations must succeed to get true)
+  if (mFailedOperations == 0) {
+    mResult = true;
+  } else {
+    mResult = false;
+  }
+
+  writer.String("result");
+  writer.Bool(mResult);
+
+  // Operation stats
+  writer.String("total_operations");
+  writer.Uint(mTotalOperations);
 
   writer.String("failed_operations");
   writer.Uint(mFailedOperations);
 
+  // Threads the operations ran on
+  writer.String("threads");
+  writer.Uint(mThreadsUsed);
+
   writer.EndObject();
 
   mJson = s.GetString();
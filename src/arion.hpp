@@ -52,8 +52,34 @@
 
 // Local
 #include "models/operation.hpp"
+#include "utils/input_buffer.hpp"
+#include "imgproc/image_pyramid.hpp"
 #include "carion.h"
 
+// JPEG sources above this many pixels are streamed through the resizes
+// instead of being decoded into memory (see Arion::streamImage). This can be
+// overridden at build time or with the "stream_min_pixels" parameter
+#ifndef ARION_STREAM_MIN_PIXELS
+#define ARION_STREAM_MIN_PIXELS 100000000
+#endif
+
+// Threads a job runs its operations (and their row bands) on. 0 uses as
+// many as OpenCV would, this can also be set with the "threads" parameter
+// (capped to the number of cores). OpenCV's own functions, such as
+// cv::resize, still split their loops over OpenCV's pool, which is process
+// wide and not capped by this
+#ifndef ARION_THREADS
+#define ARION_THREADS 0
+#endif
+
+// LibRaw processing profiles (see Arion::decodeRaw)
+enum {
+  RawProfileAuto = 0,
+  RawProfileFast = 1,
+  RawProfileBalanced = 2,
+  RawProfileFull = 3
+};
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 class Arion {
@@ -70,6 +96,10 @@ class Arion {
   bool setOutputUrl(const std::string &outputUrl);
   void setIgnoreMetadata(bool ignoreMetadata);
   void setDecodeImage(bool decodeImage);
+  void setUseEmbeddedPreview(bool useEmbeddedPreview);
+  void setRawProfile(const std::string &rawProfile);
+  void setStreamMinPixels(unsigned long streamMinPixels);
+  void setThreads(unsigned threads);
   void setCorrectOrientation(bool correctOrientation);
   void addResizeOperation(struct ArionResizeOptions options);
 
@@ -83,9 +113,38 @@ class Arion {
   //--------------------
   //      Helpers
   //--------------------
-  bool handleOrientation(Exiv2::ExifData &exifData, cv::Mat &image);
+  bool handleOrientation(long orientation, cv::Mat &image);
+  long readOrientation(Exiv2::ExifData &exifData) const;
   bool parseOperations(const boost::property_tree::ptree &pt);
   void extractImageData(const std::string &imageFilePath);
+  void extractMetadata(const InputBuffer &buffer);
+  void decodeImage(const InputBuffer &buffer);
+  bool decodeOnDemand();
+  void runDecode(bool &decoded);
+  void runOperation(Operation &operation, unsigned char &succeeded, std::string &error);
+  void runChain(const std::vector<size_t> &chain,
+                std::vector<unsigned char> &succeeded,
+                std::vector<std::string> &errors);
+  void shareOperations(std::vector<std::vector<size_t> > &chains);
+  bool readSourceSize(const InputBuffer &buffer);
+  bool openRaw(const InputBuffer &buffer);
+  void decodeRaw(LibRaw &libRaw);
+  double getMaxSourceReduction(const cv::Size &sourceSize) const;
+  unsigned planDecodeScale(const cv::Size &sourceSize) const;
+  cv::Rect planDecodeRegion(const cv::Size &sourceSize) const;
+  bool decodeJpegRegion(const InputBuffer &buffer, const cv::Size &storedSize, const cv::Rect &region);
+  bool decodeTiff(const InputBuffer &buffer);
+  bool planStreaming(const cv::Size &sourceSize) const;
+  bool streamImage(const InputBuffer &buffer, const cv::Size &storedSize);
+  bool requiresPixels() const;
+  bool planOrientation() const;
+  bool planPlanes() const;
+  bool decodeJpegPlanes(const InputBuffer &buffer);
+  int planRawProfile(const cv::Size &sourceSize) const;
+  bool previewCovers(const cv::Size &sourceSize, const cv::Size &previewSize) const;
+  bool decodeRawPreview(LibRaw &libRaw);
+  bool decodeExifPreview();
+  cv::Size orientSize(const cv::Size &size) const;
   void overrideMeta(const boost::property_tree::ptree &pt);
   void constructErrorJson();
   void parseInputUrl(std::string inputUrl);
@@ -95,10 +154,63 @@ class Arion {
   //--------------------
   boost::property_tree::ptree mInputTree;
   std::string mInputFile;
+  InputBuffer mInputBuffer;
   bool mCorrectOrientation;
   bool mIgnoreMetadata;
   cv::Mat mSourceImage;
 
+  // Full resolution (oriented) dimensions of the source. When decoding at a
+  // reduced scale mSourceImage will be smaller than this
+  cv::Size mSourceSize;
+  unsigned mDecodeScale;
+  long mOrientation;
+
+  // The part of the source (full resolution, oriented) that mSourceImage
+  // covers. Only differs from the whole source when every operation crops
+  cv::Rect mSourceRegion;
+
+  // When set, an embedded preview (RAW thumbnail or EXIF preview) is decoded
+  // instead of the full image if it is large enough for every operation
+  bool mUseEmbeddedPreview;
+  bool mEmbeddedPreview;
+
+  // Requested LibRaw profile and the one that was actually used
+  int mRawProfile;
+  int mRawProfileUsed;
+
+  // Sources larger than this are streamed (0 disables streaming)
+  unsigned long mStreamMinPixels;
+  bool mStreamed;
+
+  // Slices a JPEG with restart markers was decoded in (0 if not sliced)
+  unsigned mRestartSlices;
+
+  // Thread cap of the job (0 for the default) and the count actually used
+  unsigned mThreads;
+  unsigned mThreadsUsed;
+
+  // Detected container format (see codecs/image_format.hpp)
+  int mFormat;
+
+  // Grayscale sources are decoded and processed as a single channel
+  bool mGrayscale;
+
+  // Y, Cb and Cr planes of a JPEG that is only resized to JPEGs. These are
+  // used instead of mSourceImage, which stays empty
+  std::vector<cv::Mat> mSourcePlanes;
+
+  // Set once the pixels have been decoded (or decoding was attempted), which
+  // only happens when an operation that requires them runs
+  bool mDecoded;
+
+  // EXIF orientation not yet applied to mSourceImage (or mSourcePlanes),
+  // which the operations apply to their outputs instead
+  long mPendingOrientation;
+
+  // Reduced copies of the source that resizes cascade from, built the first
+  // time a resize needs one
+  ImagePyramid mPyramid;
+
   typedef boost::ptr_vector <Operation> Operations;
 
   Operations mOperations;
@@ -114,6 +226,8 @@ class Arion {
 
   // The following describe the result of the operations
   bool mResult;
+
+  // Report the source dimensions even when no operation needs pixels
   bool mDecodeImage;
   std::string mErrorMessage;
   unsigned mTotalOperations;
@@ -0,0 +1,307 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./image_format.hpp"
+#include "../utils/utils.hpp"
+
+#include <cstring>
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+namespace ImageFormat {
+
+//------------------------------------------------------------------------------
+// Returns true if data starts with the given signature at offset
+//------------------------------------------------------------------------------
+static bool hasSignature(const unsigned char *data,
+                         size_t length,
+                         size_t offset,
+                         const char *signature,
+                         size_t signatureLength) {
+  if (length < offset + signatureLength) {
+    return false;
+  }
+
+  return memcmp(data + offset, signature, signatureLength) == 0;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static unsigned readTiff16(const unsigned char *p, bool littleEndian) {
+  return littleEndian ? (p[0] | (p[1] << 8)) : ((p[0] << 8) | p[1]);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static unsigned readTiff32(const unsigned char *p, bool littleEndian) {
+  if (littleEndian) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned) p[3] << 24);
+  }
+
+  return ((unsigned) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+//------------------------------------------------------------------------------
+// A DNG is a TIFF with a DNGVersion tag in the first IFD
+//------------------------------------------------------------------------------
+static bool isDng(const unsigned char *data, size_t length) {
+  const bool littleEndian = data[0] == 'I';
+  const size_t ifdOffset = readTiff32(data + 4, littleEndian);
+
+  if (ifdOffset + 2 > length) {
+    return false;
+  }
+
+  const unsigned entries = readTiff16(data + ifdOffset, littleEndian);
+
+  for (unsigned i = 0; i < entries; i++) {
+    const size_t entry = ifdOffset + 2 + i * 12;
+
+    if (entry + 12 > length) {
+      return false;
+    }
+
+    if (readTiff16(data + entry, littleEndian) == 0xC612) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Most camera RAW formats (NEF, ARW, PEF, ...) are plain TIFF containers and
+// are reported as TIFF here. Those that can be told apart by their header
+// are reported as RAW
+//------------------------------------------------------------------------------
+int detect(const char *bytes, size_t length) {
+  const unsigned char *data = reinterpret_cast<const unsigned char *>(bytes);
+
+  if (data == 0 || length < 12) {
+    return ImageFormatUnknown;
+  }
+
+  if (hasSignature(data, length, 0, "\xFF\xD8\xFF", 3)) {
+    return ImageFormatJpeg;
+  }
+
+  if (hasSignature(data, length, 0, "\x89PNG\r\n\x1A\n", 8)) {
+    return ImageFormatPng;
+  }
+
+  if (hasSignature(data, length, 0, "RIFF", 4) && hasSignature(data, length, 8, "WEBP", 4)) {
+    return ImageFormatWebp;
+  }
+
+  // TIFF based RAW variants with their own magic number
+  if (hasSignature(data, length, 0, "IIRO", 4) ||     // Olympus ORF
+      hasSignature(data, length, 0, "IIRS", 4) ||     // Olympus ORF
+      hasSignature(data, length, 0, "MMOR", 4) ||     // Olympus ORF
+      hasSignature(data, length, 0, "IIU\0", 4)) {    // Panasonic RW2
+    return ImageFormatRaw;
+  }
+
+  if (hasSignature(data, length, 0, "II*\0", 4) || hasSignature(data, length, 0, "MM\0*", 4)) {
+    // Canon CR2
+    if (hasSignature(data, length, 8, "CR", 2)) {
+      return ImageFormatRaw;
+    }
+
+    if (isDng(data, length)) {
+      return ImageFormatRaw;
+    }
+
+    return ImageFormatTiff;
+  }
+
+  if (hasSignature(data, length, 0, "FUJIFILMCCD-RAW", 15) ||   // Fuji RAF
+      hasSignature(data, length, 6, "HEAPCCDR", 8) ||           // Canon CRW
+      hasSignature(data, length, 4, "ftypcrx ", 8) ||           // Canon CR3
+      hasSignature(data, length, 0, "\0MRM", 4) ||              // Minolta MRW
+      hasSignature(data, length, 0, "FOVb", 4)) {               // Sigma X3F
+    return ImageFormatRaw;
+  }
+
+  return ImageFormatUnknown;
+}
+
+//------------------------------------------------------------------------------
+// True for single component JPEGs and gray (with or without alpha) PNGs, which
+// can be decoded and processed as one channel
+//------------------------------------------------------------------------------
+bool isGrayscale(const char *bytes, size_t length, int format) {
+  const unsigned char *data = reinterpret_cast<const unsigned char *>(bytes);
+
+  if (format == ImageFormatJpeg) {
+    unsigned width = 0;
+    unsigned height = 0;
+    unsigned components = 0;
+
+    return Utils::readJpegSize(data, length, width, height, &components) && components == 1;
+  }
+
+  if (format == ImageFormatPng) {
+    // The IHDR chunk always comes first, color type 0 is gray and 4 is gray
+    // with alpha
+    if (!hasSignature(data, length, 12, "IHDR", 4) || length < 26) {
+      return false;
+    }
+
+    return data[25] == 0 || data[25] == 4;
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Width and height of the first IFD of a TIFF
+//------------------------------------------------------------------------------
+static bool readTiffSize(const unsigned char *data, size_t length, unsigned &width, unsigned &height) {
+  const bool littleEndian = data[0] == 'I';
+  const size_t ifdOffset = readTiff32(data + 4, littleEndian);
+
+  if (ifdOffset + 2 > length) {
+    return false;
+  }
+
+  const unsigned entries = readTiff16(data + ifdOffset, littleEndian);
+
+  width = 0;
+  height = 0;
+
+  for (unsigned i = 0; i < entries; i++) {
+    const size_t entry = ifdOffset + 2 + i * 12;
+
+    if (entry + 12 > length) {
+      return false;
+    }
+
+    const unsigned tag = readTiff16(data + entry, littleEndian);
+
+    if (tag != 256 && tag != 257) {// ImageWidth, ImageLength
+      continue;
+    }
+
+    // SHORT or LONG
+    const unsigned value = (readTiff16(data + entry + 2, littleEndian) == 3) ?
+                           readTiff16(data + entry + 8, littleEndian) :
+                           readTiff32(data + entry + 8, littleEndian);
+
+    if (tag == 256) {
+      width = value;
+    } else {
+      height = value;
+    }
+  }
+
+  return (width > 0) && (height > 0);
+}
+
+//------------------------------------------------------------------------------
+// Canvas size of a lossy (VP8), lossless (VP8L) or extended (VP8X) WebP
+//------------------------------------------------------------------------------
+static bool readWebpSize(const unsigned char *data, size_t length, unsigned &width, unsigned &height) {
+  if (length < 30) {
+    return false;
+  }
+
+  if (hasSignature(data, length, 12, "VP8 ", 4)) {
+    // Key frame start code followed by 14 bit dimensions
+    if (!hasSignature(data, length, 23, "\x9D\x01\x2A", 3)) {
+      return false;
+    }
+
+    width = (data[26] | (data[27] << 8)) & 0x3FFF;
+    height = (data[28] | (data[29] << 8)) & 0x3FFF;
+  } else if (hasSignature(data, length, 12, "VP8L", 4)) {
+    if (data[20] != 0x2F) {
+      return false;
+    }
+
+    const unsigned bits = data[21] | (data[22] << 8) | (data[23] << 16) | ((unsigned) data[24] << 24);
+
+    width = (bits & 0x3FFF) + 1;
+    height = ((bits >> 14) & 0x3FFF) + 1;
+  } else if (hasSignature(data, length, 12, "VP8X", 4)) {
+    width = (data[24] | (data[25] << 8) | (data[26] << 16)) + 1;
+    height = (data[27] | (data[28] << 8) | (data[29] << 16)) + 1;
+  } else {
+    return false;
+  }
+
+  return (width > 0) && (height > 0);
+}
+
+//------------------------------------------------------------------------------
+// Read the stored (not oriented) dimensions from the file header without
+// decoding anything. RAWs are not handled since their first IFD is usually a
+// thumbnail
+//------------------------------------------------------------------------------
+bool readSize(const char *bytes, size_t length, int format, unsigned &width, unsigned &height) {
+  const unsigned char *data = reinterpret_cast<const unsigned char *>(bytes);
+
+  switch (format) {
+    case ImageFormatJpeg:return Utils::readJpegSize(data, length, width, height);
+
+    case ImageFormatPng:
+      if (!hasSignature(data, length, 12, "IHDR", 4) || length < 24) {
+        return false;
+      }
+
+      width = ((unsigned) data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+      height = ((unsigned) data[20] << 24) | (data[21] << 16) | (data[22] << 8) | data[23];
+
+      return (width > 0) && (height > 0);
+
+    case ImageFormatTiff:return readTiffSize(data, length, width, height);
+
+    case ImageFormatWebp:return readWebpSize(data, length, width, height);
+
+    default:return false;
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+const char *name(int format) {
+  switch (format) {
+    case ImageFormatJpeg:return "jpeg";
+    case ImageFormatPng:return "png";
+    case ImageFormatTiff:return "tiff";
+    case ImageFormatWebp:return "webp";
+    case ImageFormatRaw:return "raw";
+    default:return "unknown";
+  }
+}
+
+}
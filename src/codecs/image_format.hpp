@@ -0,0 +1,61 @@
+#ifndef IMAGE_FORMAT_HPP
+#define IMAGE_FORMAT_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <cstddef>
+
+enum {
+  ImageFormatUnknown = 0,
+  ImageFormatJpeg = 1,
+  ImageFormatPng = 2,
+  ImageFormatTiff = 3,
+  ImageFormatWebp = 4,
+  ImageFormatRaw = 5
+};
+
+//------------------------------------------------------------------------------
+// Container detection from the leading bytes of a file (magic numbers) so
+// each input can be routed straight to the decoder that handles it
+//------------------------------------------------------------------------------
+namespace ImageFormat {
+
+int detect(const char *data, size_t length);
+const char *name(int format);
+bool isGrayscale(const char *data, size_t length, int format);
+bool readSize(const char *data, size_t length, int format, unsigned &width, unsigned &height);
+
+}
+
+#endif // IMAGE_FORMAT_HPP
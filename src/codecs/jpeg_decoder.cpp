@@ -0,0 +1,340 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./jpeg_decoder.hpp"
+
+using namespace cv;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+JpegDecoder::JpegDecoder() :
+    mpData(0),
+    mLength(0),
+    mCreated(false),
+    mOpen(false),
+    mLastRow(0) {
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+JpegDecoder::~JpegDecoder() {
+  close();
+}
+
+//------------------------------------------------------------------------------
+// libjpeg calls this on fatal errors and must not return, so jump back to
+// the method that made the call
+//------------------------------------------------------------------------------
+void JpegDecoder::errorExit(j_common_ptr info) {
+  ErrorManager *error = reinterpret_cast<ErrorManager *>(info->err);
+
+  longjmp(error->jump, 1);
+}
+
+//------------------------------------------------------------------------------
+// Read the JPEG header. Returns false if the data is not a decodable JPEG
+//------------------------------------------------------------------------------
+bool JpegDecoder::open(const char *data, size_t length) {
+  close();
+
+  mpData = data;
+  mLength = length;
+
+  mInfo.err = jpeg_std_error(&mError.pub);
+  mError.pub.error_exit = errorExit;
+
+  if (setjmp(mError.jump)) {
+    close();
+    return false;
+  }
+
+  jpeg_create_decompress(&mInfo);
+  mCreated = true;
+
+  jpeg_mem_src(&mInfo, (unsigned char *) mpData, (unsigned long) mLength);
+
+  if (jpeg_read_header(&mInfo, TRUE) != JPEG_HEADER_OK) {
+    close();
+    return false;
+  }
+
+  mOpen = true;
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void JpegDecoder::close() {
+  if (mCreated) {
+    jpeg_destroy_decompress(&mInfo);
+    mCreated = false;
+  }
+
+  mOpen = false;
+}
+
+//------------------------------------------------------------------------------
+// Full resolution size as stored in the file (no orientation applied)
+//------------------------------------------------------------------------------
+Size JpegDecoder::getSize() const {
+  if (!mOpen) {
+    return Size();
+  }
+
+  return Size(mInfo.image_width, mInfo.image_height);
+}
+
+//------------------------------------------------------------------------------
+// Grayscale JPEGs decode to a single channel, everything else to BGR
+//------------------------------------------------------------------------------
+int JpegDecoder::getChannels() const {
+  if (mOpen && mInfo.jpeg_color_space == JCS_GRAYSCALE) {
+    return 1;
+  }
+
+  return 3;
+}
+
+//------------------------------------------------------------------------------
+// Progressive and non-interleaved JPEGs are spread over several scans, for
+// which libjpeg buffers the coefficients of the whole image. The same test
+// libjpeg makes once it has read the first scan header (see open)
+//------------------------------------------------------------------------------
+bool JpegDecoder::hasMultipleScans() const {
+  return mOpen && (mInfo.progressive_mode || mInfo.comps_in_scan < mInfo.num_components);
+}
+
+//------------------------------------------------------------------------------
+// Warnings libjpeg reported since open(), such as corrupt or truncated data
+// that it decoded anyway
+//------------------------------------------------------------------------------
+long JpegDecoder::getWarningCount() const {
+  return mError.pub.num_warnings;
+}
+
+//------------------------------------------------------------------------------
+// Decode a region of the image at 1/scale (1, 2, 4 or 8) into BGR (or
+// grayscale, see getChannels) pixels. The
+// region is given in scaled coordinates. See start() for how the region
+// actually decoded (returned in decodedRegion) can differ
+//------------------------------------------------------------------------------
+bool JpegDecoder::decode(unsigned scale, const Rect &region, Mat &image, Rect &decodedRegion) {
+  if (!start(scale, region, decodedRegion)) {
+    return false;
+  }
+
+  image.create(decodedRegion.height, decodedRegion.width, CV_8UC(getChannels()));
+
+  if (readRows(image) != decodedRegion.height) {
+    return false;
+  }
+
+  // The rows below the region are not needed
+  close();
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Start decoding a region of the image at 1/scale. libjpeg can only crop
+// columns at iMCU boundaries so the region actually decoded may be wider than
+// requested. Rows above the region are skipped without running the IDCT and
+// rows below it are never read
+//------------------------------------------------------------------------------
+bool JpegDecoder::start(unsigned scale, const Rect &region, Rect &decodedRegion) {
+  if (!mOpen) {
+    return false;
+  }
+
+  if (setjmp(mError.jump)) {
+    close();
+    return false;
+  }
+
+  mInfo.scale_num = 1;
+  mInfo.scale_denom = scale;
+
+  // Same output as cv::imdecode so regions match a full decode
+  mInfo.out_color_space = (getChannels() == 1) ? JCS_GRAYSCALE : JCS_EXT_BGR;
+
+  jpeg_start_decompress(&mInfo);
+
+  const Rect bounded = region & Rect(0, 0, mInfo.output_width, mInfo.output_height);
+
+  if (bounded.area() <= 0) {
+    close();
+    return false;
+  }
+
+  JDIMENSION xOffset = bounded.x;
+  JDIMENSION width = bounded.width;
+
+  if (width < mInfo.output_width) {
+    jpeg_crop_scanline(&mInfo, &xOffset, &width);
+  }
+
+  if (bounded.y > 0) {
+    jpeg_skip_scanlines(&mInfo, bounded.y);
+  }
+
+  mLastRow = bounded.y + bounded.height;
+
+  decodedRegion = Rect(xOffset, bounded.y, width, bounded.height);
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Read the next band of rows of the region into rows, which must have
+// getChannels() channels and be as wide as the decoded region. Returns the number of rows read (0 once
+// the region is finished) or -1 on error
+//------------------------------------------------------------------------------
+int JpegDecoder::readRows(Mat &rows) {
+  if (!mOpen) {
+    return -1;
+  }
+
+  if (setjmp(mError.jump)) {
+    close();
+    return -1;
+  }
+
+  int count = 0;
+
+  while (count < rows.rows && mInfo.output_scanline < mLastRow) {
+    JSAMPROW row = rows.ptr(count);
+
+    count += jpeg_read_scanlines(&mInfo, &row, 1);
+  }
+
+  return count;
+}
+
+//------------------------------------------------------------------------------
+// Planes can be decoded for YCbCr JPEGs that are 4:2:0 or 4:4:4 since both
+// keep the same chroma layout when the image is rotated
+//------------------------------------------------------------------------------
+bool JpegDecoder::canDecodePlanes() const {
+  if (!mOpen || mInfo.jpeg_color_space != JCS_YCbCr || mInfo.num_components != 3) {
+    return false;
+  }
+
+  const jpeg_component_info *components = mInfo.comp_info;
+
+  for (int c = 1; c < 3; c++) {
+    if (components[c].h_samp_factor != 1 || components[c].v_samp_factor != 1) {
+      return false;
+    }
+  }
+
+  return (components[0].h_samp_factor == components[0].v_samp_factor) &&
+         (components[0].h_samp_factor == 1 || components[0].h_samp_factor == 2);
+}
+
+//------------------------------------------------------------------------------
+// Decode the whole image at 1/scale into its Y, Cb and Cr planes without
+// upsampling the chroma or converting to BGR. The chroma planes may be
+// smaller than the luma plane (libjpeg-turbo can also scale them up in the
+// IDCT, in which case they are the same size)
+//------------------------------------------------------------------------------
+bool JpegDecoder::decodePlanes(unsigned scale, std::vector<Mat> &planes) {
+  if (!canDecodePlanes()) {
+    return false;
+  }
+
+  std::vector<Mat> buffers(3);
+
+  if (setjmp(mError.jump)) {
+    close();
+    return false;
+  }
+
+  mInfo.scale_num = 1;
+  mInfo.scale_denom = scale;
+  mInfo.raw_data_out = TRUE;
+
+  jpeg_start_decompress(&mInfo);
+
+#if JPEG_LIB_VERSION >= 70
+  const int blockRows = mInfo.min_DCT_v_scaled_size;
+#else
+  const int blockRows = mInfo.min_DCT_scaled_size;
+#endif
+
+  JSAMPROW rows[3][MAX_SAMP_FACTOR * DCTSIZE];
+  JSAMPARRAY components[3] = {rows[0], rows[1], rows[2]};
+  int rowsPerIMCU[3];
+
+  // Whole blocks are written so the buffers are padded to the block size
+  for (int c = 0; c < 3; c++) {
+    const jpeg_component_info &component = mInfo.comp_info[c];
+
+#if JPEG_LIB_VERSION >= 70
+    const int blockWidth = component.DCT_h_scaled_size;
+    const int blockHeight = component.DCT_v_scaled_size;
+#else
+    const int blockWidth = component.DCT_scaled_size;
+    const int blockHeight = component.DCT_scaled_size;
+#endif
+
+    rowsPerIMCU[c] = component.v_samp_factor * blockHeight;
+
+    buffers[c].create(mInfo.total_iMCU_rows * rowsPerIMCU[c], component.width_in_blocks * blockWidth, CV_8UC1);
+  }
+
+  for (unsigned row = 0; row < mInfo.total_iMCU_rows; row++) {
+    for (int c = 0; c < 3; c++) {
+      for (int i = 0; i < rowsPerIMCU[c]; i++) {
+        rows[c][i] = buffers[c].ptr(row * rowsPerIMCU[c] + i);
+      }
+    }
+
+    if (jpeg_read_raw_data(&mInfo, components, mInfo.max_v_samp_factor * blockRows) == 0) {
+      close();
+      return false;
+    }
+  }
+
+  planes.resize(3);
+
+  for (int c = 0; c < 3; c++) {
+    const jpeg_component_info &component = mInfo.comp_info[c];
+
+    planes[c] = buffers[c](Rect(0, 0, component.downsampled_width, component.downsampled_height));
+  }
+
+  close();
+
+  return true;
+}
@@ -0,0 +1,102 @@
+#ifndef JPEG_DECODER_HPP
+#define JPEG_DECODER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdio>
+#include <csetjmp>
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// libjpeg-turbo
+#include <jpeglib.h>
+
+//------------------------------------------------------------------------------
+// Direct libjpeg-turbo decoding for the cases cv::imdecode can't handle, such
+// as decoding only a region of the image or streaming it a band of rows at a
+// time, or decoding straight to Y, Cb and Cr planes. Each decode (decode(),
+// decodePlanes() or start() followed by readRows()) needs a preceding call to
+// open()
+//------------------------------------------------------------------------------
+class JpegDecoder : boost::noncopyable {
+ public:
+
+  JpegDecoder();
+  ~JpegDecoder();
+
+  bool open(const char *data, size_t length);
+  void close();
+
+  cv::Size getSize() const;
+  int getChannels() const;
+  long getWarningCount() const;
+  bool hasMultipleScans() const;
+
+  bool decode(unsigned scale, const cv::Rect &region, cv::Mat &image, cv::Rect &decodedRegion);
+
+  bool start(unsigned scale, const cv::Rect &region, cv::Rect &decodedRegion);
+  int readRows(cv::Mat &rows);
+
+  bool canDecodePlanes() const;
+  bool decodePlanes(unsigned scale, std::vector<cv::Mat> &planes);
+
+ private:
+
+  struct ErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+  };
+
+  static void errorExit(j_common_ptr info);
+
+  struct jpeg_decompress_struct mInfo;
+  ErrorManager mError;
+
+  const char *mpData;
+  size_t mLength;
+  bool mCreated;
+  bool mOpen;
+
+  // Last row (exclusive) of the region being decoded
+  unsigned mLastRow;
+
+};
+
+#endif // JPEG_DECODER_HPP
@@ -0,0 +1,261 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./jpeg_encoder.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csetjmp>
+#include <algorithm>
+
+// libjpeg-turbo
+#include <jpeglib.h>
+
+using namespace cv;
+
+namespace {
+
+struct ErrorManager {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+//------------------------------------------------------------------------------
+// libjpeg calls this on fatal errors and must not return
+//------------------------------------------------------------------------------
+void errorExit(j_common_ptr info) {
+  ErrorManager *error = reinterpret_cast<ErrorManager *>(info->err);
+
+  longjmp(error->jump, 1);
+}
+
+}
+
+//------------------------------------------------------------------------------
+// Encode 8 bit Y, Cb and Cr planes into a JPEG with the same settings as the
+// OpenCV encoder. libjpeg reads raw data an iMCU row at a time from rows
+// padded to whole blocks, so each band is copied into a padded buffer with
+// the edge pixels replicated
+//------------------------------------------------------------------------------
+bool JpegEncoder::encodePlanes(const std::vector<Mat> &planes,
+                               unsigned quality,
+                               bool progressive,
+                               std::vector<unsigned char> &data) {
+  if (planes.size() != 3 || planes[0].empty() || planes[0].type() != CV_8UC1) {
+    return false;
+  }
+
+  const Size chromaSize((planes[0].cols + 1) / 2, (planes[0].rows + 1) / 2);
+
+  for (size_t c = 1; c < planes.size(); c++) {
+    if (planes[c].size() != chromaSize || planes[c].type() != CV_8UC1) {
+      return false;
+    }
+  }
+
+  struct jpeg_compress_struct info;
+  ErrorManager error;
+  unsigned char *buffer = 0;
+  unsigned long size = 0;
+  std::vector<Mat> bands(planes.size());
+
+  info.err = jpeg_std_error(&error.pub);
+  error.pub.error_exit = errorExit;
+
+  if (setjmp(error.jump)) {
+    jpeg_destroy_compress(&info);
+    free(buffer);
+    return false;
+  }
+
+  jpeg_create_compress(&info);
+  jpeg_mem_dest(&info, &buffer, &size);
+
+  info.image_width = planes[0].cols;
+  info.image_height = planes[0].rows;
+  info.input_components = 3;
+  info.in_color_space = JCS_YCbCr;
+
+  jpeg_set_defaults(&info);
+  jpeg_set_quality(&info, quality, TRUE);
+
+  if (progressive) {
+    jpeg_simple_progression(&info);
+  }
+
+  // 4:2:0, which is also the libjpeg default
+  info.comp_info[0].h_samp_factor = 2;
+  info.comp_info[0].v_samp_factor = 2;
+  info.comp_info[1].h_samp_factor = 1;
+  info.comp_info[1].v_samp_factor = 1;
+  info.comp_info[2].h_samp_factor = 1;
+  info.comp_info[2].v_samp_factor = 1;
+
+  info.raw_data_in = TRUE;
+
+  jpeg_start_compress(&info, TRUE);
+
+  JSAMPROW rows[3][MAX_SAMP_FACTOR * DCTSIZE];
+  JSAMPARRAY components[3] = {rows[0], rows[1], rows[2]};
+
+  for (size_t c = 0; c < planes.size(); c++) {
+    const jpeg_component_info &component = info.comp_info[c];
+
+    bands[c].create(component.v_samp_factor * DCTSIZE, component.width_in_blocks * DCTSIZE, CV_8UC1);
+  }
+
+  const int bandRows = info.max_v_samp_factor * DCTSIZE;
+
+  while (info.next_scanline < info.image_height) {
+    for (size_t c = 0; c < planes.size(); c++) {
+      const Mat &plane = planes[c];
+      Mat &band = bands[c];
+
+      const int y0 = info.next_scanline * info.comp_info[c].v_samp_factor / info.max_v_samp_factor;
+
+      for (int i = 0; i < band.rows; i++) {
+        const unsigned char *source = plane.ptr(std::min(y0 + i, plane.rows - 1));
+        unsigned char *destination = band.ptr(i);
+
+        memcpy(destination, source, plane.cols);
+        memset(destination + plane.cols, source[plane.cols - 1], band.cols - plane.cols);
+
+        rows[c][i] = destination;
+      }
+    }
+
+    jpeg_write_raw_data(&info, components, bandRows);
+  }
+
+  jpeg_finish_compress(&info);
+
+  data.assign(buffer, buffer + size);
+
+  jpeg_destroy_compress(&info);
+  free(buffer);
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Encode an 8 bit BGR (or grayscale) image of the given size with the same
+// settings as the OpenCV encoder, asking source for bandRows rows at a time
+//------------------------------------------------------------------------------
+bool JpegEncoder::encodeRows(const Size &size,
+                             int channels,
+                             int bandRows,
+                             const RowSource &source,
+                             unsigned quality,
+                             bool progressive,
+                             std::vector<unsigned char> &data) {
+  if (size.width <= 0 || size.height <= 0 || (channels != 1 && channels != 3) || bandRows <= 0) {
+    return false;
+  }
+
+  struct jpeg_compress_struct info;
+  ErrorManager error;
+  unsigned char *buffer = 0;
+  unsigned long length = 0;
+  Mat band;
+  Mat rows;
+  std::vector<JSAMPROW> pointers(bandRows);
+
+  info.err = jpeg_std_error(&error.pub);
+  error.pub.error_exit = errorExit;
+
+  if (setjmp(error.jump)) {
+    jpeg_destroy_compress(&info);
+    free(buffer);
+    return false;
+  }
+
+  jpeg_create_compress(&info);
+  jpeg_mem_dest(&info, &buffer, &length);
+
+  info.image_width = size.width;
+  info.image_height = size.height;
+  info.input_components = channels;
+  info.in_color_space = (channels == 1) ? JCS_GRAYSCALE : JCS_EXT_BGR;
+
+  jpeg_set_defaults(&info);
+  jpeg_set_quality(&info, quality, TRUE);
+
+  if (progressive) {
+    jpeg_simple_progression(&info);
+  }
+
+  jpeg_start_compress(&info, TRUE);
+
+  band.create(bandRows, size.width, CV_8UC(channels));
+
+  while (info.next_scanline < info.image_height) {
+    const int firstRow = info.next_scanline;
+    const int count = std::min(bandRows, size.height - firstRow);
+    bool filled = false;
+
+    rows = band.rowRange(0, count);
+
+    try {
+      filled = source(firstRow, rows);
+    }
+    catch (...) {
+      filled = false;
+    }
+
+    if (!filled) {
+      jpeg_destroy_compress(&info);
+      free(buffer);
+      return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+      pointers[i] = rows.ptr(i);
+    }
+
+    int written = 0;
+
+    while (written < count) {
+      written += jpeg_write_scanlines(&info, &pointers[written], count - written);
+    }
+  }
+
+  jpeg_finish_compress(&info);
+
+  data.assign(buffer, buffer + length);
+
+  jpeg_destroy_compress(&info);
+  free(buffer);
+
+  return true;
+}
@@ -0,0 +1,74 @@
+#ifndef JPEG_ENCODER_HPP
+#define JPEG_ENCODER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <cstddef>
+#include <vector>
+
+// Boost
+#include <boost/function.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+//------------------------------------------------------------------------------
+// Direct libjpeg-turbo encoding. encodePlanes takes Y, Cb and Cr planes (raw
+// data input), so a JPEG that was decoded to planes never goes through BGR.
+// The luma plane sets the image size and the chroma planes must be half its
+// size rounded up (4:2:0). encodeRows takes BGR (or grayscale) rows a band
+// at a time from a callback, so the image never has to exist as a whole
+//------------------------------------------------------------------------------
+namespace JpegEncoder {
+
+// Fills rows (already allocated, with as many rows as requested) with the
+// image rows starting at the given row. Returns false to abort the encode
+typedef boost::function<bool (int firstRow, cv::Mat &rows)> RowSource;
+
+bool encodePlanes(const std::vector<cv::Mat> &planes,
+                  unsigned quality,
+                  bool progressive,
+                  std::vector<unsigned char> &data);
+
+bool encodeRows(const cv::Size &size,
+                int channels,
+                int bandRows,
+                const RowSource &source,
+                unsigned quality,
+                bool progressive,
+                std::vector<unsigned char> &data);
+
+}
+
+#endif // JPEG_ENCODER_HPP
@@ -0,0 +1,373 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./restart_jpeg_decoder.hpp"
+#include "./jpeg_decoder.hpp"
+#include "../utils/executor.hpp"
+
+#include <algorithm>
+
+// OpenCV
+#include <opencv2/core/utility.hpp>
+
+using namespace cv;
+using namespace std;
+
+// Slices smaller than this many restart steps aren't worth a thread
+#define RESTART_JPEG_MIN_SLICE_STEPS 4
+
+//------------------------------------------------------------------------------
+// Decodes a range of slices into their rows of the output image
+//------------------------------------------------------------------------------
+class RestartSliceBody : public ParallelLoopBody {
+ public:
+
+  RestartSliceBody(const RestartJpegDecoder &decoder,
+                   const vector<int> &bounds,
+                   int rowStep,
+                   int mcuRows,
+                   int mcuHeight,
+                   unsigned scale,
+                   Mat &image,
+                   vector<unsigned char> &failed) :
+      mDecoder(decoder),
+      mBounds(bounds),
+      mRowStep(rowStep),
+      mMcuRows(mcuRows),
+      mMcuHeight(mcuHeight),
+      mScale(scale),
+      mImage(image),
+      mFailed(failed) {
+  }
+
+  virtual void operator()(const Range &range) const;
+
+ private:
+
+  const RestartJpegDecoder &mDecoder;
+  const vector<int> &mBounds;
+  int mRowStep;
+  int mMcuRows;
+  int mMcuHeight;
+  unsigned mScale;
+  Mat &mImage;
+
+  // One flag per slice so threads never write to the same location
+  vector<unsigned char> &mFailed;
+
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+RestartJpegDecoder::RestartJpegDecoder() :
+    mpData(0),
+    mLength(0),
+    mChannels(3),
+    mHeightOffset(0),
+    mScanOffset(0),
+    mMcuHeight(0),
+    mMcuRows(0),
+    mMcusPerRow(0),
+    mRestartInterval(0),
+    mRowStep(0) {
+}
+
+//------------------------------------------------------------------------------
+// Parse the JPEG structure. Returns false if the image can't be split, in
+// which case it should be decoded the usual way: not baseline, more than one
+// scan, no restart markers or restarts that don't line up with MCU rows
+//------------------------------------------------------------------------------
+bool RestartJpegDecoder::open(const char *data, size_t length) {
+  mpData = (const unsigned char *) data;
+  mLength = length;
+  mRestartInterval = 0;
+  mHeightOffset = 0;
+  mIntervals.clear();
+
+  if (length < 4 || mpData[0] != 0xFF || mpData[1] != 0xD8) {
+    return false;
+  }
+
+  int components = 0;
+  int maxH = 1;
+  int maxV = 1;
+
+  size_t pos = 2;
+
+  while (pos + 4 <= length) {
+    if (mpData[pos] != 0xFF) {
+      return false;
+    }
+
+    const unsigned char marker = mpData[pos + 1];
+
+    if (marker == 0xFF) {
+      pos++;
+      continue;
+    }
+
+    const size_t segmentLength = (mpData[pos + 2] << 8) | mpData[pos + 3];
+
+    if (pos + 2 + segmentLength > length) {
+      return false;
+    }
+
+    const unsigned char *segment = mpData + pos + 4;
+
+    // Baseline and extended sequential Huffman only
+    if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      return false;
+    }
+
+    if (marker == 0xC0 || marker == 0xC1) {
+      mHeightOffset = pos + 5;
+      mSize.height = (segment[1] << 8) | segment[2];
+      mSize.width = (segment[3] << 8) | segment[4];
+      components = segment[5];
+
+      for (int i = 0; i < components; i++) {
+        const unsigned char sampling = segment[6 + i * 3 + 1];
+
+        maxH = max(maxH, sampling >> 4);
+        maxV = max(maxV, sampling & 0x0F);
+      }
+    } else if (marker == 0xDD) {
+      mRestartInterval = (segment[0] << 8) | segment[1];
+    } else if (marker == 0xDA) {
+      // The scan has to contain every component (interleaved)
+      if (mHeightOffset == 0 || segment[0] != components) {
+        return false;
+      }
+
+      mScanOffset = pos + 2 + segmentLength;
+      break;
+    }
+
+    pos += 2 + segmentLength;
+  }
+
+  if (mScanOffset == 0 || mRestartInterval == 0 || mSize.height == 0 || mSize.width == 0) {
+    return false;
+  }
+
+  // Grayscale stays single channel (see JpegDecoder::getChannels)
+  mChannels = (components == 1) ? 1 : 3;
+
+  // A single component scan is not interleaved, its MCU is one block
+  const int mcuWidth = (components == 1) ? 8 : 8 * maxH;
+  mMcuHeight = (components == 1) ? 8 : 8 * maxV;
+
+  mMcusPerRow = (mSize.width + mcuWidth - 1) / mcuWidth;
+  mMcuRows = (mSize.height + mMcuHeight - 1) / mMcuHeight;
+
+  // Restarts have to fall at the start of MCU rows
+  if (mRestartInterval % mMcusPerRow == 0) {
+    mRowStep = mRestartInterval / mMcusPerRow;
+  } else if (mMcusPerRow % mRestartInterval == 0) {
+    mRowStep = 1;
+  } else {
+    return false;
+  }
+
+  return parseScan(mScanOffset);
+}
+
+//------------------------------------------------------------------------------
+// Find where each restart interval starts in the entropy coded data
+//------------------------------------------------------------------------------
+bool RestartJpegDecoder::parseScan(size_t start) {
+  mIntervals.push_back(start);
+
+  size_t pos = start;
+
+  while (pos + 1 < mLength) {
+    if (mpData[pos] != 0xFF) {
+      pos++;
+      continue;
+    }
+
+    const unsigned char marker = mpData[pos + 1];
+
+    if (marker == 0x00) {
+      // Stuffed zero byte
+      pos += 2;
+    } else if (marker == 0xFF) {
+      // Fill byte
+      pos++;
+    } else if (marker >= 0xD0 && marker <= 0xD7) {
+      mIntervals.push_back(pos + 2);
+      pos += 2;
+    } else if (marker == 0xD9) {
+      mIntervals.push_back(pos);
+      break;
+    } else {
+      // Anything else (another scan, DNL) isn't supported
+      return false;
+    }
+  }
+
+  const long totalMcus = (long) mMcusPerRow * mMcuRows;
+  const size_t expected = (size_t) ((totalMcus + mRestartInterval - 1) / mRestartInterval);
+
+  // The intervals plus the end of the scan
+  return mIntervals.size() == expected + 1;
+}
+
+//------------------------------------------------------------------------------
+// Build a standalone JPEG holding MCU rows [firstRow, lastRow)
+//------------------------------------------------------------------------------
+void RestartJpegDecoder::buildSlice(int firstRow, int lastRow, vector<char> &slice) const {
+  // The last MCU row may end part way into a restart step, so the interval
+  // that holds it is rounded up
+  const size_t firstInterval = (size_t) firstRow * mMcusPerRow / mRestartInterval;
+  const size_t lastInterval = ((size_t) lastRow * mMcusPerRow + mRestartInterval - 1) / mRestartInterval;
+
+  const size_t start = mIntervals[firstInterval];
+
+  // Stop before the restart marker that ends the last interval
+  const size_t end = (lastInterval + 1 < mIntervals.size()) ? mIntervals[lastInterval] - 2 : mIntervals.back();
+
+  const int height = min(mSize.height - firstRow * mMcuHeight, (lastRow - firstRow) * mMcuHeight);
+
+  slice.clear();
+  slice.reserve(mScanOffset + (end - start) + 2);
+  slice.insert(slice.end(), mpData, mpData + mScanOffset);
+  slice.insert(slice.end(), mpData + start, mpData + end);
+
+  slice[mHeightOffset] = (char) ((height >> 8) & 0xFF);
+  slice[mHeightOffset + 1] = (char) (height & 0xFF);
+
+  // libjpeg expects restart markers to count up from RST0
+  unsigned restart = 0;
+
+  for (size_t i = mScanOffset; i + 1 < slice.size(); i++) {
+    const unsigned char byte = (unsigned char) slice[i];
+    const unsigned char marker = (unsigned char) slice[i + 1];
+
+    if (byte != 0xFF) {
+      continue;
+    }
+
+    if (marker >= 0xD0 && marker <= 0xD7) {
+      slice[i + 1] = (char) (0xD0 + (restart++ & 7));
+      i++;
+    } else if (marker == 0x00) {
+      i++;
+    }
+  }
+
+  slice.push_back((char) 0xFF);
+  slice.push_back((char) 0xD9);
+}
+
+//------------------------------------------------------------------------------
+// Number of slices decode() splits the image into, one per thread but at
+// least two so the same path runs on a single core (where the overlapping
+// restart rows are the only cost). Less than 2 means decode() won't split it
+//------------------------------------------------------------------------------
+int RestartJpegDecoder::getSliceCount() const {
+  if (mIntervals.empty()) {
+    return 0;
+  }
+
+  const int steps = (mMcuRows + mRowStep - 1) / mRowStep;
+
+  return min(max(Executor::getNumThreads(), 2), steps / RESTART_JPEG_MIN_SLICE_STEPS);
+}
+
+//------------------------------------------------------------------------------
+// Decode at 1/scale into BGR (or grayscale), one slice per thread. Returns
+// false if it is not worth splitting the image or any slice fails
+//------------------------------------------------------------------------------
+bool RestartJpegDecoder::decode(unsigned scale, Mat &image) const {
+  const int slices = getSliceCount();
+
+  if (slices < 2) {
+    return false;
+  }
+
+  // Slice boundaries in MCU rows, on restart aligned rows
+  vector<int> bounds;
+
+  const int steps = (mMcuRows + mRowStep - 1) / mRowStep;
+
+  for (int i = 0; i < slices; i++) {
+    bounds.push_back((int) ((long) steps * i / slices) * mRowStep);
+  }
+
+  bounds.push_back(mMcuRows);
+
+  image.create((mSize.height + scale - 1) / scale, (mSize.width + scale - 1) / scale, CV_8UC(mChannels));
+
+  vector<unsigned char> failed(slices, 0);
+
+  Executor::parallelFor(Range(0, slices),
+                        RestartSliceBody(*this, bounds, mRowStep, mMcuRows, mMcuHeight, scale, image, failed));
+
+  return find(failed.begin(), failed.end(), 1) == failed.end();
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void RestartSliceBody::operator()(const Range &range) const {
+  for (int i = range.start; i < range.end; i++) {
+    const int firstRow = mBounds[i];
+    const int lastRow = mBounds[i + 1];
+
+    // Decode one restart step beyond each inner edge of the slice
+    const int top = max(firstRow - mRowStep, 0);
+    const int bottom = min(lastRow + mRowStep, mMcuRows);
+
+    vector<char> slice;
+    mDecoder.buildSlice(top, bottom, slice);
+
+    // Rows of this slice at the decode scale
+    const int y0 = firstRow * mMcuHeight / (int) mScale;
+    const int y1 = (lastRow == mMcuRows) ? mImage.rows : lastRow * mMcuHeight / (int) mScale;
+    const int skip = (firstRow - top) * mMcuHeight / (int) mScale;
+
+    Mat rows = mImage.rowRange(y0, y1);
+    Rect decodedRegion;
+
+    JpegDecoder decoder;
+
+    // libjpeg only warns about truncated data and fills in gray, which
+    // would mean a slice was cut wrong
+    if (!decoder.open(&slice[0], slice.size()) ||
+        !decoder.decode(mScale, Rect(0, skip, mImage.cols, y1 - y0), rows, decodedRegion) ||
+        rows.data != mImage.ptr(y0) ||
+        decoder.getWarningCount() > 0) {
+      mFailed[i] = 1;
+    }
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef RESTART_JPEG_DECODER_HPP
+#define RESTART_JPEG_DECODER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <cstddef>
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+//------------------------------------------------------------------------------
+// Decodes baseline JPEGs that contain restart markers on several threads.
+// Restart markers reset the entropy decoder, so the scan is cut at restart
+// boundaries that fall on MCU row starts and every slice is decoded as a
+// JPEG of its own (header copied, height patched, markers renumbered).
+// Slices overlap by one restart row so chroma upsampling at their edges sees
+// the same neighbours as a single threaded decode
+//------------------------------------------------------------------------------
+class RestartJpegDecoder : boost::noncopyable {
+ public:
+
+  RestartJpegDecoder();
+
+  bool open(const char *data, size_t length);
+
+  int getSliceCount() const;
+
+  bool decode(unsigned scale, cv::Mat &image) const;
+
+ private:
+
+  friend class RestartSliceBody;
+
+  bool parseScan(size_t start);
+  void buildSlice(int firstRow, int lastRow, std::vector<char> &slice) const;
+
+  const unsigned char *mpData;
+  size_t mLength;
+
+  cv::Size mSize;
+  int mChannels;
+
+  // Byte offset of the frame height in the SOF segment and of the first
+  // byte after the SOS header
+  size_t mHeightOffset;
+  size_t mScanOffset;
+
+  int mMcuHeight;
+  int mMcuRows;
+  int mMcusPerRow;
+  int mRestartInterval;
+
+  // MCU rows per restart aligned step (slices start on multiples of this)
+  int mRowStep;
+
+  // Offset of the first entropy coded byte of every restart interval, plus
+  // the offset of the marker that ends the scan
+  std::vector<size_t> mIntervals;
+
+};
+
+#endif // RESTART_JPEG_DECODER_HPP
@@ -0,0 +1,422 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./tiff_reader.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace cv;
+using namespace std;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+TiffReader::TiffReader() :
+    mpTiff(0),
+    mpData(0),
+    mLength(0),
+    mPosition(0) {
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+TiffReader::~TiffReader() {
+  close();
+}
+
+//------------------------------------------------------------------------------
+// Open the TIFF and enumerate its pyramid. Returns false if libtiff can't
+// read it or if the image has an orientation other than top-left (libtiff's
+// RGBA interface would apply part of it on its own)
+//------------------------------------------------------------------------------
+bool TiffReader::open(const char *data, size_t length) {
+  close();
+
+  mpData = data;
+  mLength = length;
+  mPosition = 0;
+
+  // Keep libtiff from printing to the console (it would break the JSON)
+  TIFFSetErrorHandler(0);
+  TIFFSetWarningHandler(0);
+
+  mpTiff = TIFFClientOpen("memory", "r", (thandle_t) this,
+                          readProc, writeProc, seekProc, closeProc,
+                          sizeProc, mapProc, unmapProc);
+
+  if (!mpTiff) {
+    return false;
+  }
+
+  uint16 orientation = ORIENTATION_TOPLEFT;
+
+  if (TIFFGetField(mpTiff, TIFFTAG_ORIENTATION, &orientation) && orientation != ORIENTATION_TOPLEFT) {
+    close();
+    return false;
+  }
+
+  // SubIFD offsets have to be copied before changing directory
+  vector<toff_t> subIfds;
+  uint16 subIfdCount = 0;
+  toff_t *subIfdOffsets = 0;
+
+  if (TIFFGetField(mpTiff, TIFFTAG_SUBIFD, &subIfdCount, &subIfdOffsets)) {
+    subIfds.assign(subIfdOffsets, subIfdOffsets + subIfdCount);
+  }
+
+  // The main image and any reduced resolution subfiles that follow it
+  do {
+    const tdir_t directory = TIFFCurrentDirectory(mpTiff);
+    uint32 subfileType = 0;
+
+    TIFFGetField(mpTiff, TIFFTAG_SUBFILETYPE, &subfileType);
+
+    if (directory == 0 || (subfileType & FILETYPE_REDUCEDIMAGE)) {
+      addLevel(directory, 0);
+    }
+  } while (TIFFReadDirectory(mpTiff));
+
+  for (size_t i = 0; i < subIfds.size(); i++) {
+    if (TIFFSetSubDirectory(mpTiff, subIfds[i])) {
+      addLevel(0, subIfds[i]);
+    }
+  }
+
+  if (mLevels.empty()) {
+    close();
+    return false;
+  }
+
+  // Levels have to match the aspect ratio of the full image (this drops
+  // thumbnails and masks)
+  const Level base = mLevels[0];
+  const double aspect = (double) base.size.width / (double) base.size.height;
+
+  vector<Level> levels(1, base);
+
+  for (size_t i = 1; i < mLevels.size(); i++) {
+    const Size &size = mLevels[i].size;
+    const double levelAspect = (double) size.width / (double) size.height;
+
+    if (size.width <= base.size.width && fabs(levelAspect - aspect) / aspect < 0.02) {
+      levels.push_back(mLevels[i]);
+    }
+  }
+
+  sort(levels.begin(), levels.end(), compareLevels);
+
+  mLevels = levels;
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void TiffReader::close() {
+  if (mpTiff) {
+    TIFFClose(mpTiff);
+    mpTiff = 0;
+  }
+
+  mLevels.clear();
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+unsigned TiffReader::getLevelCount() const {
+  return mLevels.size();
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+Size TiffReader::getLevelSize(unsigned level) const {
+  if (level >= mLevels.size()) {
+    return Size();
+  }
+
+  return mLevels[level].size;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool TiffReader::isTiled(unsigned level) const {
+  return (level < mLevels.size()) && mLevels[level].tiled;
+}
+
+//------------------------------------------------------------------------------
+// The smallest level that is reduced by no more than maxReduction (in both
+// dimensions) relative to level 0
+//------------------------------------------------------------------------------
+unsigned TiffReader::selectLevel(double maxReduction) const {
+  unsigned selected = 0;
+
+  for (unsigned i = 1; i < mLevels.size(); i++) {
+    const double reductionX = (double) mLevels[0].size.width / (double) mLevels[i].size.width;
+    const double reductionY = (double) mLevels[0].size.height / (double) mLevels[i].size.height;
+
+    if (max(reductionX, reductionY) <= maxReduction) {
+      selected = i;
+    }
+  }
+
+  return selected;
+}
+
+//------------------------------------------------------------------------------
+// Read a region (in the coordinates of the level) into BGR pixels
+//------------------------------------------------------------------------------
+bool TiffReader::read(unsigned level, const Rect &region, Mat &image) {
+  if (!mpTiff || level >= mLevels.size()) {
+    return false;
+  }
+
+  const Level &selected = mLevels[level];
+  const Rect bounded = region & Rect(Point(0, 0), selected.size);
+
+  if (bounded.area() <= 0 || !setLevel(selected)) {
+    return false;
+  }
+
+  image.create(bounded.height, bounded.width, CV_8UC3);
+
+  if (selected.tiled) {
+    return readTiles(selected, bounded, image);
+  }
+
+  return readStrips(selected, bounded, image);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool TiffReader::compareLevels(const Level &a, const Level &b) {
+  return a.size.width > b.size.width;
+}
+
+//------------------------------------------------------------------------------
+// Record the current directory as a level
+//------------------------------------------------------------------------------
+bool TiffReader::addLevel(tdir_t directory, toff_t subIfdOffset) {
+  Level level;
+  uint32 width = 0;
+  uint32 height = 0;
+
+  if (!TIFFGetField(mpTiff, TIFFTAG_IMAGEWIDTH, &width) ||
+      !TIFFGetField(mpTiff, TIFFTAG_IMAGELENGTH, &height) ||
+      width == 0 || height == 0) {
+    return false;
+  }
+
+  level.directory = directory;
+  level.subIfdOffset = subIfdOffset;
+  level.size = Size(width, height);
+  level.tiled = TIFFIsTiled(mpTiff) != 0;
+  level.rowsPerStrip = height;
+
+  if (level.tiled) {
+    uint32 tileWidth = 0;
+    uint32 tileHeight = 0;
+
+    TIFFGetField(mpTiff, TIFFTAG_TILEWIDTH, &tileWidth);
+    TIFFGetField(mpTiff, TIFFTAG_TILELENGTH, &tileHeight);
+
+    if (tileWidth == 0 || tileHeight == 0) {
+      return false;
+    }
+
+    level.tileSize = Size(tileWidth, tileHeight);
+  } else {
+    TIFFGetFieldDefaulted(mpTiff, TIFFTAG_ROWSPERSTRIP, &level.rowsPerStrip);
+    level.rowsPerStrip = min(max(level.rowsPerStrip, (uint32) 1), height);
+  }
+
+  mLevels.push_back(level);
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool TiffReader::setLevel(const Level &level) {
+  if (level.subIfdOffset) {
+    return TIFFSetSubDirectory(mpTiff, level.subIfdOffset) != 0;
+  }
+
+  return TIFFSetDirectory(mpTiff, level.directory) != 0;
+}
+
+//------------------------------------------------------------------------------
+// libtiff's RGBA tiles are stored bottom-up with the image rows at the top of
+// the tile, even for partial tiles at the edges
+//------------------------------------------------------------------------------
+bool TiffReader::readTiles(const Level &level, const Rect &region, Mat &image) {
+  const int tileWidth = level.tileSize.width;
+  const int tileHeight = level.tileSize.height;
+
+  vector<uint32> raster((size_t) tileWidth * tileHeight);
+
+  const int firstY = (region.y / tileHeight) * tileHeight;
+  const int firstX = (region.x / tileWidth) * tileWidth;
+
+  for (int ty = firstY; ty < region.y + region.height; ty += tileHeight) {
+    for (int tx = firstX; tx < region.x + region.width; tx += tileWidth) {
+      if (!TIFFReadRGBATile(mpTiff, tx, ty, &raster[0])) {
+        return false;
+      }
+
+      const Rect tile = Rect(tx, ty, tileWidth, tileHeight) & region;
+
+      for (int y = tile.y; y < tile.y + tile.height; y++) {
+        const uint32 *src = &raster[(size_t) (tileHeight - 1 - (y - ty)) * tileWidth + (tile.x - tx)];
+        unsigned char *dst = image.ptr(y - region.y) + (tile.x - region.x) * 3;
+
+        for (int x = 0; x < tile.width; x++) {
+          dst[x * 3] = TIFFGetB(src[x]);
+          dst[x * 3 + 1] = TIFFGetG(src[x]);
+          dst[x * 3 + 2] = TIFFGetR(src[x]);
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Strips span the whole width so only rows can be skipped
+//------------------------------------------------------------------------------
+bool TiffReader::readStrips(const Level &level, const Rect &region, Mat &image) {
+  const int width = level.size.width;
+  const int rowsPerStrip = (int) level.rowsPerStrip;
+
+  vector<uint32> raster((size_t) width * rowsPerStrip);
+
+  const int firstRow = (region.y / rowsPerStrip) * rowsPerStrip;
+
+  for (int row = firstRow; row < region.y + region.height; row += rowsPerStrip) {
+    if (!TIFFReadRGBAStrip(mpTiff, row, &raster[0])) {
+      return false;
+    }
+
+    // A strip holds this many rows bottom-up
+    const int rows = min(rowsPerStrip, level.size.height - row);
+
+    const int y0 = max(row, region.y);
+    const int y1 = min(row + rows, region.y + region.height);
+
+    for (int y = y0; y < y1; y++) {
+      const uint32 *src = &raster[(size_t) (rows - 1 - (y - row)) * width + region.x];
+      unsigned char *dst = image.ptr(y - region.y);
+
+      for (int x = 0; x < region.width; x++) {
+        dst[x * 3] = TIFFGetB(src[x]);
+        dst[x * 3 + 1] = TIFFGetG(src[x]);
+        dst[x * 3 + 2] = TIFFGetR(src[x]);
+      }
+    }
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// libtiff client callbacks over the in-memory buffer
+//------------------------------------------------------------------------------
+tmsize_t TiffReader::readProc(thandle_t handle, void *buffer, tmsize_t size) {
+  TiffReader *reader = (TiffReader *) handle;
+
+  if (reader->mPosition >= reader->mLength) {
+    return 0;
+  }
+
+  const tmsize_t count = (tmsize_t) min((toff_t) size, (toff_t) reader->mLength - reader->mPosition);
+
+  memcpy(buffer, reader->mpData + reader->mPosition, count);
+  reader->mPosition += count;
+
+  return count;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+tmsize_t TiffReader::writeProc(thandle_t handle, void *buffer, tmsize_t size) {
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+toff_t TiffReader::seekProc(thandle_t handle, toff_t offset, int whence) {
+  TiffReader *reader = (TiffReader *) handle;
+
+  switch (whence) {
+    case SEEK_SET: reader->mPosition = offset;
+      break;
+    case SEEK_CUR: reader->mPosition += offset;
+      break;
+    case SEEK_END: reader->mPosition = reader->mLength + offset;
+      break;
+    default:break;
+  }
+
+  return reader->mPosition;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+int TiffReader::closeProc(thandle_t handle) {
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+toff_t TiffReader::sizeProc(thandle_t handle) {
+  return ((TiffReader *) handle)->mLength;
+}
+
+//------------------------------------------------------------------------------
+// The buffer is already in memory (usually mapped) so hand it to libtiff
+// directly instead of having it copy every tile
+//------------------------------------------------------------------------------
+int TiffReader::mapProc(thandle_t handle, void **base, toff_t *size) {
+  TiffReader *reader = (TiffReader *) handle;
+
+  *base = (void *) reader->mpData;
+  *size = reader->mLength;
+
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void TiffReader::unmapProc(thandle_t handle, void *base, toff_t size) {
+}
@@ -0,0 +1,108 @@
+#ifndef TIFF_READER_HPP
+#define TIFF_READER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <cstddef>
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// libtiff
+#include <tiffio.h>
+
+//------------------------------------------------------------------------------
+// Reads TIFFs from memory with libtiff. Pyramids stored either as reduced
+// resolution subfiles or as SubIFDs of the main image are enumerated as
+// levels (level 0 is the full resolution image) and only the tiles or strips
+// that intersect the requested region are read
+//------------------------------------------------------------------------------
+class TiffReader : boost::noncopyable {
+ public:
+
+  TiffReader();
+  ~TiffReader();
+
+  bool open(const char *data, size_t length);
+  void close();
+
+  unsigned getLevelCount() const;
+  cv::Size getLevelSize(unsigned level) const;
+  bool isTiled(unsigned level) const;
+
+  unsigned selectLevel(double maxReduction) const;
+
+  bool read(unsigned level, const cv::Rect &region, cv::Mat &image);
+
+ private:
+
+  struct Level {
+    tdir_t directory;
+    toff_t subIfdOffset;
+    cv::Size size;
+    bool tiled;
+    cv::Size tileSize;
+    uint32 rowsPerStrip;
+  };
+
+  static bool compareLevels(const Level &a, const Level &b);
+
+  bool addLevel(tdir_t directory, toff_t subIfdOffset);
+  bool setLevel(const Level &level);
+  bool readTiles(const Level &level, const cv::Rect &region, cv::Mat &image);
+  bool readStrips(const Level &level, const cv::Rect &region, cv::Mat &image);
+
+  static tmsize_t readProc(thandle_t handle, void *buffer, tmsize_t size);
+  static tmsize_t writeProc(thandle_t handle, void *buffer, tmsize_t size);
+  static toff_t seekProc(thandle_t handle, toff_t offset, int whence);
+  static int closeProc(thandle_t handle);
+  static toff_t sizeProc(thandle_t handle);
+  static int mapProc(thandle_t handle, void **base, toff_t *size);
+  static void unmapProc(thandle_t handle, void *base, toff_t size);
+
+  TIFF *mpTiff;
+  const char *mpData;
+  size_t mLength;
+  toff_t mPosition;
+
+  // Sorted from the largest (level 0) to the smallest
+  std::vector<Level> mLevels;
+
+};
+
+#endif // TIFF_READER_HPP
@@ -0,0 +1,415 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./box_blur.hpp"
+#include "../utils/executor.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// OpenCV
+#include <opencv2/core/utility.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BOX_BLUR_X86 1
+#endif
+
+using namespace cv;
+using namespace std;
+
+// Number of box blurs, three is within a few percent of a Gaussian
+#define BOX_BLUR_PASSES 3
+
+// Bands smaller than this many rows aren't worth a thread
+#define BOX_BLUR_MIN_BAND_ROWS 64
+
+namespace {
+
+//------------------------------------------------------------------------------
+// Reflect an index into [0, length) without repeating the edge sample, the
+// same as OpenCV's default border
+//------------------------------------------------------------------------------
+int reflect(int i, int length) {
+  if (length == 1) {
+    return 0;
+  }
+
+  while (i < 0 || i >= length) {
+    if (i < 0) {
+      i = -i;
+    }
+
+    if (i >= length) {
+      i = 2 * (length - 1) - i;
+    }
+  }
+
+  return i;
+}
+
+//------------------------------------------------------------------------------
+// Radius of each box. The boxes are one of two odd widths, picked so that
+// the variances of the passes add up to sigma squared
+//------------------------------------------------------------------------------
+vector<int> boxRadii(double sigma) {
+  const double variance = 12.0 * sigma * sigma;
+  const int passes = BOX_BLUR_PASSES;
+
+  int lower = (int) floor(sqrt(variance / passes + 1.0));
+
+  if (lower % 2 == 0) {
+    lower--;
+  }
+
+  const int upper = lower + 2;
+
+  // Number of passes that use the lower width
+  const int lowerPasses = (int) lround((variance - passes * lower * lower - 4.0 * passes * lower - 3.0 * passes) /
+                                       (-4.0 * lower - 4.0));
+
+  vector<int> radii;
+
+  for (int i = 0; i < passes; i++) {
+    radii.push_back(((i < lowerPasses) ? lower : upper) / 2);
+  }
+
+  return radii;
+}
+
+//------------------------------------------------------------------------------
+// Rows of a source of the given height that a box of this radius reads to
+// produce rows [first, last)
+//------------------------------------------------------------------------------
+Range rowsRead(int first, int last, int radius, int height) {
+  Range range(height, 0);
+
+  for (int y = first - radius; y < last + radius; y++) {
+    const int row = reflect(y, height);
+
+    range.start = min(range.start, row);
+    range.end = max(range.end, row + 1);
+  }
+
+  return range;
+}
+
+//------------------------------------------------------------------------------
+// One output row of a running box sum: output the average of the current
+// window, then slide it by adding one row and removing another, starting at
+// element start. The vector kernels below must give exactly the same result
+//------------------------------------------------------------------------------
+void boxRow(int *sums,
+            const unsigned char *add,
+            const unsigned char *remove,
+            float scale,
+            int start,
+            int length,
+            unsigned char *output) {
+  for (int x = start; x < length; x++) {
+    output[x] = (unsigned char) min(max((int) lrintf((float) sums[x] * scale), 0), 255);
+    sums[x] += add[x] - remove[x];
+  }
+}
+
+#ifdef BOX_BLUR_X86
+
+//------------------------------------------------------------------------------
+// 8 elements at a time. Returns the number of elements done
+//------------------------------------------------------------------------------
+__attribute__((target("sse2")))
+int boxRowSse2(int *sums, const unsigned char *add, const unsigned char *remove, float scale, int length,
+               unsigned char *output) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 scales = _mm_set1_ps(scale);
+
+  int x = 0;
+
+  for (; x + 8 <= length; x += 8) {
+    __m128i sum0 = _mm_loadu_si128((const __m128i *) (sums + x));
+    __m128i sum1 = _mm_loadu_si128((const __m128i *) (sums + x + 4));
+
+    // Rounds to nearest like lrintf
+    const __m128i average0 = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum0), scales));
+    const __m128i average1 = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum1), scales));
+    const __m128i averages = _mm_packs_epi32(average0, average1);
+
+    _mm_storel_epi64((__m128i *) (output + x), _mm_packus_epi16(averages, averages));
+
+    const __m128i added = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (add + x)), zero);
+    const __m128i removed = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (remove + x)), zero);
+    const __m128i delta = _mm_sub_epi16(added, removed);
+
+    // Sign extend the differences to 32 bits
+    const __m128i sign = _mm_srai_epi16(delta, 15);
+
+    sum0 = _mm_add_epi32(sum0, _mm_unpacklo_epi16(delta, sign));
+    sum1 = _mm_add_epi32(sum1, _mm_unpackhi_epi16(delta, sign));
+
+    _mm_storeu_si128((__m128i *) (sums + x), sum0);
+    _mm_storeu_si128((__m128i *) (sums + x + 4), sum1);
+  }
+
+  return x;
+}
+
+//------------------------------------------------------------------------------
+// Same as the SSE2 kernel 16 elements at a time
+//------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+int boxRowAvx2(int *sums, const unsigned char *add, const unsigned char *remove, float scale, int length,
+               unsigned char *output) {
+  const __m256 scales = _mm256_set1_ps(scale);
+
+  int x = 0;
+
+  for (; x + 16 <= length; x += 16) {
+    __m256i sum0 = _mm256_loadu_si256((const __m256i *) (sums + x));
+    __m256i sum1 = _mm256_loadu_si256((const __m256i *) (sums + x + 8));
+
+    const __m256i average0 = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(sum0), scales));
+    const __m256i average1 = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(sum1), scales));
+
+    // Pack each half on its own so the bytes come out in order
+    const __m128i averages0 = _mm_packs_epi32(_mm256_castsi256_si128(average0),
+                                              _mm256_extracti128_si256(average0, 1));
+    const __m128i averages1 = _mm_packs_epi32(_mm256_castsi256_si128(average1),
+                                              _mm256_extracti128_si256(average1, 1));
+
+    _mm_storeu_si128((__m128i *) (output + x), _mm_packus_epi16(averages0, averages1));
+
+    const __m256i added0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (add + x)));
+    const __m256i added1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (add + x + 8)));
+    const __m256i removed0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (remove + x)));
+    const __m256i removed1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (remove + x + 8)));
+
+    sum0 = _mm256_add_epi32(sum0, _mm256_sub_epi32(added0, removed0));
+    sum1 = _mm256_add_epi32(sum1, _mm256_sub_epi32(added1, removed1));
+
+    _mm256_storeu_si256((__m256i *) (sums + x), sum0);
+    _mm256_storeu_si256((__m256i *) (sums + x + 8), sum1);
+  }
+
+  return x;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Run the widest kernel the CPU supports. Returns the number of elements
+// done, the rest is left to boxRow
+//------------------------------------------------------------------------------
+int boxRowVector(int *sums, const unsigned char *add, const unsigned char *remove, float scale, int length,
+                 unsigned char *output) {
+#ifdef BOX_BLUR_X86
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  static const bool sse2 = __builtin_cpu_supports("sse2");
+
+  if (avx2) {
+    return boxRowAvx2(sums, add, remove, scale, length, output);
+  }
+
+  if (sse2) {
+    return boxRowSse2(sums, add, remove, scale, length, output);
+  }
+#endif
+
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Box blur the columns of an image of the given height into output rows
+// [first, first + count). source only holds the rows from sourceFirst, which
+// must include every row the box reads (see rowsRead)
+//------------------------------------------------------------------------------
+void boxColumns(const Mat &source, int sourceFirst, int height, int radius, int first, int count, Mat &output) {
+  output.create(count, source.cols, source.type());
+
+  if (radius == 0) {
+    source.rowRange(first - sourceFirst, first - sourceFirst + count).copyTo(output);
+    return;
+  }
+
+  const int length = source.cols * source.channels();
+  const float scale = 1.0f / (float) (2 * radius + 1);
+
+  vector<int> sums(length, 0);
+
+  for (int k = -radius; k <= radius; k++) {
+    const unsigned char *row = source.ptr(reflect(first + k, height) - sourceFirst);
+
+    for (int x = 0; x < length; x++) {
+      sums[x] += row[x];
+    }
+  }
+
+  for (int y = first; y < first + count; y++) {
+    const unsigned char *remove = source.ptr(reflect(y - radius, height) - sourceFirst);
+
+    // The window doesn't slide past the last row
+    const unsigned char *add = (y + 1 < first + count) ?
+                               source.ptr(reflect(y + radius + 1, height) - sourceFirst) : remove;
+
+    unsigned char *row = output.ptr(y - first);
+
+    const int done = boxRowVector(sums.data(), add, remove, scale, length, row);
+
+    boxRow(sums.data(), add, remove, scale, done, length, row);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Blurs the columns of a range of bands. Each band runs all the passes on
+// its own, starting from just the rows of the source it needs, so bands
+// don't depend on each other
+//------------------------------------------------------------------------------
+class BoxBandBody : public ParallelLoopBody {
+ public:
+
+  BoxBandBody(const Mat &source, const vector<int> &radii, int bands, Mat &output) :
+      mSource(source),
+      mRadii(radii),
+      mBands(bands),
+      mOutput(output) {
+  }
+
+  virtual void operator()(const Range &range) const;
+
+ private:
+
+  const Mat &mSource;
+  const vector<int> &mRadii;
+  int mBands;
+  Mat &mOutput;
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void BoxBandBody::operator()(const Range &range) const {
+  const int height = mSource.rows;
+  const int passes = (int) mRadii.size();
+
+  for (int i = range.start; i < range.end; i++) {
+    const int first = (int) ((long) height * i / mBands);
+    const int last = (int) ((long) height * (i + 1) / mBands);
+
+    // Rows each pass has to produce, working back from the last one
+    vector<Range> ranges(passes + 1);
+    ranges[passes] = Range(first, last);
+
+    for (int pass = passes - 1; pass >= 0; pass--) {
+      ranges[pass] = rowsRead(ranges[pass + 1].start, ranges[pass + 1].end, mRadii[pass], height);
+    }
+
+    Mat input = mSource.rowRange(ranges[0].start, ranges[0].end);
+
+    for (int pass = 0; pass < passes; pass++) {
+      Mat blurred;
+
+      if (pass + 1 == passes) {
+        blurred = mOutput.rowRange(first, last);
+      }
+
+      boxColumns(input, ranges[pass].start, height, mRadii[pass],
+                 ranges[pass + 1].start, ranges[pass + 1].size(), blurred);
+
+      input = blurred;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void blurColumns(const Mat &source, Mat &output, const vector<int> &radii) {
+  output.create(source.size(), source.type());
+
+  const int bands = max(min(Executor::getNumThreads(), source.rows / BOX_BLUR_MIN_BAND_ROWS), 1);
+
+  Executor::parallelFor(Range(0, bands), BoxBandBody(source, radii, bands, output));
+}
+
+}
+
+//------------------------------------------------------------------------------
+// Number of pixels on each side of a pixel that contribute to it
+//------------------------------------------------------------------------------
+int BoxBlur::radius(double sigma) {
+  const vector<int> radii = boxRadii(sigma);
+
+  int total = 0;
+
+  for (size_t i = 0; i < radii.size(); i++) {
+    total += radii[i];
+  }
+
+  return total;
+}
+
+//------------------------------------------------------------------------------
+// Blur like GaussianBlur with the given sigma (and a kernel size picked from
+// it). The columns are blurred first, then the rows through a transpose.
+// Like GaussianBlur, a submatrix (such as a crop) is blurred with the pixels
+// of its parent image around it and only the parent's borders are reflected
+//------------------------------------------------------------------------------
+void BoxBlur::gaussian(const Mat &source, Mat &output, double sigma) {
+  const vector<int> radii = boxRadii(sigma);
+  const int reach = radius(sigma);
+
+  Size parentSize;
+  Point offset;
+  source.locateROI(parentSize, offset);
+
+  // Just the pixels of the parent that reach the submatrix
+  const int top = min(offset.y, reach);
+  const int bottom = min(parentSize.height - offset.y - source.rows, reach);
+  const int left = min(offset.x, reach);
+  const int right = min(parentSize.width - offset.x - source.cols, reach);
+
+  Mat padded = source;
+  padded.adjustROI(top, bottom, left, right);
+
+  Mat columns;
+  blurColumns(padded, columns, radii);
+
+  Mat transposed;
+  transpose(columns, transposed);
+
+  Mat rows;
+  blurColumns(transposed, rows, radii);
+
+  Mat blurred;
+  transpose(rows, blurred);
+
+  output = blurred(Rect(left, top, source.cols, source.rows));
+}
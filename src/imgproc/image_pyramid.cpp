@@ -0,0 +1,115 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./image_pyramid.hpp"
+
+// OpenCV
+#include <opencv2/imgproc.hpp>
+
+using namespace cv;
+using namespace std;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+ImagePyramid::ImagePyramid() {
+}
+
+//------------------------------------------------------------------------------
+// The images become level 0 (they are shared, not copied)
+//------------------------------------------------------------------------------
+void ImagePyramid::setImages(const vector<Mat> &images) {
+  lock_guard<mutex> lock(mMutex);
+
+  mLevels.assign(1, images);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void ImagePyramid::clear() {
+  lock_guard<mutex> lock(mMutex);
+
+  mLevels.clear();
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool ImagePyramid::empty() const {
+  lock_guard<mutex> lock(mMutex);
+
+  return mLevels.empty() || mLevels[0].empty() || mLevels[0][0].empty();
+}
+
+//------------------------------------------------------------------------------
+// Build any missing levels up to the one requested. Odd dimensions round up
+// so no source pixels are dropped
+//------------------------------------------------------------------------------
+const vector<Mat> &ImagePyramid::getLevel(unsigned level) {
+  lock_guard<mutex> lock(mMutex);
+
+  while (mLevels.size() <= level) {
+    const vector<Mat> &previous = mLevels.back();
+    vector<Mat> next(previous.size());
+
+    for (size_t i = 0; i < previous.size(); i++) {
+      const Size size((previous[i].cols + 1) / 2, (previous[i].rows + 1) / 2);
+
+      resize(previous[i], next[i], size, 0, 0, INTER_AREA);
+    }
+
+    mLevels.push_back(next);
+  }
+
+  return mLevels[level];
+}
+
+//------------------------------------------------------------------------------
+// The smallest level that still has at least minRatio times the output size
+// in both dimensions for a region (given in level 0 pixels) that is resized
+// to size. With a ratio of 2 a final area resize from that level always
+// averages at least 2x2 level pixels, which keeps it close to resizing from
+// level 0
+//------------------------------------------------------------------------------
+unsigned ImagePyramid::selectLevel(const Size &region, const Size &size, unsigned minRatio) const {
+  unsigned level = 0;
+
+  if (size.width <= 0 || size.height <= 0) {
+    return level;
+  }
+
+  while ((region.width >> (level + 1)) >= (int) minRatio * size.width &&
+         (region.height >> (level + 1)) >= (int) minRatio * size.height) {
+    level++;
+  }
+
+  return level;
+}
@@ -0,0 +1,78 @@
+#ifndef IMAGE_PYRAMID_HPP
+#define IMAGE_PYRAMID_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+//------------------------------------------------------------------------------
+// Cache of successively halved copies of the decoded source shared by all of
+// the resize operations of a job. Level 0 is the source itself (the BGR image
+// or its Y, Cb and Cr planes) and level k + 1 is an area reduction of level k,
+// so each level is only built once, from the next larger one, and only when
+// an operation first asks for it. Operations running at the same time can
+// share it, the first one to ask for a level builds it while the others wait
+//------------------------------------------------------------------------------
+class ImagePyramid : boost::noncopyable {
+ public:
+
+  ImagePyramid();
+
+  void setImages(const std::vector<cv::Mat> &images);
+  void clear();
+  bool empty() const;
+
+  const std::vector<cv::Mat> &getLevel(unsigned level);
+
+  unsigned selectLevel(const cv::Size &region, const cv::Size &size, unsigned minRatio) const;
+
+ private:
+
+  // Each level holds one image per source plane. Levels are never moved once
+  // built, so the references getLevel returns stay valid as it grows
+  std::deque<std::vector<cv::Mat> > mLevels;
+
+  mutable std::mutex mMutex;
+
+};
+
+#endif // IMAGE_PYRAMID_HPP
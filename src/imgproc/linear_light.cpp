@@ -0,0 +1,154 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./linear_light.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+//------------------------------------------------------------------------------
+// sRGB transfer functions on [0, 1]
+//------------------------------------------------------------------------------
+double decodeSrgb(double value) {
+  if (value <= 0.04045) {
+    return value / 12.92;
+  }
+
+  return pow((value + 0.055) / 1.055, 2.4);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+double encodeSrgb(double value) {
+  if (value <= 0.0031308) {
+    return value * 12.92;
+  }
+
+  return 1.055 * pow(value, 1.0 / 2.4) - 0.055;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+vector<unsigned short> buildLinearTable() {
+  vector<unsigned short> table(256);
+
+  for (int i = 0; i < 256; i++) {
+    table[i] = (unsigned short) lround(decodeSrgb(i / 255.0) * LINEAR_LIGHT_MAX);
+  }
+
+  return table;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+vector<unsigned char> buildSrgbTable() {
+  vector<unsigned char> table(LINEAR_LIGHT_MAX + 1);
+
+  for (int i = 0; i <= LINEAR_LIGHT_MAX; i++) {
+    table[i] = (unsigned char) lround(encodeSrgb((double) i / LINEAR_LIGHT_MAX) * 255.0);
+  }
+
+  return table;
+}
+
+//------------------------------------------------------------------------------
+// The tables are built on first use
+//------------------------------------------------------------------------------
+const vector<unsigned short> &linearTable() {
+  static const vector<unsigned short> table = buildLinearTable();
+
+  return table;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+const vector<unsigned char> &srgbTable() {
+  static const vector<unsigned char> table = buildSrgbTable();
+
+  return table;
+}
+
+}
+
+//------------------------------------------------------------------------------
+// 8-bit sRGB to 16-bit linear light with the same number of channels
+//------------------------------------------------------------------------------
+void LinearLight::toLinear(const Mat &image, Mat &linear) {
+  const int length = image.cols * image.channels();
+
+  Mat output(image.size(), CV_16UC(image.channels()));
+
+  for (int y = 0; y < image.rows; y++) {
+    toLinearRow(image.ptr(y), output.ptr<unsigned short>(y), length);
+  }
+
+  linear = output;
+}
+
+//------------------------------------------------------------------------------
+// Convert length values of one row
+//------------------------------------------------------------------------------
+void LinearLight::toLinearRow(const unsigned char *row, unsigned short *linear, int length) {
+  const unsigned short *table = linearTable().data();
+
+  for (int x = 0; x < length; x++) {
+    linear[x] = table[row[x]];
+  }
+}
+
+//------------------------------------------------------------------------------
+// Back to 8-bit sRGB. Values above LINEAR_LIGHT_MAX are clamped
+//------------------------------------------------------------------------------
+void LinearLight::toSrgb(const Mat &linear, Mat &image) {
+  const unsigned char *table = srgbTable().data();
+  const int length = linear.cols * linear.channels();
+
+  Mat output(linear.size(), CV_8UC(linear.channels()));
+
+  for (int y = 0; y < linear.rows; y++) {
+    const unsigned short *src = linear.ptr<unsigned short>(y);
+    unsigned char *dst = output.ptr(y);
+
+    for (int x = 0; x < length; x++) {
+      dst[x] = table[min((int) src[x], LINEAR_LIGHT_MAX)];
+    }
+  }
+
+  image = output;
+}
@@ -0,0 +1,59 @@
+#ifndef LINEAR_LIGHT_HPP
+#define LINEAR_LIGHT_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// Linear light values are 15 bits so the fixed-point resamplers can work on
+// them with 16-bit multiplies
+#define LINEAR_LIGHT_MAX 32767
+
+//------------------------------------------------------------------------------
+// Conversion between 8-bit sRGB and 16-bit linear light (values up to
+// LINEAR_LIGHT_MAX) through lookup tables, so resizing can average light
+// instead of gamma encoded values. Going to linear is a 256 entry table and
+// coming back a table with an entry for every linear value, so neither
+// direction does any arithmetic per pixel
+//------------------------------------------------------------------------------
+namespace LinearLight {
+
+void toLinear(const cv::Mat &image, cv::Mat &linear);
+void toLinearRow(const unsigned char *row, unsigned short *linear, int length);
+void toSrgb(const cv::Mat &linear, cv::Mat &image);
+
+}
+
+#endif // LINEAR_LIGHT_HPP
@@ -0,0 +1,771 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./resampler.hpp"
+#include "./linear_light.hpp"
+#include "../utils/executor.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+// OpenCV
+#include <opencv2/core/utility.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RESAMPLER_X86 1
+#endif
+
+using namespace cv;
+using namespace std;
+
+// Coefficients are fixed-point with this many fractional bits so that they
+// fit the 16-bit multiplies of the vector kernels
+#define RESAMPLER_PRECISION_BITS 14
+
+// Largest value of 16-bit images. With 15 bits the pixels are still positive
+// 16-bit integers and a whole weighted sum fits in 32 bits
+#define RESAMPLER_MAX_16U 32767
+
+// The coefficient cache is cleared once it holds this many tables
+#define RESAMPLER_CACHE_SIZE 512
+
+// Bands smaller than this many output rows aren't worth a thread
+#define RESAMPLER_MIN_BAND_ROWS 64
+
+namespace {
+
+//------------------------------------------------------------------------------
+// Taps of every output sample of one pass
+//------------------------------------------------------------------------------
+struct Coefficients {
+  // First source sample, number of taps and offset into weights of each
+  // output sample
+  vector<int> first;
+  vector<int> count;
+  vector<int> offset;
+
+  vector<short> weights;
+
+  // Largest number of taps of any output sample
+  int maxCount;
+};
+
+typedef shared_ptr<const Coefficients> CoefficientsPtr;
+typedef tuple<int, int, int> CoefficientsKey;
+
+mutex cacheMutex;
+map<CoefficientsKey, CoefficientsPtr> cache;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+double sinc(double x) {
+  if (x == 0.0) {
+    return 1.0;
+  }
+
+  x *= M_PI;
+
+  return sin(x) / x;
+}
+
+//------------------------------------------------------------------------------
+// Mitchell-Netravali family of cubics
+//------------------------------------------------------------------------------
+double cubic(double x, double b, double c) {
+  if (x < 1.0) {
+    return ((12.0 - 9.0 * b - 6.0 * c) * x * x * x +
+            (-18.0 + 12.0 * b + 6.0 * c) * x * x +
+            (6.0 - 2.0 * b)) / 6.0;
+  }
+
+  if (x < 2.0) {
+    return ((-b - 6.0 * c) * x * x * x +
+            (6.0 * b + 30.0 * c) * x * x +
+            (-12.0 * b - 48.0 * c) * x +
+            (8.0 * b + 24.0 * c)) / 6.0;
+  }
+
+  return 0.0;
+}
+
+//------------------------------------------------------------------------------
+// Radius of the filter in source samples (before scaling for a reduction)
+//------------------------------------------------------------------------------
+double filterSupport(int filter) {
+  switch (filter) {
+    case ResampleFilterBox: return 0.5;
+    case ResampleFilterLanczos3: return 3.0;
+    default: return 2.0;
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+double filterWeight(int filter, double x) {
+  // Half open so samples exactly between two source samples only get one
+  if (filter == ResampleFilterBox) {
+    return (x >= -0.5 && x < 0.5) ? 1.0 : 0.0;
+  }
+
+  x = fabs(x);
+
+  switch (filter) {
+    case ResampleFilterCatmullRom: return cubic(x, 0.0, 0.5);
+    case ResampleFilterMitchell: return cubic(x, 1.0 / 3.0, 1.0 / 3.0);
+    case ResampleFilterLanczos3: return (x < 3.0) ? sinc(x) * sinc(x / 3.0) : 0.0;
+    default: return 0.0;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Fixed-point weights of every output sample when resampling length samples
+// to outputLength. When reducing, the filter is stretched over the source so
+// every source sample contributes. The weights of each output sample add up
+// to exactly one so flat areas stay flat
+//------------------------------------------------------------------------------
+CoefficientsPtr computeCoefficients(int length, int outputLength, int filter) {
+  shared_ptr<Coefficients> coefficients(new Coefficients());
+
+  const double scale = (double) length / (double) outputLength;
+  const double filterScale = max(scale, 1.0);
+  const double support = filterSupport(filter) * filterScale;
+  const int one = 1 << RESAMPLER_PRECISION_BITS;
+
+  coefficients->maxCount = 0;
+  coefficients->first.resize(outputLength);
+  coefficients->count.resize(outputLength);
+  coefficients->offset.resize(outputLength);
+
+  vector<double> weights;
+  vector<int> fixed;
+
+  for (int i = 0; i < outputLength; i++) {
+    const double center = (i + 0.5) * scale;
+
+    // One sample wider than needed on each side, the zero weights are
+    // dropped below
+    int x0 = max((int) floor(center - support), 0);
+    int x1 = min((int) floor(center + support) + 1, length);
+
+    x0 = min(x0, length - 1);
+    x1 = max(x1, x0 + 1);
+
+    weights.clear();
+    double total = 0.0;
+
+    for (int x = x0; x < x1; x++) {
+      const double weight = filterWeight(filter, (x + 0.5 - center) / filterScale);
+
+      weights.push_back(weight);
+      total += weight;
+    }
+
+    // Can't happen for these filters, but never divide by zero
+    if (total == 0.0) {
+      weights.assign(weights.size(), 0.0);
+      weights[min((int) center, x1 - 1) - x0] = 1.0;
+      total = 1.0;
+    }
+
+    fixed.resize(weights.size());
+
+    int sum = 0;
+    size_t largest = 0;
+
+    for (size_t k = 0; k < weights.size(); k++) {
+      fixed[k] = (int) lround(weights[k] / total * one);
+      sum += fixed[k];
+
+      if (fixed[k] > fixed[largest]) {
+        largest = k;
+      }
+    }
+
+    // Rounding error goes to the largest weight
+    fixed[largest] += one - sum;
+
+    // Drop taps that rounded to nothing
+    size_t begin = 0;
+    size_t end = fixed.size();
+
+    while (begin < end && fixed[begin] == 0) {
+      begin++;
+    }
+
+    while (end > begin && fixed[end - 1] == 0) {
+      end--;
+    }
+
+    coefficients->first[i] = x0 + (int) begin;
+    coefficients->count[i] = (int) (end - begin);
+    coefficients->maxCount = max(coefficients->maxCount, coefficients->count[i]);
+    coefficients->offset[i] = (int) coefficients->weights.size();
+
+    for (size_t k = begin; k < end; k++) {
+      coefficients->weights.push_back((short) fixed[k]);
+    }
+  }
+
+  return coefficients;
+}
+
+//------------------------------------------------------------------------------
+// Look up the coefficients in the cache, computing them on a miss. Tables are
+// immutable so they can be used outside the lock
+//------------------------------------------------------------------------------
+CoefficientsPtr getCoefficients(int length, int outputLength, int filter) {
+  const CoefficientsKey key(filter, length, outputLength);
+
+  {
+    lock_guard<mutex> lock(cacheMutex);
+
+    map<CoefficientsKey, CoefficientsPtr>::const_iterator found = cache.find(key);
+
+    if (found != cache.end()) {
+      return found->second;
+    }
+  }
+
+  CoefficientsPtr coefficients = computeCoefficients(length, outputLength, filter);
+
+  lock_guard<mutex> lock(cacheMutex);
+
+  if (cache.size() >= RESAMPLER_CACHE_SIZE) {
+    cache.clear();
+  }
+
+  cache[key] = coefficients;
+
+  return coefficients;
+}
+
+//------------------------------------------------------------------------------
+// Weighted sum of count source rows into one output row, starting at byte
+// start. The vector kernels below must give exactly the same result
+//------------------------------------------------------------------------------
+void resampleRow(const unsigned char *const *rows,
+                 const short *weights,
+                 int count,
+                 int start,
+                 int length,
+                 unsigned char *output) {
+  for (int x = start; x < length; x++) {
+    int sum = 1 << (RESAMPLER_PRECISION_BITS - 1);
+
+    for (int k = 0; k < count; k++) {
+      sum += rows[k][x] * weights[k];
+    }
+
+    sum >>= RESAMPLER_PRECISION_BITS;
+
+    output[x] = (unsigned char) min(max(sum, 0), 255);
+  }
+}
+
+//------------------------------------------------------------------------------
+// resampleRow for 16-bit rows (see RESAMPLER_MAX_16U), starting at element
+// start
+//------------------------------------------------------------------------------
+void resampleRow16(const unsigned short *const *rows,
+                   const short *weights,
+                   int count,
+                   int start,
+                   int length,
+                   unsigned short *output) {
+  for (int x = start; x < length; x++) {
+    int sum = 1 << (RESAMPLER_PRECISION_BITS - 1);
+
+    for (int k = 0; k < count; k++) {
+      sum += rows[k][x] * weights[k];
+    }
+
+    sum >>= RESAMPLER_PRECISION_BITS;
+
+    output[x] = (unsigned short) min(max(sum, 0), RESAMPLER_MAX_16U);
+  }
+}
+
+#ifdef RESAMPLER_X86
+
+//------------------------------------------------------------------------------
+// Two weights packed for _mm_madd_epi16
+//------------------------------------------------------------------------------
+inline int weightPair(short first, short second) {
+  return (int) ((unsigned short) first | ((unsigned) (unsigned short) second << 16));
+}
+
+//------------------------------------------------------------------------------
+// 16 bytes at a time. Pixels of two rows are interleaved and widened to 16
+// bits so each madd applies two taps. Returns the number of bytes done
+//------------------------------------------------------------------------------
+__attribute__((target("sse2")))
+int resampleRowSse2(const unsigned char *const *rows, const short *weights, int count, int length,
+                    unsigned char *output) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi32(1 << (RESAMPLER_PRECISION_BITS - 1));
+
+  int x = 0;
+
+  for (; x + 16 <= length; x += 16) {
+    __m128i sum0 = half;
+    __m128i sum1 = half;
+    __m128i sum2 = half;
+    __m128i sum3 = half;
+
+    for (int k = 0; k < count; k += 2) {
+      const bool pair = (k + 1 < count);
+      const __m128i w = _mm_set1_epi32(weightPair(weights[k], pair ? weights[k + 1] : 0));
+      const __m128i a = _mm_loadu_si128((const __m128i *) (rows[k] + x));
+      const __m128i b = pair ? _mm_loadu_si128((const __m128i *) (rows[k + 1] + x)) : zero;
+
+      const __m128i lo = _mm_unpacklo_epi8(a, b);
+      const __m128i hi = _mm_unpackhi_epi8(a, b);
+
+      sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+      sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+      sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+      sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+    }
+
+    sum0 = _mm_srai_epi32(sum0, RESAMPLER_PRECISION_BITS);
+    sum1 = _mm_srai_epi32(sum1, RESAMPLER_PRECISION_BITS);
+    sum2 = _mm_srai_epi32(sum2, RESAMPLER_PRECISION_BITS);
+    sum3 = _mm_srai_epi32(sum3, RESAMPLER_PRECISION_BITS);
+
+    // Saturating packs clamp to 0-255
+    const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(sum0, sum1), _mm_packs_epi32(sum2, sum3));
+
+    _mm_storeu_si128((__m128i *) (output + x), packed);
+  }
+
+  return x;
+}
+
+//------------------------------------------------------------------------------
+// Same as the SSE2 kernel 32 bytes at a time. The unpacks and packs both work
+// within 128-bit lanes so the bytes come out in order
+//------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+int resampleRowAvx2(const unsigned char *const *rows, const short *weights, int count, int length,
+                    unsigned char *output) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i half = _mm256_set1_epi32(1 << (RESAMPLER_PRECISION_BITS - 1));
+
+  int x = 0;
+
+  for (; x + 32 <= length; x += 32) {
+    __m256i sum0 = half;
+    __m256i sum1 = half;
+    __m256i sum2 = half;
+    __m256i sum3 = half;
+
+    for (int k = 0; k < count; k += 2) {
+      const bool pair = (k + 1 < count);
+      const __m256i w = _mm256_set1_epi32(weightPair(weights[k], pair ? weights[k + 1] : 0));
+      const __m256i a = _mm256_loadu_si256((const __m256i *) (rows[k] + x));
+      const __m256i b = pair ? _mm256_loadu_si256((const __m256i *) (rows[k + 1] + x)) : zero;
+
+      const __m256i lo = _mm256_unpacklo_epi8(a, b);
+      const __m256i hi = _mm256_unpackhi_epi8(a, b);
+
+      sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+      sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+      sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+      sum3 = _mm256_add_epi32(sum3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+    }
+
+    sum0 = _mm256_srai_epi32(sum0, RESAMPLER_PRECISION_BITS);
+    sum1 = _mm256_srai_epi32(sum1, RESAMPLER_PRECISION_BITS);
+    sum2 = _mm256_srai_epi32(sum2, RESAMPLER_PRECISION_BITS);
+    sum3 = _mm256_srai_epi32(sum3, RESAMPLER_PRECISION_BITS);
+
+    const __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(sum0, sum1), _mm256_packs_epi32(sum2, sum3));
+
+    _mm256_storeu_si256((__m256i *) (output + x), packed);
+  }
+
+  return x;
+}
+
+//------------------------------------------------------------------------------
+// 16-bit rows, 8 elements at a time. The pixels are already 16 bits wide so
+// the rows only need interleaving. Returns the number of elements done
+//------------------------------------------------------------------------------
+__attribute__((target("sse2")))
+int resampleRow16Sse2(const unsigned short *const *rows, const short *weights, int count, int length,
+                      unsigned short *output) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi32(1 << (RESAMPLER_PRECISION_BITS - 1));
+
+  int x = 0;
+
+  for (; x + 8 <= length; x += 8) {
+    __m128i sum0 = half;
+    __m128i sum1 = half;
+
+    for (int k = 0; k < count; k += 2) {
+      const bool pair = (k + 1 < count);
+      const __m128i w = _mm_set1_epi32(weightPair(weights[k], pair ? weights[k + 1] : 0));
+      const __m128i a = _mm_loadu_si128((const __m128i *) (rows[k] + x));
+      const __m128i b = pair ? _mm_loadu_si128((const __m128i *) (rows[k + 1] + x)) : zero;
+
+      sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+      sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+    }
+
+    sum0 = _mm_srai_epi32(sum0, RESAMPLER_PRECISION_BITS);
+    sum1 = _mm_srai_epi32(sum1, RESAMPLER_PRECISION_BITS);
+
+    // The signed saturating pack clamps to RESAMPLER_MAX_16U
+    const __m128i packed = _mm_max_epi16(_mm_packs_epi32(sum0, sum1), zero);
+
+    _mm_storeu_si128((__m128i *) (output + x), packed);
+  }
+
+  return x;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+int resampleRow16Avx2(const unsigned short *const *rows, const short *weights, int count, int length,
+                      unsigned short *output) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i half = _mm256_set1_epi32(1 << (RESAMPLER_PRECISION_BITS - 1));
+
+  int x = 0;
+
+  for (; x + 16 <= length; x += 16) {
+    __m256i sum0 = half;
+    __m256i sum1 = half;
+
+    for (int k = 0; k < count; k += 2) {
+      const bool pair = (k + 1 < count);
+      const __m256i w = _mm256_set1_epi32(weightPair(weights[k], pair ? weights[k + 1] : 0));
+      const __m256i a = _mm256_loadu_si256((const __m256i *) (rows[k] + x));
+      const __m256i b = pair ? _mm256_loadu_si256((const __m256i *) (rows[k + 1] + x)) : zero;
+
+      sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+      sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+    }
+
+    sum0 = _mm256_srai_epi32(sum0, RESAMPLER_PRECISION_BITS);
+    sum1 = _mm256_srai_epi32(sum1, RESAMPLER_PRECISION_BITS);
+
+    const __m256i packed = _mm256_max_epi16(_mm256_packs_epi32(sum0, sum1), zero);
+
+    _mm256_storeu_si256((__m256i *) (output + x), packed);
+  }
+
+  return x;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Run the widest kernel the CPU supports. Returns the number of bytes done,
+// the rest is left to resampleRow
+//------------------------------------------------------------------------------
+int resampleRowVector(const unsigned char *const *rows, const short *weights, int count, int length,
+                      unsigned char *output) {
+#ifdef RESAMPLER_X86
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  static const bool sse2 = __builtin_cpu_supports("sse2");
+
+  if (avx2) {
+    return resampleRowAvx2(rows, weights, count, length, output);
+  }
+
+  if (sse2) {
+    return resampleRowSse2(rows, weights, count, length, output);
+  }
+#endif
+
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+int resampleRow16Vector(const unsigned short *const *rows, const short *weights, int count, int length,
+                        unsigned short *output) {
+#ifdef RESAMPLER_X86
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  static const bool sse2 = __builtin_cpu_supports("sse2");
+
+  if (avx2) {
+    return resampleRow16Avx2(rows, weights, count, length, output);
+  }
+
+  if (sse2) {
+    return resampleRow16Sse2(rows, weights, count, length, output);
+  }
+#endif
+
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Resample the columns of source to outputRows rows, of which only the count
+// rows from first are produced
+//------------------------------------------------------------------------------
+void resampleColumns(const Mat &source, Mat &output, int outputRows, int filter, int first, int count) {
+  if (source.rows == outputRows) {
+    output = source.rowRange(first, first + count);
+    return;
+  }
+
+  const CoefficientsPtr coefficients = getCoefficients(source.rows, outputRows, filter);
+  const int length = source.cols * source.channels();
+
+  output.create(count, source.cols, source.type());
+
+  if (source.depth() == CV_16U) {
+    vector<const unsigned short *> rows;
+
+    for (int y = first; y < first + count; y++) {
+      const int taps = coefficients->count[y];
+      const short *weights = &coefficients->weights[coefficients->offset[y]];
+      unsigned short *row = output.ptr<unsigned short>(y - first);
+
+      rows.resize(taps);
+
+      for (int k = 0; k < taps; k++) {
+        rows[k] = source.ptr<unsigned short>(coefficients->first[y] + k);
+      }
+
+      const int done = resampleRow16Vector(rows.data(), weights, taps, length, row);
+
+      resampleRow16(rows.data(), weights, taps, done, length, row);
+    }
+
+    return;
+  }
+
+  vector<const unsigned char *> rows;
+
+  for (int y = first; y < first + count; y++) {
+    const int taps = coefficients->count[y];
+    const short *weights = &coefficients->weights[coefficients->offset[y]];
+    unsigned char *row = output.ptr(y - first);
+
+    rows.resize(taps);
+
+    for (int k = 0; k < taps; k++) {
+      rows[k] = source.ptr(coefficients->first[y] + k);
+    }
+
+    const int done = resampleRowVector(rows.data(), weights, taps, length, row);
+
+    resampleRow(rows.data(), weights, taps, done, length, row);
+  }
+}
+
+//------------------------------------------------------------------------------
+// resampleColumns for an 8-bit sRGB source with a 16-bit linear light output.
+// Source rows are converted as the filter window reaches them into a ring
+// just large enough for one window, so each row is converted once and the
+// source is never converted as a whole
+//------------------------------------------------------------------------------
+void resampleColumnsLinear(const Mat &source, Mat &output, int outputRows, int filter, int first, int count) {
+  if (source.rows == outputRows) {
+    LinearLight::toLinear(source.rowRange(first, first + count), output);
+    return;
+  }
+
+  const CoefficientsPtr coefficients = getCoefficients(source.rows, outputRows, filter);
+  const int length = source.cols * source.channels();
+  const int ringSize = coefficients->maxCount;
+
+  output.create(count, source.cols, CV_16UC(source.channels()));
+
+  Mat ring(ringSize, length, CV_16UC1);
+  vector<int> ringRows(ringSize, -1);
+  vector<const unsigned short *> rows;
+
+  for (int y = first; y < first + count; y++) {
+    const int taps = coefficients->count[y];
+    const short *weights = &coefficients->weights[coefficients->offset[y]];
+    unsigned short *row = output.ptr<unsigned short>(y - first);
+
+    rows.resize(taps);
+
+    // The rows of a window are consecutive so they never share a slot
+    for (int k = 0; k < taps; k++) {
+      const int sourceRow = coefficients->first[y] + k;
+      const int slot = sourceRow % ringSize;
+
+      if (ringRows[slot] != sourceRow) {
+        LinearLight::toLinearRow(source.ptr(sourceRow), ring.ptr<unsigned short>(slot), length);
+        ringRows[slot] = sourceRow;
+      }
+
+      rows[k] = ring.ptr<unsigned short>(slot);
+    }
+
+    const int done = resampleRow16Vector(rows.data(), weights, taps, length, row);
+
+    resampleRow16(rows.data(), weights, taps, done, length, row);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Both passes for the count output rows from first. Each output row only
+// depends on its own filter window, so bands of the output can be produced
+// on their own
+//------------------------------------------------------------------------------
+void resizeBand(const Mat &source, Mat &output, const Size &size, int filter, bool linearLight, int first, int count) {
+  Mat columns;
+
+  if (linearLight) {
+    resampleColumnsLinear(source, columns, size.height, filter, first, count);
+  } else {
+    resampleColumns(source, columns, size.height, filter, first, count);
+  }
+
+  Mat transposed;
+  transpose(columns, transposed);
+
+  Mat rows;
+  resampleColumns(transposed, rows, size.width, filter, 0, size.width);
+
+  transpose(rows, output);
+
+  if (linearLight) {
+    LinearLight::toSrgb(output, output);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Produces a range of bands of the output rows into their rows of output
+//------------------------------------------------------------------------------
+class ResampleBandBody : public ParallelLoopBody {
+ public:
+
+  ResampleBandBody(const Mat &source,
+                   const Size &size,
+                   int filter,
+                   bool linearLight,
+                   int first,
+                   int count,
+                   int bands,
+                   Mat &output) :
+      mSource(source),
+      mSize(size),
+      mFilter(filter),
+      mLinearLight(linearLight),
+      mFirst(first),
+      mCount(count),
+      mBands(bands),
+      mOutput(output) {
+  }
+
+  virtual void operator()(const Range &range) const;
+
+ private:
+
+  const Mat &mSource;
+  Size mSize;
+  int mFilter;
+  bool mLinearLight;
+  int mFirst;
+  int mCount;
+  int mBands;
+  Mat &mOutput;
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void ResampleBandBody::operator()(const Range &range) const {
+  for (int i = range.start; i < range.end; i++) {
+    const int first = (int) ((long) mCount * i / mBands);
+    const int last = (int) ((long) mCount * (i + 1) / mBands);
+
+    Mat band;
+    resizeBand(mSource, band, mSize, mFilter, mLinearLight, mFirst + first, last - first);
+
+    Mat rows = mOutput.rowRange(first, last);
+    band.copyTo(rows);
+  }
+}
+
+}
+
+//------------------------------------------------------------------------------
+// Resize an 8-bit image, or a 16-bit image with values up to
+// RESAMPLER_MAX_16U (such as LinearLight images), with any number of
+// channels. The columns are resampled first, then the rows of the (much
+// smaller, when reducing) intermediate image through a transpose so both
+// passes read whole rows.
+// With linearLight an 8-bit sRGB source is resampled in 16-bit linear light
+// (see LinearLight) and the output converted back to 8-bit sRGB
+//------------------------------------------------------------------------------
+void Resampler::resize(const Mat &source, Mat &output, const Size &size, int filter, bool linearLight) {
+  resizeRows(source, output, size, filter, linearLight, 0, size.height);
+}
+
+//------------------------------------------------------------------------------
+// Only the count output rows from first of a resize to size. Each output row
+// only depends on its own filter window so the rows are exactly those of the
+// whole resize. Large outputs are split into bands of rows that run on the
+// job's threads (see Executor::parallelFor)
+//------------------------------------------------------------------------------
+void Resampler::resizeRows(const Mat &source,
+                           Mat &output,
+                           const Size &size,
+                           int filter,
+                           bool linearLight,
+                           int first,
+                           int count) {
+  linearLight = linearLight && (source.depth() == CV_8U);
+
+  const int bands = max(min(Executor::getNumThreads(), count / RESAMPLER_MIN_BAND_ROWS), 1);
+
+  if (bands == 1) {
+    resizeBand(source, output, size, filter, linearLight, first, count);
+    return;
+  }
+
+  // A new image since output may be the source, which the bands still read
+  Mat resized(count, size.width, source.type());
+
+  Executor::parallelFor(Range(0, bands),
+                        ResampleBandBody(source, size, filter, linearLight, first, count, bands, resized));
+
+  output = resized;
+}
@@ -0,0 +1,71 @@
+#ifndef RESAMPLER_HPP
+#define RESAMPLER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// Filters of the separable resampler (see Resampler::resize)
+enum {
+  ResampleFilterNone = -1,
+  ResampleFilterBox = 0,
+  ResampleFilterCatmullRom = 1,
+  ResampleFilterMitchell = 2,
+  ResampleFilterLanczos3 = 3
+};
+
+//------------------------------------------------------------------------------
+// Separable 8-bit (or 15-bit linear light) resampler for the filters OpenCV
+// doesn't offer. Both passes run the same fixed-point kernel over whole rows
+// (the horizontal pass works on the transposed image), vectorized with SSE2
+// and with AVX2 when the CPU supports it. The filter coefficients for each
+// (source length, output length, filter) are computed once and cached since
+// the same preset sizes come up over and over
+//------------------------------------------------------------------------------
+namespace Resampler {
+
+void resize(const cv::Mat &source, cv::Mat &output, const cv::Size &size, int filter, bool linearLight = false);
+
+void resizeRows(const cv::Mat &source,
+                cv::Mat &output,
+                const cv::Size &size,
+                int filter,
+                bool linearLight,
+                int first,
+                int count);
+
+}
+
+#endif // RESAMPLER_HPP
@@ -0,0 +1,169 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./stream_resizer.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+StreamResizer::StreamResizer(const Rect &cropRegion, const Size &size, int channels) :
+    mCropRegion(cropRegion),
+    mSize(size),
+    mChannels(channels),
+    mScaleY((double) cropRegion.height / (double) size.height),
+    mRow(size.width * channels),
+    mAccumulator(size.width * channels, 0.0f),
+    mOutputRow(0),
+    mImage(size, CV_MAKETYPE(CV_8U, channels)) {
+
+  // Each output column covers [x * scaleX, (x + 1) * scaleX) of the crop
+  const double scaleX = (double) cropRegion.width / (double) size.width;
+
+  for (int x = 0; x < size.width; x++) {
+    const double start = x * scaleX;
+    const double end = (x == size.width - 1) ? cropRegion.width : (x + 1) * scaleX;
+
+    for (int sx = (int) floor(start); sx < end && sx < cropRegion.width; sx++) {
+      const double overlap = min(end, sx + 1.0) - max(start, (double) sx);
+
+      if (overlap <= 0.0) {
+        continue;
+      }
+
+      mTabSource.push_back(sx);
+      mTabOutput.push_back(x);
+      mTabWeight.push_back((float) (overlap / scaleX));
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Feed a band of source rows. y and x are the source coordinates of the first
+// pixel of the band, rows outside of the crop region are ignored
+//------------------------------------------------------------------------------
+void StreamResizer::push(const Mat &rows, int y, int x) {
+  for (int i = 0; i < rows.rows && !isDone(); i++) {
+    const int cropRow = y + i - mCropRegion.y;
+
+    if (cropRow < 0 || cropRow >= mCropRegion.height) {
+      continue;
+    }
+
+    resampleRow(rows.ptr(i) + (mCropRegion.x - x) * mChannels);
+
+    // Spread the source row over the output rows it overlaps
+    const double top = cropRow;
+    const double bottom = cropRow + 1.0;
+
+    while (mOutputRow < mSize.height) {
+      const double rowStart = mOutputRow * mScaleY;
+      const double rowEnd = (mOutputRow == mSize.height - 1) ? mCropRegion.height : (mOutputRow + 1) * mScaleY;
+
+      const double overlap = min(bottom, rowEnd) - max(top, rowStart);
+
+      if (overlap > 0.0) {
+        accumulate((float) (overlap / mScaleY));
+      }
+
+      if (bottom < rowEnd) {
+        break;
+      }
+
+      emitRow();
+
+      if (bottom == rowEnd) {
+        break;
+      }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool StreamResizer::isDone() const {
+  return mOutputRow >= mSize.height;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+const Mat &StreamResizer::getImage() const {
+  return mImage;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void StreamResizer::resampleRow(const unsigned char *src) {
+  fill(mRow.begin(), mRow.end(), 0.0f);
+
+  const size_t count = mTabWeight.size();
+
+  for (size_t k = 0; k < count; k++) {
+    const unsigned char *s = src + mTabSource[k] * mChannels;
+    float *d = &mRow[mTabOutput[k] * mChannels];
+    const float w = mTabWeight[k];
+
+    for (int c = 0; c < mChannels; c++) {
+      d[c] += s[c] * w;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void StreamResizer::accumulate(float weight) {
+  const size_t count = mRow.size();
+
+  for (size_t i = 0; i < count; i++) {
+    mAccumulator[i] += mRow[i] * weight;
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void StreamResizer::emitRow() {
+  unsigned char *d = mImage.ptr(mOutputRow);
+  const size_t count = mAccumulator.size();
+
+  for (size_t i = 0; i < count; i++) {
+    d[i] = saturate_cast<uchar>(mAccumulator[i]);
+  }
+
+  fill(mAccumulator.begin(), mAccumulator.end(), 0.0f);
+
+  mOutputRow++;
+}
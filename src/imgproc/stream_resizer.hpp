@@ -0,0 +1,88 @@
+#ifndef STREAM_RESIZER_HPP
+#define STREAM_RESIZER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+//------------------------------------------------------------------------------
+// Separable area (box) downsampler that is fed the source a band of rows at a
+// time, so the source never has to be held in memory. Only one accumulator
+// row is kept besides the output. Meant for reductions (the crop region at
+// least as large as the output)
+//------------------------------------------------------------------------------
+class StreamResizer : boost::noncopyable {
+ public:
+
+  StreamResizer(const cv::Rect &cropRegion, const cv::Size &size, int channels);
+
+  void push(const cv::Mat &rows, int y, int x);
+
+  bool isDone() const;
+  const cv::Mat &getImage() const;
+
+ private:
+
+  void resampleRow(const unsigned char *src);
+  void accumulate(float weight);
+  void emitRow();
+
+  cv::Rect mCropRegion;
+  cv::Size mSize;
+  int mChannels;
+
+  double mScaleY;
+
+  // Horizontal weights as (source column, output column, weight) triples
+  std::vector<int> mTabSource;
+  std::vector<int> mTabOutput;
+  std::vector<float> mTabWeight;
+
+  // The current source row resampled horizontally and the output row being
+  // accumulated
+  std::vector<float> mRow;
+  std::vector<float> mAccumulator;
+
+  int mOutputRow;
+  cv::Mat mImage;
+
+};
+
+#endif // STREAM_RESIZER_HPP
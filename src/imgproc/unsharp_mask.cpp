@@ -0,0 +1,565 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./unsharp_mask.hpp"
+#include "../utils/executor.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// OpenCV
+#include <opencv2/core/utility.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define UNSHARP_MASK_X86 1
+#endif
+
+using namespace cv;
+using namespace std;
+
+// Blur weights are fixed-point with this many fractional bits
+#define UNSHARP_MASK_WEIGHT_BITS 14
+
+// Fractional bits the blur keeps between the two passes and when it is
+// subtracted from the source, so only the output is rounded to 8 bits. A
+// blurred 8-bit value with 7 fractional bits still fits a signed 16-bit
+// integer
+#define UNSHARP_MASK_BLUR_BITS 7
+
+// Fractional bits of the amount. Amounts go up to 10 (1000%) which still
+// fits a signed 16-bit multiply
+#define UNSHARP_MASK_AMOUNT_BITS 11
+
+// Bits to drop from the product of a difference and the amount
+#define UNSHARP_MASK_PRODUCT_SHIFT (UNSHARP_MASK_BLUR_BITS + UNSHARP_MASK_AMOUNT_BITS)
+
+// Bands smaller than this many rows aren't worth a thread
+#define UNSHARP_MASK_MIN_BAND_ROWS 64
+
+namespace {
+
+//------------------------------------------------------------------------------
+// Reflect an index into [0, length) without repeating the edge sample, the
+// same as OpenCV's default border
+//------------------------------------------------------------------------------
+int reflect(int i, int length) {
+  if (length == 1) {
+    return 0;
+  }
+
+  while (i < 0 || i >= length) {
+    if (i < 0) {
+      i = -i;
+    }
+
+    if (i >= length) {
+      i = 2 * (length - 1) - i;
+    }
+  }
+
+  return i;
+}
+
+//------------------------------------------------------------------------------
+// Fixed-point Gaussian with the size OpenCV picks for 8-bit images (3 sigma
+// each side). The weights add up to exactly one
+//------------------------------------------------------------------------------
+vector<short> gaussianKernel(double sigma) {
+  const int size = max((int) lround(sigma * 6.0 + 1.0) | 1, 1);
+  const int one = 1 << UNSHARP_MASK_WEIGHT_BITS;
+  const int half = size / 2;
+
+  vector<double> weights(size);
+  double total = 0.0;
+
+  for (int k = 0; k < size; k++) {
+    const double x = k - half;
+
+    weights[k] = (sigma > 0.0) ? exp(-0.5 * x * x / (sigma * sigma)) : (k == half);
+    total += weights[k];
+  }
+
+  vector<short> kernel(size);
+  int sum = 0;
+
+  for (int k = 0; k < size; k++) {
+    kernel[k] = (short) lround(weights[k] / total * one);
+    sum += kernel[k];
+  }
+
+  // Rounding error goes to the center
+  kernel[half] += one - sum;
+
+  return kernel;
+}
+
+//------------------------------------------------------------------------------
+// Vertical pass: weighted sum of size source rows into one row of blurred
+// values (with UNSHARP_MASK_BLUR_BITS fractional bits), starting at element
+// start. The vector kernels below must give exactly the same result
+//------------------------------------------------------------------------------
+void blurColumns(const unsigned char *const *rows,
+                 const short *kernel,
+                 int size,
+                 int start,
+                 int length,
+                 short *blurred) {
+  const int shift = UNSHARP_MASK_WEIGHT_BITS - UNSHARP_MASK_BLUR_BITS;
+
+  for (int x = start; x < length; x++) {
+    int sum = 1 << (shift - 1);
+
+    for (int k = 0; k < size; k++) {
+      sum += rows[k][x] * kernel[k];
+    }
+
+    blurred[x] = (short) (sum >> shift);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Horizontal pass and the weighted difference, starting at element start.
+// Tap k of element x is blurred[x + k * channels], so blurred has to start
+// size / 2 pixels before the row (see UnsharpMask::applyRows)
+//------------------------------------------------------------------------------
+void sharpenRow(const short *blurred,
+                const short *kernel,
+                int size,
+                int channels,
+                const unsigned char *source,
+                int amount,
+                int threshold,
+                int start,
+                int length,
+                unsigned char *output) {
+  for (int x = start; x < length; x++) {
+    int sum = 1 << (UNSHARP_MASK_WEIGHT_BITS - 1);
+
+    for (int k = 0; k < size; k++) {
+      sum += blurred[x + k * channels] * kernel[k];
+    }
+
+    const int blur = sum >> UNSHARP_MASK_WEIGHT_BITS;
+
+    int difference = (source[x] << UNSHARP_MASK_BLUR_BITS) - blur;
+
+    if (abs(difference) < threshold) {
+      difference = 0;
+    }
+
+    const int value = source[x] + ((difference * amount + (1 << (UNSHARP_MASK_PRODUCT_SHIFT - 1))) >>
+                                   UNSHARP_MASK_PRODUCT_SHIFT);
+
+    output[x] = (unsigned char) min(max(value, 0), 255);
+  }
+}
+
+#ifdef UNSHARP_MASK_X86
+
+//------------------------------------------------------------------------------
+// Two weights packed for _mm_madd_epi16
+//------------------------------------------------------------------------------
+inline int weightPair(short first, short second) {
+  return (int) ((unsigned short) first | ((unsigned) (unsigned short) second << 16));
+}
+
+//------------------------------------------------------------------------------
+// 8 pixels at a time. Pixels of two rows are widened and interleaved so each
+// madd applies two taps. Returns the number of elements done
+//------------------------------------------------------------------------------
+__attribute__((target("sse2")))
+int blurColumnsSse2(const unsigned char *const *rows, const short *kernel, int size, int length,
+                    short *blurred) {
+  const int shift = UNSHARP_MASK_WEIGHT_BITS - UNSHARP_MASK_BLUR_BITS;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi32(1 << (shift - 1));
+
+  int x = 0;
+
+  for (; x + 8 <= length; x += 8) {
+    __m128i sum0 = half;
+    __m128i sum1 = half;
+
+    for (int k = 0; k < size; k += 2) {
+      const bool pair = (k + 1 < size);
+      const __m128i w = _mm_set1_epi32(weightPair(kernel[k], pair ? kernel[k + 1] : 0));
+      const __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (rows[k] + x)), zero);
+      const __m128i b = pair ? _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (rows[k + 1] + x)), zero) : zero;
+
+      sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+      sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+    }
+
+    sum0 = _mm_srai_epi32(sum0, shift);
+    sum1 = _mm_srai_epi32(sum1, shift);
+
+    _mm_storeu_si128((__m128i *) (blurred + x), _mm_packs_epi32(sum0, sum1));
+  }
+
+  return x;
+}
+
+//------------------------------------------------------------------------------
+// Same as the SSE2 kernel 16 pixels at a time. The 16-bit unpacks and packs
+// work within 128-bit lanes so the values come out in order
+//------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+int blurColumnsAvx2(const unsigned char *const *rows, const short *kernel, int size, int length,
+                    short *blurred) {
+  const int shift = UNSHARP_MASK_WEIGHT_BITS - UNSHARP_MASK_BLUR_BITS;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i half = _mm256_set1_epi32(1 << (shift - 1));
+
+  int x = 0;
+
+  for (; x + 16 <= length; x += 16) {
+    __m256i sum0 = half;
+    __m256i sum1 = half;
+
+    for (int k = 0; k < size; k += 2) {
+      const bool pair = (k + 1 < size);
+      const __m256i w = _mm256_set1_epi32(weightPair(kernel[k], pair ? kernel[k + 1] : 0));
+      const __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (rows[k] + x)));
+      const __m256i b = pair ? _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (rows[k + 1] + x))) : zero;
+
+      sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+      sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+    }
+
+    sum0 = _mm256_srai_epi32(sum0, shift);
+    sum1 = _mm256_srai_epi32(sum1, shift);
+
+    _mm256_storeu_si256((__m256i *) (blurred + x), _mm256_packs_epi32(sum0, sum1));
+  }
+
+  return x;
+}
+
+//------------------------------------------------------------------------------
+// 8 elements at a time. The blur stays in 32 bits only for the sums, the
+// difference, threshold and amount are applied to 16-bit values
+//------------------------------------------------------------------------------
+__attribute__((target("sse2")))
+int sharpenRowSse2(const short *blurred, const short *kernel, int size, int channels,
+                   const unsigned char *source, int amount, int threshold, int length,
+                   unsigned char *output) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi32(1 << (UNSHARP_MASK_WEIGHT_BITS - 1));
+  const __m128i productHalf = _mm_set1_epi32(1 << (UNSHARP_MASK_PRODUCT_SHIFT - 1));
+  const __m128i amounts = _mm_set1_epi16((short) amount);
+  const __m128i thresholds = _mm_set1_epi16((short) threshold);
+
+  int x = 0;
+
+  for (; x + 8 <= length; x += 8) {
+    __m128i sum0 = half;
+    __m128i sum1 = half;
+
+    for (int k = 0; k < size; k += 2) {
+      const bool pair = (k + 1 < size);
+      const __m128i w = _mm_set1_epi32(weightPair(kernel[k], pair ? kernel[k + 1] : 0));
+      const __m128i a = _mm_loadu_si128((const __m128i *) (blurred + x + k * channels));
+      const __m128i b = pair ? _mm_loadu_si128((const __m128i *) (blurred + x + (k + 1) * channels)) : zero;
+
+      sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+      sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+    }
+
+    const __m128i blur = _mm_packs_epi32(_mm_srai_epi32(sum0, UNSHARP_MASK_WEIGHT_BITS),
+                                         _mm_srai_epi32(sum1, UNSHARP_MASK_WEIGHT_BITS));
+
+    const __m128i pixels = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (source + x)), zero);
+
+    __m128i difference = _mm_sub_epi16(_mm_slli_epi16(pixels, UNSHARP_MASK_BLUR_BITS), blur);
+
+    const __m128i magnitude = _mm_max_epi16(difference, _mm_sub_epi16(zero, difference));
+
+    difference = _mm_andnot_si128(_mm_cmpgt_epi16(thresholds, magnitude), difference);
+
+    // Full 32-bit products from the low and high halves
+    const __m128i productLo = _mm_mullo_epi16(difference, amounts);
+    const __m128i productHi = _mm_mulhi_epi16(difference, amounts);
+
+    __m128i product0 = _mm_unpacklo_epi16(productLo, productHi);
+    __m128i product1 = _mm_unpackhi_epi16(productLo, productHi);
+
+    product0 = _mm_srai_epi32(_mm_add_epi32(product0, productHalf), UNSHARP_MASK_PRODUCT_SHIFT);
+    product1 = _mm_srai_epi32(_mm_add_epi32(product1, productHalf), UNSHARP_MASK_PRODUCT_SHIFT);
+
+    const __m128i sharpened = _mm_add_epi16(pixels, _mm_packs_epi32(product0, product1));
+
+    _mm_storel_epi64((__m128i *) (output + x), _mm_packus_epi16(sharpened, sharpened));
+  }
+
+  return x;
+}
+
+//------------------------------------------------------------------------------
+// Same as the SSE2 kernel 16 elements at a time
+//------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+int sharpenRowAvx2(const short *blurred, const short *kernel, int size, int channels,
+                   const unsigned char *source, int amount, int threshold, int length,
+                   unsigned char *output) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i half = _mm256_set1_epi32(1 << (UNSHARP_MASK_WEIGHT_BITS - 1));
+  const __m256i productHalf = _mm256_set1_epi32(1 << (UNSHARP_MASK_PRODUCT_SHIFT - 1));
+  const __m256i amounts = _mm256_set1_epi16((short) amount);
+  const __m256i thresholds = _mm256_set1_epi16((short) threshold);
+
+  int x = 0;
+
+  for (; x + 16 <= length; x += 16) {
+    __m256i sum0 = half;
+    __m256i sum1 = half;
+
+    for (int k = 0; k < size; k += 2) {
+      const bool pair = (k + 1 < size);
+      const __m256i w = _mm256_set1_epi32(weightPair(kernel[k], pair ? kernel[k + 1] : 0));
+      const __m256i a = _mm256_loadu_si256((const __m256i *) (blurred + x + k * channels));
+      const __m256i b = pair ? _mm256_loadu_si256((const __m256i *) (blurred + x + (k + 1) * channels)) : zero;
+
+      sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+      sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+    }
+
+    const __m256i blur = _mm256_packs_epi32(_mm256_srai_epi32(sum0, UNSHARP_MASK_WEIGHT_BITS),
+                                            _mm256_srai_epi32(sum1, UNSHARP_MASK_WEIGHT_BITS));
+
+    const __m256i pixels = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (source + x)));
+
+    __m256i difference = _mm256_sub_epi16(_mm256_slli_epi16(pixels, UNSHARP_MASK_BLUR_BITS), blur);
+
+    const __m256i magnitude = _mm256_abs_epi16(difference);
+
+    difference = _mm256_andnot_si256(_mm256_cmpgt_epi16(thresholds, magnitude), difference);
+
+    const __m256i productLo = _mm256_mullo_epi16(difference, amounts);
+    const __m256i productHi = _mm256_mulhi_epi16(difference, amounts);
+
+    __m256i product0 = _mm256_unpacklo_epi16(productLo, productHi);
+    __m256i product1 = _mm256_unpackhi_epi16(productLo, productHi);
+
+    product0 = _mm256_srai_epi32(_mm256_add_epi32(product0, productHalf), UNSHARP_MASK_PRODUCT_SHIFT);
+    product1 = _mm256_srai_epi32(_mm256_add_epi32(product1, productHalf), UNSHARP_MASK_PRODUCT_SHIFT);
+
+    const __m256i sharpened = _mm256_add_epi16(pixels, _mm256_packs_epi32(product0, product1));
+
+    // Pack the two lanes into one 16 byte row
+    const __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(sharpened),
+                                            _mm256_extracti128_si256(sharpened, 1));
+
+    _mm_storeu_si128((__m128i *) (output + x), packed);
+  }
+
+  return x;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Run the widest kernel the CPU supports. Returns the number of elements
+// done, the rest is left to blurColumns
+//------------------------------------------------------------------------------
+int blurColumnsVector(const unsigned char *const *rows, const short *kernel, int size, int length,
+                      short *blurred) {
+#ifdef UNSHARP_MASK_X86
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  static const bool sse2 = __builtin_cpu_supports("sse2");
+
+  if (avx2) {
+    return blurColumnsAvx2(rows, kernel, size, length, blurred);
+  }
+
+  if (sse2) {
+    return blurColumnsSse2(rows, kernel, size, length, blurred);
+  }
+#endif
+
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Returns the number of elements done, the rest is left to sharpenRow
+//------------------------------------------------------------------------------
+int sharpenRowVector(const short *blurred, const short *kernel, int size, int channels,
+                     const unsigned char *source, int amount, int threshold, int length,
+                     unsigned char *output) {
+#ifdef UNSHARP_MASK_X86
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  static const bool sse2 = __builtin_cpu_supports("sse2");
+
+  if (avx2) {
+    return sharpenRowAvx2(blurred, kernel, size, channels, source, amount, threshold, length, output);
+  }
+
+  if (sse2) {
+    return sharpenRowSse2(blurred, kernel, size, channels, source, amount, threshold, length, output);
+  }
+#endif
+
+  return 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Sharpens a range of bands of rows. Each band blurs the rows around it
+// from the source on its own, so bands don't depend on each other
+//------------------------------------------------------------------------------
+class SharpenBandBody : public ParallelLoopBody {
+ public:
+
+  SharpenBandBody(const Mat &source,
+                  const vector<short> &kernel,
+                  int amount,
+                  int threshold,
+                  int first,
+                  int count,
+                  int bands,
+                  Mat &output) :
+      mSource(source),
+      mKernel(kernel),
+      mAmount(amount),
+      mThreshold(threshold),
+      mFirst(first),
+      mCount(count),
+      mBands(bands),
+      mOutput(output) {
+  }
+
+  virtual void operator()(const Range &range) const;
+
+ private:
+
+  const Mat &mSource;
+  const vector<short> &mKernel;
+  int mAmount;
+  int mThreshold;
+  int mFirst;
+  int mCount;
+  int mBands;
+  Mat &mOutput;
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void SharpenBandBody::operator()(const Range &range) const {
+  const int size = (int) mKernel.size();
+  const int half = size / 2;
+  const int channels = mSource.channels();
+  const int length = mSource.cols * channels;
+
+  // One vertically blurred row with room for the reflected pixels at both
+  // ends
+  vector<short> blurred((mSource.cols + 2 * half) * channels);
+  short *row = &blurred[half * channels];
+
+  vector<const unsigned char *> rows(size);
+
+  for (int i = range.start; i < range.end; i++) {
+    const int first = mFirst + (int) ((long) mCount * i / mBands);
+    const int last = mFirst + (int) ((long) mCount * (i + 1) / mBands);
+
+    for (int y = first; y < last; y++) {
+      for (int k = 0; k < size; k++) {
+        rows[k] = mSource.ptr(reflect(y + k - half, mSource.rows));
+      }
+
+      const int blurDone = blurColumnsVector(rows.data(), mKernel.data(), size, length, row);
+
+      blurColumns(rows.data(), mKernel.data(), size, blurDone, length, row);
+
+      for (int x = 1; x <= half; x++) {
+        const int left = reflect(-x, mSource.cols);
+        const int right = reflect(mSource.cols - 1 + x, mSource.cols);
+
+        for (int c = 0; c < channels; c++) {
+          row[-x * channels + c] = row[left * channels + c];
+          row[(mSource.cols - 1 + x) * channels + c] = row[right * channels + c];
+        }
+      }
+
+      const unsigned char *sourceRow = mSource.ptr(y);
+      unsigned char *outputRow = mOutput.ptr(y - mFirst);
+
+      const int done = sharpenRowVector(blurred.data(), mKernel.data(), size, channels, sourceRow,
+                                        mAmount, mThreshold, length, outputRow);
+
+      sharpenRow(blurred.data(), mKernel.data(), size, channels, sourceRow,
+                 mAmount, mThreshold, done, length, outputRow);
+    }
+  }
+}
+
+}
+
+//------------------------------------------------------------------------------
+// Sharpen a whole 8-bit image. amount is a fraction (1.0 is 100%) and radius
+// the sigma of the blur
+//------------------------------------------------------------------------------
+void UnsharpMask::apply(const Mat &source, Mat &output, double amount, double radius, int threshold) {
+  applyRows(source, output, amount, radius, threshold, 0, source.rows);
+}
+
+//------------------------------------------------------------------------------
+// Sharpen only the count rows of source from first into output. The rows
+// around them are still read by the blur, so a band of a larger image with
+// enough rows on either side comes out the same as in the whole image. Large
+// images are split into bands of rows that run on the job's threads (see
+// Executor::parallelFor)
+//------------------------------------------------------------------------------
+void UnsharpMask::applyRows(const Mat &source,
+                            Mat &output,
+                            double amount,
+                            double radius,
+                            int threshold,
+                            int first,
+                            int count) {
+  const vector<short> kernel = gaussianKernel(radius);
+  const int amountFixed = (int) lround(min(max(amount, 0.0), 10.0) * (1 << UNSHARP_MASK_AMOUNT_BITS));
+  const int thresholdFixed = min(max(threshold, 0), 255) << UNSHARP_MASK_BLUR_BITS;
+
+  // Rows that are written can't be read by the blur of the next rows
+  if (output.datastart == source.datastart) {
+    output.release();
+  }
+
+  output.create(count, source.cols, source.type());
+
+  const int bands = max(min(Executor::getNumThreads(), count / UNSHARP_MASK_MIN_BAND_ROWS), 1);
+
+  Executor::parallelFor(Range(0, bands),
+                        SharpenBandBody(source, kernel, amountFixed, thresholdFixed, first, count, bands, output));
+}
@@ -0,0 +1,66 @@
+#ifndef UNSHARP_MASK_HPP
+#define UNSHARP_MASK_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+//------------------------------------------------------------------------------
+// Unsharp mask for 8-bit images with any number of channels, equivalent to a
+// GaussianBlur (sigma radius, reflected borders) followed by addWeighted with
+// 1 + amount and -amount. Both blur passes and the weighted difference run
+// row by row in one sweep over the image: each output row is blurred
+// vertically into a 16-bit row buffer, then blurred horizontally and combined
+// with the source while that buffer is still in cache. The arithmetic is
+// fixed-point, vectorized with SSE2 and with AVX2 when the CPU supports it.
+//
+// Differences between a pixel and its blur below threshold (0-255) are left
+// alone so flat areas and noise are not sharpened
+//------------------------------------------------------------------------------
+namespace UnsharpMask {
+
+void apply(const cv::Mat &source, cv::Mat &output, double amount, double radius, int threshold);
+
+void applyRows(const cv::Mat &source,
+               cv::Mat &output,
+               double amount,
+               double radius,
+               int threshold,
+               int first,
+               int count);
+
+}
+
+#endif // UNSHARP_MASK_HPP
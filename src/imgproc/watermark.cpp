@@ -0,0 +1,494 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./watermark.hpp"
+#include "../utils/executor.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// OpenCV
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WATERMARK_X86 1
+#endif
+
+using namespace cv;
+using namespace std;
+
+// Opacities and strengths are out of this (8.8 fixed-point)
+#define WATERMARK_ONE 256
+
+// Bands smaller than this many rows aren't worth a thread
+#define WATERMARK_MIN_BAND_ROWS 64
+
+namespace {
+
+//------------------------------------------------------------------------------
+// Fast approximation of brightness (the same weights as the watermark has
+// always used)
+// http://stackoverflow.com/questions/596216/formula-to-determine-brightness-of-rgb-color
+//------------------------------------------------------------------------------
+inline unsigned brightness(unsigned b, unsigned g, unsigned r) {
+  return (r + r + r + b + g + g + g + g) >> 3;
+}
+
+//------------------------------------------------------------------------------
+// Composite length elements of a row in place. The opacity of each element
+// is its strength times its alpha divided by 255 (rounded), so a strength of
+// WATERMARK_ONE with an opaque pixel replaces the background. The vector
+// kernels below must give exactly the same result
+//------------------------------------------------------------------------------
+void blendRow(unsigned char *background,
+              const unsigned char *foreground,
+              const unsigned char *alpha,
+              const unsigned short *strengths,
+              int start,
+              int length) {
+  for (int x = start; x < length; x++) {
+    const unsigned product = strengths[x] * alpha[x] + 128;
+    const unsigned opacity = (product + (product >> 8)) >> 8;
+
+    background[x] = (unsigned char) ((background[x] * (WATERMARK_ONE - opacity) + foreground[x] * opacity + 128) >> 8);
+  }
+}
+
+#ifdef WATERMARK_X86
+
+//------------------------------------------------------------------------------
+// 8 elements at a time. Every intermediate fits an unsigned 16-bit lane.
+// Returns the number of elements done
+//------------------------------------------------------------------------------
+__attribute__((target("sse2")))
+int blendRowSse2(unsigned char *background,
+                 const unsigned char *foreground,
+                 const unsigned char *alpha,
+                 const unsigned short *strengths,
+                 int length) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi16(128);
+  const __m128i one = _mm_set1_epi16(WATERMARK_ONE);
+  const __m128i divide = _mm_set1_epi16(257);
+
+  int x = 0;
+
+  for (; x + 8 <= length; x += 8) {
+    const __m128i pixels = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (background + x)), zero);
+    const __m128i overlay = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (foreground + x)), zero);
+    const __m128i alphas = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (alpha + x)), zero);
+    const __m128i strength = _mm_loadu_si128((const __m128i *) (strengths + x));
+
+    // Dividing by 255 as a multiply by 257 / 65536, which unlike the shifts
+    // in blendRow can't overflow 16 bits
+    const __m128i product = _mm_add_epi16(_mm_mullo_epi16(strength, alphas), half);
+    const __m128i opacity = _mm_mulhi_epu16(product, divide);
+
+    __m128i blended = _mm_add_epi16(_mm_mullo_epi16(pixels, _mm_sub_epi16(one, opacity)),
+                                    _mm_mullo_epi16(overlay, opacity));
+
+    blended = _mm_srli_epi16(_mm_add_epi16(blended, half), 8);
+
+    _mm_storel_epi64((__m128i *) (background + x), _mm_packus_epi16(blended, blended));
+  }
+
+  return x;
+}
+
+//------------------------------------------------------------------------------
+// Same as the SSE2 kernel 16 elements at a time
+//------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+int blendRowAvx2(unsigned char *background,
+                 const unsigned char *foreground,
+                 const unsigned char *alpha,
+                 const unsigned short *strengths,
+                 int length) {
+  const __m256i half = _mm256_set1_epi16(128);
+  const __m256i one = _mm256_set1_epi16(WATERMARK_ONE);
+  const __m256i divide = _mm256_set1_epi16(257);
+
+  int x = 0;
+
+  for (; x + 16 <= length; x += 16) {
+    const __m256i pixels = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (background + x)));
+    const __m256i overlay = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (foreground + x)));
+    const __m256i alphas = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (alpha + x)));
+    const __m256i strength = _mm256_loadu_si256((const __m256i *) (strengths + x));
+
+    const __m256i product = _mm256_add_epi16(_mm256_mullo_epi16(strength, alphas), half);
+    const __m256i opacity = _mm256_mulhi_epu16(product, divide);
+
+    __m256i blended = _mm256_add_epi16(_mm256_mullo_epi16(pixels, _mm256_sub_epi16(one, opacity)),
+                                       _mm256_mullo_epi16(overlay, opacity));
+
+    blended = _mm256_srli_epi16(_mm256_add_epi16(blended, half), 8);
+
+    // Pack the two lanes into one 16 byte row
+    const __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(blended),
+                                            _mm256_extracti128_si256(blended, 1));
+
+    _mm_storeu_si128((__m128i *) (background + x), packed);
+  }
+
+  return x;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Run the widest kernel the CPU supports, then finish with blendRow
+//------------------------------------------------------------------------------
+void blend(unsigned char *background,
+           const unsigned char *foreground,
+           const unsigned char *alpha,
+           const unsigned short *strengths,
+           int length) {
+  int done = 0;
+
+#ifdef WATERMARK_X86
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  static const bool sse2 = __builtin_cpu_supports("sse2");
+
+  if (avx2) {
+    done = blendRowAvx2(background, foreground, alpha, strengths, length);
+  } else if (sse2) {
+    done = blendRowSse2(background, foreground, alpha, strengths, length);
+  }
+#endif
+
+  blendRow(background, foreground, alpha, strengths, done, length);
+}
+
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+Watermark::Watermark() {
+}
+
+//------------------------------------------------------------------------------
+// Returns false if the file can't be read
+//------------------------------------------------------------------------------
+bool Watermark::load(const string &file) {
+  if (file.empty()) {
+    return setImage(Mat());
+  }
+
+  return setImage(imread(file, IMREAD_UNCHANGED));
+}
+
+//------------------------------------------------------------------------------
+// Prepare a gray, BGR or BGRA image (of any depth) as the watermark. Images
+// without alpha are opaque
+//------------------------------------------------------------------------------
+bool Watermark::setImage(const Mat &image) {
+  mSize = Size();
+  mSpans.clear();
+
+  for (int channels = 0; channels < 5; channels++) {
+    mForegrounds[channels].release();
+    mAlphas[channels].release();
+  }
+
+  if (image.empty()) {
+    return false;
+  }
+
+  Mat bgra;
+
+  switch (image.channels()) {
+    case 1: cvtColor(image, bgra, COLOR_GRAY2BGRA);
+      break;
+
+    case 3: cvtColor(image, bgra, COLOR_BGR2BGRA);
+      break;
+
+    case 4: bgra = image;
+      break;
+
+    default: return false;
+  }
+
+  if (bgra.depth() != CV_8U) {
+    bgra.convertTo(bgra, CV_8U, (bgra.depth() == CV_16U) ? 1.0 / 257.0 : 1.0);
+  }
+
+  mSize = bgra.size();
+  mSpans.resize(mSize.height);
+
+  mForegrounds[1].create(mSize, CV_8UC1);
+  mForegrounds[3].create(mSize, CV_8UC3);
+  mForegrounds[4] = bgra;
+
+  mAlphas[1].create(mSize, CV_8UC1);
+  mAlphas[3].create(mSize, CV_8UC3);
+  mAlphas[4].create(mSize, CV_8UC4);
+
+  for (int y = 0; y < mSize.height; y++) {
+    const unsigned char *pixel = bgra.ptr(y);
+    int spanStart = -1;
+
+    for (int x = 0; x < mSize.width; x++, pixel += 4) {
+      const unsigned char alpha = pixel[3];
+
+      // Gray images get the brightness of the watermark
+      mForegrounds[1].ptr(y)[x] = (unsigned char) brightness(pixel[0], pixel[1], pixel[2]);
+      mAlphas[1].ptr(y)[x] = alpha;
+
+      for (int c = 0; c < 3; c++) {
+        mForegrounds[3].ptr(y)[x * 3 + c] = pixel[c];
+        mAlphas[3].ptr(y)[x * 3 + c] = alpha;
+      }
+
+      for (int c = 0; c < 4; c++) {
+        mAlphas[4].ptr(y)[x * 4 + c] = alpha;
+      }
+
+      if (alpha && spanStart < 0) {
+        spanStart = x;
+      } else if (!alpha && spanStart >= 0) {
+        mSpans[y].push_back(Range(spanStart, x));
+        spanStart = -1;
+      }
+    }
+
+    if (spanStart >= 0) {
+      mSpans[y].push_back(Range(spanStart, mSize.width));
+    }
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Watermark::empty() const {
+  return mSpans.empty();
+}
+
+//------------------------------------------------------------------------------
+// Approximate number of bytes held by the prepared layouts and spans
+//------------------------------------------------------------------------------
+size_t Watermark::getMemoryUsage() const {
+  size_t bytes = 0;
+
+  for (int channels = 0; channels < 5; channels++) {
+    bytes += mForegrounds[channels].total() * mForegrounds[channels].elemSize();
+    bytes += mAlphas[channels].total() * mAlphas[channels].elemSize();
+  }
+
+  for (size_t y = 0; y < mSpans.size(); y++) {
+    bytes += sizeof(mSpans[y]) + mSpans[y].size() * sizeof(Range);
+  }
+
+  return bytes;
+}
+
+//------------------------------------------------------------------------------
+// Composite onto an image (or a band of one starting at firstRow) with the
+// opacity of every pixel scaled by amount (0-1)
+//------------------------------------------------------------------------------
+void Watermark::applyFixed(Mat &image, int firstRow, double amount) const {
+  const double strength = min(max(amount, 0.0), 1.0) * WATERMARK_ONE;
+
+  composite(image, firstRow, 0, (unsigned short) lround(strength));
+}
+
+//------------------------------------------------------------------------------
+// Composite with the opacity of every pixel scaled by
+//
+//   (blendMax - blendMin) * log10(9 * (brightness / 255) + 1) + blendMin
+//
+// where brightness is that of the image pixel under it, so the watermark
+// stands out less on dark areas
+//------------------------------------------------------------------------------
+void Watermark::applyAdaptive(Mat &image, int firstRow, double blendMin, double blendMax) const {
+  const double blendDelta = blendMax - blendMin;
+  const double normFactor = 9.0 / 255.0;
+
+  unsigned short curve[256];
+
+  for (int i = 0; i < 256; i++) {
+    const double blend = blendDelta * log10(1.0 + normFactor * (double) i) + blendMin;
+
+    curve[i] = (unsigned short) lround(min(max(blend, 0.0), 1.0) * WATERMARK_ONE);
+  }
+
+  composite(image, firstRow, curve, 0);
+}
+
+//------------------------------------------------------------------------------
+// Composites a range of bands of rows of the image
+//------------------------------------------------------------------------------
+class WatermarkBandBody : public ParallelLoopBody {
+ public:
+
+  WatermarkBandBody(const Watermark &watermark,
+                    Mat &image,
+                    int firstRow,
+                    const unsigned short *curve,
+                    unsigned short strength,
+                    int bands) :
+      mWatermark(watermark),
+      mImage(image),
+      mFirstRow(firstRow),
+      mpCurve(curve),
+      mStrength(strength),
+      mBands(bands) {
+  }
+
+  virtual void operator()(const Range &range) const;
+
+ private:
+
+  const Watermark &mWatermark;
+  Mat &mImage;
+  int mFirstRow;
+  const unsigned short *mpCurve;
+  unsigned short mStrength;
+  int mBands;
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void WatermarkBandBody::operator()(const Range &range) const {
+  for (int i = range.start; i < range.end; i++) {
+    const int first = (int) ((long) mImage.rows * i / mBands);
+    const int last = (int) ((long) mImage.rows * (i + 1) / mBands);
+
+    mWatermark.compositeRows(mImage, mFirstRow, mpCurve, mStrength, Range(first, last));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Rows only depend on themselves, so large images are split into bands of
+// rows that run on the job's threads (see Executor::parallelFor). Other
+// channel counts than 1, 3 and 4 are left alone
+//------------------------------------------------------------------------------
+void Watermark::composite(Mat &image, int firstRow, const unsigned short *curve, unsigned short strength) const {
+  if (empty() || image.depth() != CV_8U) {
+    return;
+  }
+
+  const int bands = max(min(Executor::getNumThreads(), image.rows / WATERMARK_MIN_BAND_ROWS), 1);
+
+  Executor::parallelFor(Range(0, bands), WatermarkBandBody(*this, image, firstRow, curve, strength, bands));
+}
+
+//------------------------------------------------------------------------------
+// Pick the compositor for the channel count of the image
+//------------------------------------------------------------------------------
+void Watermark::compositeRows(Mat &image,
+                              int firstRow,
+                              const unsigned short *curve,
+                              unsigned short strength,
+                              const Range &rows) const {
+  switch (image.channels()) {
+    case 1: compositeRows<1>(image, firstRow, curve, strength, rows);
+      break;
+
+    case 3: compositeRows<3>(image, firstRow, curve, strength, rows);
+      break;
+
+    case 4: compositeRows<4>(image, firstRow, curve, strength, rows);
+      break;
+
+    default: break;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Composite every span of the watermark row under each image row, once per
+// horizontal repeat. With a curve the strength of each pixel comes from the
+// brightness of the image under it, otherwise every pixel gets strength
+//------------------------------------------------------------------------------
+template <int Channels>
+void Watermark::compositeRows(Mat &image,
+                              int firstRow,
+                              const unsigned short *curve,
+                              unsigned short strength,
+                              const Range &rows) const {
+  const Mat &foregrounds = mForegrounds[Channels];
+  const Mat &alphas = mAlphas[Channels];
+
+  // Strength of every element of the widest possible span
+  vector<unsigned short> strengths(mSize.width * Channels, strength);
+
+  for (int y = rows.start; y < rows.end; y++) {
+    const int wy = (firstRow + y) % mSize.height;
+    const vector<Range> &spans = mSpans[wy];
+
+    if (spans.empty()) {
+      continue;
+    }
+
+    unsigned char *row = image.ptr(y);
+    const unsigned char *foreground = foregrounds.ptr(wy);
+    const unsigned char *alpha = alphas.ptr(wy);
+
+    for (int tile = 0; tile < image.cols; tile += mSize.width) {
+      for (size_t i = 0; i < spans.size(); i++) {
+        const int start = tile + spans[i].start;
+        const int end = min(tile + spans[i].end, image.cols);
+
+        if (start >= end) {
+          break;
+        }
+
+        unsigned char *pixels = row + start * Channels;
+
+        if (curve) {
+          for (int x = 0; x < end - start; x++) {
+            const unsigned char *pixel = pixels + x * Channels;
+            const unsigned short pixelStrength = curve[(Channels == 1) ? pixel[0] :
+                                                       brightness(pixel[0], pixel[1], pixel[2])];
+
+            for (int c = 0; c < Channels; c++) {
+              strengths[x * Channels + c] = pixelStrength;
+            }
+          }
+        }
+
+        blend(pixels,
+              foreground + spans[i].start * Channels,
+              alpha + spans[i].start * Channels,
+              strengths.data(),
+              (end - start) * Channels);
+      }
+    }
+  }
+}
@@ -0,0 +1,103 @@
+#ifndef WATERMARK_HPP
+#define WATERMARK_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+//------------------------------------------------------------------------------
+// A watermark prepared for compositing onto 8-bit gray, BGR or BGRA images.
+// The watermark is tiled over the image from its top left corner. The
+// foreground and alpha are laid out once per image channel count so a row
+// of the watermark lines up element for element with a row of the image, and
+// each row keeps the spans of pixels that aren't fully transparent so
+// nothing else is touched. Blending is 8.8 fixed-point, vectorized with SSE2
+// and with AVX2 when the CPU supports it.
+//
+// The opacity of a watermark pixel is its alpha times either a fixed amount
+// or, when adaptive, a curve of the brightness of the image pixel under it
+// (looked up in a 256 entry table)
+//------------------------------------------------------------------------------
+class Watermark : boost::noncopyable {
+ public:
+
+  Watermark();
+
+  bool load(const std::string &file);
+  bool setImage(const cv::Mat &image);
+  bool empty() const;
+  size_t getMemoryUsage() const;
+
+  void applyFixed(cv::Mat &image, int firstRow, double amount) const;
+  void applyAdaptive(cv::Mat &image, int firstRow, double blendMin, double blendMax) const;
+
+ private:
+
+  friend class WatermarkBandBody;
+
+  template <int Channels>
+  void compositeRows(cv::Mat &image,
+                     int firstRow,
+                     const unsigned short *curve,
+                     unsigned short strength,
+                     const cv::Range &rows) const;
+
+  void compositeRows(cv::Mat &image,
+                     int firstRow,
+                     const unsigned short *curve,
+                     unsigned short strength,
+                     const cv::Range &rows) const;
+
+  void composite(cv::Mat &image, int firstRow, const unsigned short *curve, unsigned short strength) const;
+
+  cv::Size mSize;
+
+  // Foreground and alpha (repeated for each channel) of the watermark for
+  // images with 1, 3 and 4 channels, indexed by the channel count
+  cv::Mat mForegrounds[5];
+  cv::Mat mAlphas[5];
+
+  // Pixel ranges of each row that aren't fully transparent
+  std::vector<std::vector<cv::Range> > mSpans;
+
+};
+
+#endif // WATERMARK_HPP
@@ -0,0 +1,174 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./watermark_cache.hpp"
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+// Boost
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+namespace {
+
+typedef tuple<string, time_t, uintmax_t> WatermarkKey;
+typedef list<WatermarkKey> WatermarkUsage;
+
+struct WatermarkEntry {
+  WatermarkPtr watermark;
+  size_t bytes;
+
+  // Position in the usage list (most recently used at the front)
+  WatermarkUsage::iterator usage;
+};
+
+mutex cacheMutex;
+map<WatermarkKey, WatermarkEntry> cache;
+WatermarkUsage usage;
+size_t cacheBytes = 0;
+unsigned long cacheHits = 0;
+unsigned long cacheMisses = 0;
+
+//------------------------------------------------------------------------------
+// Drop the least recently used entries until bytes more fit under the cap.
+// Must be called with the lock held
+//------------------------------------------------------------------------------
+void evict(size_t bytes) {
+  while (!usage.empty() && cacheBytes + bytes > ARION_WATERMARK_CACHE_BYTES) {
+    map<WatermarkKey, WatermarkEntry>::iterator oldest = cache.find(usage.back());
+
+    cacheBytes -= oldest->second.bytes;
+    cache.erase(oldest);
+    usage.pop_back();
+  }
+}
+
+}
+
+namespace WatermarkCache {
+
+//------------------------------------------------------------------------------
+// Returns the prepared watermark for file, reading it on a miss, or null if
+// the file can't be read. hits and misses are the counters as of this lookup,
+// so callers on other threads don't change them. Two threads missing on the
+// same file at once both read it, which is harmless since either copy is
+// correct
+//------------------------------------------------------------------------------
+WatermarkPtr get(const string &file, bool &hit, unsigned long &hits, unsigned long &misses) {
+  hit = false;
+
+  boost::system::error_code error;
+  const time_t modified = boost::filesystem::last_write_time(file, error);
+
+  if (error) {
+    getCounters(hits, misses);
+    return WatermarkPtr();
+  }
+
+  const uintmax_t size = boost::filesystem::file_size(file, error);
+
+  if (error) {
+    getCounters(hits, misses);
+    return WatermarkPtr();
+  }
+
+  const WatermarkKey key(file, modified, size);
+
+  {
+    lock_guard<mutex> lock(cacheMutex);
+
+    map<WatermarkKey, WatermarkEntry>::iterator found = cache.find(key);
+
+    if (found != cache.end()) {
+      usage.splice(usage.begin(), usage, found->second.usage);
+      cacheHits++;
+      hit = true;
+
+      hits = cacheHits;
+      misses = cacheMisses;
+
+      return found->second.watermark;
+    }
+
+    cacheMisses++;
+
+    hits = cacheHits;
+    misses = cacheMisses;
+  }
+
+  shared_ptr<Watermark> watermark = make_shared<Watermark>();
+
+  if (!watermark->load(file)) {
+    return WatermarkPtr();
+  }
+
+  const size_t bytes = watermark->getMemoryUsage();
+
+  // Too large to ever fit, used once and dropped
+  if (bytes > ARION_WATERMARK_CACHE_BYTES) {
+    return watermark;
+  }
+
+  lock_guard<mutex> lock(cacheMutex);
+
+  if (cache.find(key) == cache.end()) {
+    evict(bytes);
+
+    usage.push_front(key);
+
+    WatermarkEntry &entry = cache[key];
+    entry.watermark = watermark;
+    entry.bytes = bytes;
+    entry.usage = usage.begin();
+
+    cacheBytes += bytes;
+  }
+
+  return watermark;
+}
+
+//------------------------------------------------------------------------------
+// Hits and misses since the process started
+//------------------------------------------------------------------------------
+void getCounters(unsigned long &hits, unsigned long &misses) {
+  lock_guard<mutex> lock(cacheMutex);
+
+  hits = cacheHits;
+  misses = cacheMisses;
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef WATERMARK_CACHE_HPP
+#define WATERMARK_CACHE_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <memory>
+#include <string>
+
+// Local
+#include "./watermark.hpp"
+
+// Prepared watermarks are evicted (least recently used first) once the cache
+// holds more than this many bytes
+#ifndef ARION_WATERMARK_CACHE_BYTES
+#define ARION_WATERMARK_CACHE_BYTES (64 * 1024 * 1024)
+#endif
+
+typedef std::shared_ptr<const Watermark> WatermarkPtr;
+
+//------------------------------------------------------------------------------
+// Process wide cache of prepared watermarks, so every resize of a job (and
+// every job of a process linking carion) decodes a given watermark file once.
+// Entries are keyed by path, modification time and file size so a file that
+// is replaced on disk is read again. Watermarks are immutable once prepared
+// and can be shared between threads
+//------------------------------------------------------------------------------
+namespace WatermarkCache {
+
+WatermarkPtr get(const std::string &file, bool &hit, unsigned long &hits, unsigned long &misses);
+
+void getCounters(unsigned long &hits, unsigned long &misses);
+
+}
+
+#endif // WATERMARK_CACHE_HPP
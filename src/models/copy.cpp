@@ -37,6 +37,7 @@
 #include <iostream>
 #include <string>
 #include <ostream>
+#include <limits>
 #include <fstream>
 
 // Boost
@@ -95,6 +96,39 @@ void Copy::setup(const ptree &params) {
   }
 }
 
+//------------------------------------------------------------------------------
+// Pixels are never looked at so the source can be decoded at any scale
+//------------------------------------------------------------------------------
+double Copy::getMaxSourceReduction(const cv::Size &sourceSize) const {
+  return std::numeric_limits<double>::max();
+}
+
+//------------------------------------------------------------------------------
+// No pixels are read
+//------------------------------------------------------------------------------
+cv::Rect Copy::getSourceRegion(const cv::Size &sourceSize) const {
+  return cv::Rect();
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Copy::canStream(const cv::Size &sourceSize) const {
+  return true;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Copy::canUsePlanes() const {
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// The file is copied as is and its metadata written back to the copy
+//------------------------------------------------------------------------------
+unsigned Copy::getRequirements() const {
+  return OperationRequiresSourceBytes | OperationRequiresMetadata;
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 bool Copy::getStatus() const {
@@ -112,10 +146,18 @@ bool Copy::run() {
     return false;
   }
 
-  std::ifstream src(mInputFile.c_str(), std::ios::binary);
-  std::ofstream dst(mOutputFile.c_str(), std::ios::binary);
+  // Write the bytes that are already in memory rather than reading the input
+  // file a second time
+  if (mpSourceData) {
+    std::ofstream dst(mOutputFile.c_str(), std::ios::binary);
 
-  dst << src.rdbuf();
+    dst.write(mpSourceData, mSourceLength);
+  } else {
+    std::ifstream src(mInputFile.c_str(), std::ios::binary);
+    std::ofstream dst(mOutputFile.c_str(), std::ios::binary);
+
+    dst << src.rdbuf();
+  }
 
   //--------------------------------
   //  Inherit EXIF data if needed
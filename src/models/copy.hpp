@@ -67,6 +67,11 @@ class Copy : public Operation {
   virtual void setup(const boost::property_tree::ptree &params);
   virtual bool run();
   virtual bool getJpeg(std::vector<unsigned char> &data);
+  virtual double getMaxSourceReduction(const cv::Size &sourceSize) const;
+  virtual cv::Rect getSourceRegion(const cv::Size &sourceSize) const;
+  virtual bool canStream(const cv::Size &sourceSize) const;
+  virtual bool canUsePlanes() const;
+  virtual unsigned getRequirements() const;
 
   std::string getOutputFile() const;
   bool getStatus() const;
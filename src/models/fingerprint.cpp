@@ -125,6 +125,13 @@ void Fingerprint::decodeType(const std::string &type) {
   }
 }
 
+//------------------------------------------------------------------------------
+// Only the decoded pixels are hashed
+//------------------------------------------------------------------------------
+unsigned Fingerprint::getRequirements() const {
+  return OperationRequiresPixels;
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 bool Fingerprint::run() {
@@ -72,6 +72,7 @@ class Fingerprint : public Operation {
   virtual void setup(const boost::property_tree::ptree &params);
   virtual bool run();
   virtual bool getJpeg(std::vector<unsigned char> &data);
+  virtual unsigned getRequirements() const;
 
   void setType(const std::string &type);
   bool getStatus() const;
@@ -51,7 +51,12 @@ Operation::Operation() :
     mpExifData(0),
     mpXmpData(0),
     mpIccProfile(0),
-    mpIptcData(0) {
+    mpIptcData(0),
+    mpSourceData(0),
+    mSourceLength(0),
+    mOrientation(1),
+    mpPyramid(0),
+    mpPixelSource(0) {
 }
 
 //------------------------------------------------------------------------------
@@ -97,4 +102,96 @@ void Operation::setIccProfile(Exiv2::DataBuf *iccProfile) {
 //------------------------------------------------------------------------------
 void Operation::setImage(cv::Mat &image) {
   mImage = image;
+  mSourceSize = image.size();
+  mSourceRegion = cv::Rect(cv::Point(0, 0), mSourceSize);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Operation::setSourceSize(const cv::Size &sourceSize) {
+  mSourceSize = sourceSize;
+  mSourceRegion = cv::Rect(cv::Point(0, 0), mSourceSize);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Operation::setSourceRegion(const cv::Rect &sourceRegion) {
+  mSourceRegion = sourceRegion;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Operation::setSourcePlanes(const std::vector<cv::Mat> &sourcePlanes) {
+  mSourcePlanes = sourcePlanes;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Operation::setSourceBytes(const char *data, size_t length) {
+  mpSourceData = data;
+  mSourceLength = length;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Operation::setOrientation(long orientation) {
+  mOrientation = orientation;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Operation::setPyramid(ImagePyramid *pyramid) {
+  mpPyramid = pyramid;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Operation::setPixelSource(const Operation *operation) {
+  mpPixelSource = operation;
+}
+
+//------------------------------------------------------------------------------
+// By default assume that the operation needs pixels and metadata
+//------------------------------------------------------------------------------
+unsigned Operation::getRequirements() const {
+  return OperationRequiresPixels | OperationRequiresMetadata;
+}
+
+//------------------------------------------------------------------------------
+// By default assume that the operation needs the full resolution source
+//------------------------------------------------------------------------------
+double Operation::getMaxSourceReduction(const cv::Size &sourceSize) const {
+  return 1.0;
+}
+
+//------------------------------------------------------------------------------
+// By default assume that the operation reads the entire source
+//------------------------------------------------------------------------------
+cv::Rect Operation::getSourceRegion(const cv::Size &sourceSize) const {
+  return cv::Rect(cv::Point(0, 0), sourceSize);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Operation::canStream(const cv::Size &sourceSize) const {
+  return false;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Operation::canUsePlanes() const {
+  return false;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Operation::canApplyOrientation() const {
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// By default nothing is shared
+//------------------------------------------------------------------------------
+std::string Operation::getPipelineKey() const {
+  return std::string();
 }
@@ -51,6 +51,15 @@
 #include "../thirdparty/rapidjson/prettywriter.h"
 #include "../thirdparty/rapidjson/stringbuffer.h"
 
+class ImagePyramid;
+
+// What an operation reads from the source (see Operation::getRequirements)
+enum {
+  OperationRequiresPixels = 1,
+  OperationRequiresMetadata = 2,
+  OperationRequiresSourceBytes = 4
+};
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 class Operation : boost::noncopyable {
@@ -78,6 +87,43 @@ class Operation : boost::noncopyable {
   void setIptcData(const Exiv2::IptcData *iptcData);
   void setIccProfile(Exiv2::DataBuf *iccProfile);
   void setImage(cv::Mat &image);
+  void setSourceSize(const cv::Size &sourceSize);
+  void setSourceRegion(const cv::Rect &sourceRegion);
+  void setSourcePlanes(const std::vector<cv::Mat> &sourcePlanes);
+  void setSourceBytes(const char *data, size_t length);
+  void setOrientation(long orientation);
+  void setPyramid(ImagePyramid *pyramid);
+  void setPixelSource(const Operation *operation);
+
+  // Combination of the OperationRequires flags. The source pixels are only
+  // decoded once an operation that requires them is about to run
+  virtual unsigned getRequirements() const;
+
+  // The largest factor (in each dimension) that the source image can be
+  // reduced by during decoding without affecting the result. Operations that
+  // need every source pixel return 1.0
+  virtual double getMaxSourceReduction(const cv::Size &sourceSize) const;
+
+  // The part of the source (in full resolution coordinates) that the
+  // operation reads. An empty rectangle means no pixels are needed
+  virtual cv::Rect getSourceRegion(const cv::Size &sourceSize) const;
+
+  // True if the operation can run without the decoded source, i.e. it needs
+  // no pixels or its pixels can be produced while streaming the source
+  virtual bool canStream(const cv::Size &sourceSize) const;
+
+  // True if the operation can run on the Y, Cb and Cr planes of a JPEG
+  // instead of the decoded BGR image
+  virtual bool canUsePlanes() const;
+
+  // True if the operation can take the source in its stored orientation and
+  // apply the EXIF orientation itself (see mOrientation)
+  virtual bool canApplyOrientation() const;
+
+  // Identifies the pixels the operation produces before encoding. Operations
+  // with the same non-empty key produce identical pixels, so only the first
+  // of them has to compute them (see setPixelSource)
+  virtual std::string getPipelineKey() const;
 
  protected:
 
@@ -91,6 +137,36 @@ class Operation : boost::noncopyable {
   Exiv2::DataBuf *mpIccProfile;
   cv::Mat mImage;
 
+  // Full resolution dimensions of the source (mImage may have been decoded
+  // at a reduced scale)
+  cv::Size mSourceSize;
+
+  // The part of the source that mImage covers, in full resolution
+  // coordinates (the whole source unless only a region was decoded)
+  cv::Rect mSourceRegion;
+
+  // Y, Cb and Cr planes of the source when it was decoded without
+  // converting to BGR (mImage is empty in that case)
+  std::vector<cv::Mat> mSourcePlanes;
+
+  // The undecoded source file (may be null when the source was given as an
+  // image)
+  const char *mpSourceData;
+  size_t mSourceLength;
+
+  // EXIF orientation that still has to be applied to mImage (or the source
+  // planes). mSourceSize and mSourceRegion are always oriented
+  long mOrientation;
+
+  // Reduced copies of the source shared with the other operations (may be
+  // null)
+  ImagePyramid *mpPyramid;
+
+  // Earlier operation with the same pipeline key whose pixels this one
+  // encodes instead of computing its own (may be null). It has always run
+  // by the time this one does
+  const Operation *mpPixelSource;
+
 };
 
 #endif // OPERATION_HPP
@@ -37,6 +37,7 @@
 #include <iostream>
 #include <string>
 #include <ostream>
+#include <limits>
 
 // Boost
 #include <boost/exception/info.hpp>
@@ -97,6 +98,38 @@ void Read_meta::setup(const ptree &params) {
   }
 }
 
+//------------------------------------------------------------------------------
+// Pixels are never looked at so the source can be decoded at any scale
+//------------------------------------------------------------------------------
+double Read_meta::getMaxSourceReduction(const cv::Size &sourceSize) const {
+  return std::numeric_limits<double>::max();
+}
+
+//------------------------------------------------------------------------------
+// No pixels are read
+//------------------------------------------------------------------------------
+cv::Rect Read_meta::getSourceRegion(const cv::Size &sourceSize) const {
+  return cv::Rect();
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Read_meta::canStream(const cv::Size &sourceSize) const {
+  return true;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Read_meta::canUsePlanes() const {
+  return true;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+unsigned Read_meta::getRequirements() const {
+  return OperationRequiresMetadata;
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 bool Read_meta::getStatus() const {
@@ -33,16 +33,25 @@
 
 #include "./resize.hpp"
 #include "../utils/utils.hpp"
+#include "../codecs/jpeg_encoder.hpp"
+#include "../imgproc/image_pyramid.hpp"
+#include "../imgproc/resampler.hpp"
+#include "../imgproc/linear_light.hpp"
+#include "../imgproc/unsharp_mask.hpp"
+#include "../imgproc/box_blur.hpp"
 
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <ostream>
+#include <sstream>
 
 // Boost
 #include <boost/exception/info.hpp>
 #include <boost/exception/error_info.hpp>
 #include <boost/exception/all.hpp>
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
 
 // OpenCV
 #include <opencv2/imgproc.hpp>
@@ -64,16 +73,28 @@ Resize::Resize() :
     mWidth(0),
     mQuality(92),
     mInterpolation(INTER_AREA),
+    mResampleFilter(ResampleFilterNone),
+    mResizeStrategy(ResizeStrategyAuto),
     mGravity(ResizeGravitytCenter),
     mPreFilter(false),
+    mLinearLight(false),
+    mTileMinPixels(ARION_RESIZE_TILE_MIN_PIXELS),
     mSharpenAmount(0),
     mSharpenRadius(0.0),
+    mSharpenThreshold(0),
     mPreserveMeta(false),
     mWatermarkFile(),
     mWatermarkType(ResizeWatermarkTypeStandard),
     mWatermarkAmount(0.05),
     mWatermarkMin(0.05),
     mWatermarkMax(0.5),
+    mPreResized(false),
+    mPyramidLevel(0),
+    mTiled(false),
+    mWatermarkCached(false),
+    mWatermarkCacheHits(0),
+    mWatermarkCacheMisses(0),
+    mPixelsReused(false),
     mStatus(ResizeStatusDidNotTry),
     mErrorMessage() {
 }
@@ -133,6 +154,11 @@ void Resize::setup(const ptree &params) {
     setInterpolation(*interpolation);
   }
 
+  boost::optional <string> resize_strategy = params.get_optional<string>("resize_strategy");
+  if (resize_strategy) {// Not required
+    setResizeStrategy(*resize_strategy);
+  }
+
   boost::optional<bool> pre_filter = params.get_optional<bool>("pre_filter");
   if (pre_filter) {//optional
     mPreFilter = true;
@@ -140,6 +166,16 @@ void Resize::setup(const ptree &params) {
     mPreFilter = false;
   }
 
+  boost::optional<bool> linear_light = params.get_optional<bool>("linear_light");
+  if (linear_light) {// Not required
+    setLinearLight(*linear_light);
+  }
+
+  boost::optional<unsigned long> tile_min_pixels = params.get_optional<unsigned long>("tile_min_pixels");
+  if (tile_min_pixels) {// Not required
+    setTileMinPixels(*tile_min_pixels);
+  }
+
   boost::optional<unsigned> sharpen_amount = params.get_optional<unsigned>("sharpen_amount");
   if (sharpen_amount) {// Not required
     validateSharpenAmount(*sharpen_amount);
@@ -150,6 +186,11 @@ void Resize::setup(const ptree &params) {
     validateSharpenRadius(*sharpen_radius);
   }
 
+  boost::optional<unsigned> sharpen_threshold = params.get_optional<unsigned>("sharpen_threshold");
+  if (sharpen_threshold) {// Not required
+    validateSharpenThreshold(*sharpen_threshold);
+  }
+
   boost::optional <string> watermark_type = params.get_optional<string>("watermark_type");
   if (watermark_type) {// Not required
     validateWatermarkType(*watermark_type);
@@ -200,6 +241,8 @@ void Resize::setQuality(unsigned quality) {
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 void Resize::setInterpolation(const std::string &interpolation) {
+  mResampleFilter = ResampleFilterNone;
+
   if (interpolation == "nearest") {
     mInterpolation = INTER_NEAREST;
   } else if (interpolation == "linear") {
@@ -208,10 +251,32 @@ void Resize::setInterpolation(const std::string &interpolation) {
     mInterpolation = INTER_CUBIC;
   } else if (interpolation == "area") {
     mInterpolation = INTER_AREA;
-  } else if (interpolation == "lanczon4") {
+  } else if (interpolation == "lanczos4" || interpolation == "lanczon4") {
+    // "lanczon4" is still accepted for existing jobs
     mInterpolation = INTER_LANCZOS4;
   } else if (interpolation == "linear_exact") {
     mInterpolation = INTER_LINEAR_EXACT;
+  } else if (interpolation == "box") {
+    mResampleFilter = ResampleFilterBox;
+  } else if (interpolation == "catmull_rom") {
+    mResampleFilter = ResampleFilterCatmullRom;
+  } else if (interpolation == "mitchell") {
+    mResampleFilter = ResampleFilterMitchell;
+  } else if (interpolation == "lanczos3") {
+    mResampleFilter = ResampleFilterLanczos3;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Unknown strategies fall back to picking one automatically
+//------------------------------------------------------------------------------
+void Resize::setResizeStrategy(const std::string &resizeStrategy) {
+  if (resizeStrategy == "exact") {
+    mResizeStrategy = ResizeStrategyExact;
+  } else if (resizeStrategy == "fast") {
+    mResizeStrategy = ResizeStrategyFast;
+  } else {
+    mResizeStrategy = ResizeStrategyAuto;
   }
 }
 
@@ -233,12 +298,31 @@ void Resize::setSharpenRadius(float radius) {
   validateSharpenRadius(radius);
 }
 
+//------------------------------------------------------------------------------
+// 0 never tiles
+//------------------------------------------------------------------------------
+void Resize::setTileMinPixels(unsigned long tileMinPixels) {
+  mTileMinPixels = tileMinPixels;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::setSharpenThreshold(unsigned threshold) {
+  validateSharpenThreshold(threshold);
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 void Resize::setPreserveMeta(bool preserveMeta) {
   mPreserveMeta = preserveMeta;
 }
 
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::setLinearLight(bool linearLight) {
+  mLinearLight = linearLight;
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 void Resize::setWatermarkUrl(const std::string &watermarkUrl) {
@@ -296,6 +380,15 @@ bool Resize::getJpeg(std::vector<unsigned char> &data) {
   compression_params.push_back(IMWRITE_JPEG_PROGRESSIVE);
   compression_params.push_back(1);
 
+  if (mTiled) {
+    data = mJpegData;
+    return true;
+  }
+
+  if (!mResizedPlanes.empty()) {
+    return JpegEncoder::encodePlanes(mResizedPlanes, mQuality, true, data);
+  }
+
   return imencode(".jpg", mImageResizedFinal, data, compression_params);
 }
 
@@ -465,36 +558,40 @@ void Resize::validateSharpenRadius(float sharpenRadius) {
 
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
-void Resize::computeSizeSquare() {
+void Resize::validateSharpenThreshold(unsigned sharpenThreshold) {
+  if (sharpenThreshold <= 255) {
+    mSharpenThreshold = sharpenThreshold;
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::computeSizeSquare(const Size &sourceSize, Rect &cropRegion, Size &size) const {
   // Don't assume the height and width the user specified are the same
   // and just use the width
-  mSize = Size(mWidth, mWidth);
+  size = Size(mWidth, mWidth);
 
-  const unsigned sourceHeight = (unsigned) mImage.rows;
-  const unsigned sourceWidth = (unsigned) mImage.cols;
+  const unsigned sourceHeight = (unsigned) sourceSize.height;
+  const unsigned sourceWidth = (unsigned) sourceSize.width;
 
   if (sourceHeight == sourceWidth) {
     // Easy... the image is already square
-    mImageToResize = mImage;
+    cropRegion = Rect(0, 0, sourceWidth, sourceHeight);
   } else if (sourceHeight > sourceWidth) {
     int y = round(((double) sourceHeight - (double) sourceWidth) / 2.0);
-    Rect cropRegion(0, y, sourceWidth, sourceWidth);
-
-    mImageToResize = mImage(cropRegion);
+    cropRegion = Rect(0, y, sourceWidth, sourceWidth);
   } else // sourceWidth < sourceHeight
   {
     int x = round(((double) sourceWidth - (double) sourceHeight) / 2.0);
-    Rect cropRegion(x, 0, sourceHeight, sourceHeight);
-
-    mImageToResize = mImage(cropRegion);
+    cropRegion = Rect(x, 0, sourceHeight, sourceHeight);
   }
 }
 
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
-void Resize::computeSizeWidth() {
-  const unsigned sourceHeight = (unsigned) mImage.rows;
-  const unsigned sourceWidth = (unsigned) mImage.cols;
+void Resize::computeSizeWidth(const Size &sourceSize, Rect &cropRegion, Size &size) const {
+  const unsigned sourceHeight = (unsigned) sourceSize.height;
+  const unsigned sourceWidth = (unsigned) sourceSize.width;
 
   double aspect = (double) sourceHeight / (double) sourceWidth;
 
@@ -507,16 +604,16 @@ void Resize::computeSizeWidth() {
     resizeWidth = getAspectWidth(resizeHeight, aspect);
   }
 
-  mImageToResize = mImage;
-  mSize = Size(resizeWidth, resizeHeight);
+  cropRegion = Rect(0, 0, sourceWidth, sourceHeight);
+  size = Size(resizeWidth, resizeHeight);
 
 }
 
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
-void Resize::computeSizeHeight() {
-  const unsigned sourceHeight = (unsigned) mImage.rows;
-  const unsigned sourceWidth = (unsigned) mImage.cols;
+void Resize::computeSizeHeight(const Size &sourceSize, Rect &cropRegion, Size &size) const {
+  const unsigned sourceHeight = (unsigned) sourceSize.height;
+  const unsigned sourceWidth = (unsigned) sourceSize.width;
 
   double aspect = (double) sourceHeight / (double) sourceWidth;
 
@@ -529,15 +626,15 @@ void Resize::computeSizeHeight() {
     resizeHeight = getAspectHeight(resizeWidth, aspect);
   }
 
-  mImageToResize = mImage;
-  mSize = Size(resizeWidth, resizeHeight);
+  cropRegion = Rect(0, 0, sourceWidth, sourceHeight);
+  size = Size(resizeWidth, resizeHeight);
 }
 
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
-void Resize::computeSizeFill() {
-  const unsigned sourceHeight = mImage.rows;
-  const unsigned sourceWidth = mImage.cols;
+void Resize::computeSizeFill(const Size &sourceSize, Rect &cropRegion, Size &size) const {
+  const unsigned sourceHeight = sourceSize.height;
+  const unsigned sourceWidth = sourceSize.width;
 
   double destAspect = (double) mHeight / (double) mWidth;
 
@@ -597,138 +694,496 @@ void Resize::computeSizeFill() {
 
   }
 
-  Rect cropRegion(cropX, cropY, cropWidth, cropHeight);
+  cropRegion = Rect(cropX, cropY, cropWidth, cropHeight);
+
+  size = Size(mWidth, mHeight);
 
-  mImageToResize = mImage(cropRegion);
+}
 
-  mSize = Size(mWidth, mHeight);
+//------------------------------------------------------------------------------
+// Compute the region of the full resolution source that will be used and the
+// final output dimensions. Returns false if the resize type is invalid
+//------------------------------------------------------------------------------
+bool Resize::computeGeometry(const Size &sourceSize, Rect &cropRegion, Size &size) const {
+  switch (mType) {
+    case ResizeTypeSquare:computeSizeSquare(sourceSize, cropRegion, size);
+      return true;
 
+    case ResizeTypeFixedHeight:computeSizeHeight(sourceSize, cropRegion, size);
+      return true;
+
+    case ResizeTypeFill:computeSizeFill(sourceSize, cropRegion, size);
+      return true;
+
+    case ResizeTypeFixedWidth:computeSizeWidth(sourceSize, cropRegion, size);
+      return true;
+
+    default:return false;
+  }
 }
 
 //------------------------------------------------------------------------------
+// The source can be reduced as long as the cropped region stays at least as
+// large as the output
 //------------------------------------------------------------------------------
-bool Resize::run() {
+double Resize::getMaxSourceReduction(const Size &sourceSize) const {
+  if ((mHeight == 0) || (mWidth == 0)) {
+    return 1.0;
+  }
 
-  mStatus = ResizeStatusPending;
+  Rect cropRegion;
+  Size size;
 
-  if (mImage.empty()) {
-    mStatus = ResizeStatusError;
-    mErrorMessage = "Input image data is empty";
+  if (!computeGeometry(sourceSize, cropRegion, size) || size.width <= 0 || size.height <= 0) {
+    return 1.0;
+  }
+
+  return min((double) cropRegion.width / (double) size.width,
+             (double) cropRegion.height / (double) size.height);
+}
+
+//------------------------------------------------------------------------------
+// The crop region plus enough border for the pre-filter, which reads pixels
+// outside of the crop
+//------------------------------------------------------------------------------
+Rect Resize::getSourceRegion(const Size &sourceSize) const {
+  Rect cropRegion;
+  Size size;
+
+  if (!computeGeometry(sourceSize, cropRegion, size) || cropRegion.area() <= 0) {
+    return Rect(Point(0, 0), sourceSize);
+  }
+
+  if (mPreFilter) {
+    // Same sigma as run()
+    const int border = BoxBlur::radius(cropRegion.width / 1000.0) + 1;
+
+    cropRegion.x -= border;
+    cropRegion.y -= border;
+    cropRegion.width += 2 * border;
+    cropRegion.height += 2 * border;
+  }
+
+  return cropRegion & Rect(Point(0, 0), sourceSize);
+}
+
+//------------------------------------------------------------------------------
+// Streaming uses area resampling, so only area reductions without a
+// pre-filter (which needs the whole crop) can be streamed
+//------------------------------------------------------------------------------
+bool Resize::canStream(const Size &sourceSize) const {
+  if (mPreFilter || mLinearLight || (mHeight == 0) || (mWidth == 0)) {
     return false;
   }
 
-  //---------------------------------------------------
-  //  Perform the resize operation and write to disk
-  //---------------------------------------------------
-  try {
+  if (mInterpolation != INTER_AREA || mResampleFilter != ResampleFilterNone) {
+    return false;
+  }
 
-    switch (mType) {
-      //--------------------------
-      //      Square resize
-      //--------------------------
-      case ResizeTypeSquare: {
-        computeSizeSquare();
-        break;
-      }
+  Rect cropRegion;
+  Size size;
 
-        //--------------------------
-        //  Height priority resize
-        //--------------------------
-      case ResizeTypeFixedHeight: {
-        computeSizeHeight();
-        break;
-      }
+  if (!computeGeometry(sourceSize, cropRegion, size) || size.width <= 0 || size.height <= 0) {
+    return false;
+  }
 
-        //--------------------------
-        //      Fill resize
-        //--------------------------
-      case ResizeTypeFill: {
-        computeSizeFill();
-        break;
-      }
+  return (cropRegion.width >= size.width) && (cropRegion.height >= size.height);
+}
 
-        //--------------------------
-        //  Width priority resize
-        //--------------------------
-      case ResizeTypeFixedWidth: {
-        computeSizeWidth();
-        break;
-      }
+//------------------------------------------------------------------------------
+// The planes can be resized and encoded directly unless a watermark (which is
+// composited in BGR) is applied, the resize is in linear light (which needs
+// RGB) or the output isn't a JPEG
+//------------------------------------------------------------------------------
+bool Resize::canUsePlanes() const {
+  if (mWatermarkFile.length() || mLinearLight) {
+    return false;
+  }
 
-        //--------------------------
-        //  Error (unknown type)
-        //--------------------------
-      default:mStatus = ResizeStatusError;
-        mErrorMessage = "Invalid resize type";
-        return false;
-    }
+  return isJpegOutput();
+}
 
-    if (mHeight == 0) {
-      mStatus = ResizeStatusError;
-      mErrorMessage = "Height cannot be 0";
-      return false;
-    }
+//------------------------------------------------------------------------------
+// Outputs without a file are only ever fetched as JPEGs (see getJpeg)
+//------------------------------------------------------------------------------
+bool Resize::isJpegOutput() const {
+  string extension = mOutputFile.substr(mOutputFile.find_last_of('.') + 1);
+  transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
 
-    if (mWidth == 0) {
-      mStatus = ResizeStatusError;
-      mErrorMessage = "Width cannot be 0";
-      return false;
+  return mOutputFile.empty() || extension == "jpg" || extension == "jpeg";
+}
+
+//------------------------------------------------------------------------------
+// Large JPEG outputs are produced a band at a time (see runTiled). Oriented
+// outputs are left alone since a band of the output is a column of the
+// resized image. Only needs the source size, so it can be asked before the
+// operation runs (see getPipelineKey)
+//------------------------------------------------------------------------------
+bool Resize::willTile() const {
+  if (!mSourcePlanes.empty() || mPreResized || mOrientation > 1) {
+    return false;
+  }
+
+  Rect cropRegion;
+  Size size;
+
+  if (mTileMinPixels == 0 || !computeGeometry(mSourceSize, cropRegion, size) ||
+      (unsigned long) size.area() < mTileMinPixels) {
+    return false;
+  }
+
+  return isJpegOutput();
+}
+
+//------------------------------------------------------------------------------
+// Tiling works on 8 bit grayscale or BGR images only
+//------------------------------------------------------------------------------
+bool Resize::canTile(const Mat &imageToResize) const {
+  if (imageToResize.depth() != CV_8U || (imageToResize.channels() != 1 && imageToResize.channels() != 3)) {
+    return false;
+  }
+
+  return willTile();
+}
+
+//------------------------------------------------------------------------------
+// Resize, sharpen, watermark and encode the output a band of rows at a time,
+// so each band is finished while it is still in cache and the full size
+// sharpened output never exists. Our resampler and OpenCV's area reductions
+// produce each band (plus the rows the sharpen needs around it) directly, see
+// getAreaBandPeriod. OpenCV's other interpolations can't be split into bands
+// with identical results, so for those the resize is done up front and only
+// the rest is banded.
+//
+// The rows handed to the encoder are the pixels the untiled path would write.
+// They are encoded with libjpeg directly (kept in mJpegData) rather than
+// through imwrite, with the same settings, so the bytes only match when
+// OpenCV links the same libjpeg
+//------------------------------------------------------------------------------
+bool Resize::runTiled(const Mat &imageToResize) {
+  // Whole JPEG MCU rows per band
+  const int rowBytes = mSize.width * imageToResize.channels();
+  const int bandRows = max(ARION_RESIZE_TILE_BYTES / rowBytes / 16, 1) * 16;
+
+  const int areaPeriod = getAreaBandPeriod(imageToResize.size());
+
+  mImageResized.release();
+
+  // Bands that would have to be widened by more than a band are not worth it
+  if (mResampleFilter == ResampleFilterNone && (areaPeriod == 0 || areaPeriod > bandRows)) {
+    resizeImage(imageToResize, mImageResized, mSize);
+  }
+
+  const WatermarkPtr watermark = loadWatermark();
+
+  mTiled = true;
+
+  return JpegEncoder::encodeRows(mSize,
+                                 imageToResize.channels(),
+                                 bandRows,
+                                 boost::bind(&Resize::produceTile,
+                                             this,
+                                             boost::cref(imageToResize),
+                                             boost::cref(watermark),
+                                             _1,
+                                             _2),
+                                 mQuality,
+                                 true,
+                                 mJpegData);
+}
+
+//------------------------------------------------------------------------------
+// Fill rows with the finished output rows starting at firstRow. The blur
+// behind the sharpen reaches about 3 sigma, so the band is resized with a few
+// more rows on either side than that
+//------------------------------------------------------------------------------
+bool Resize::produceTile(const Mat &imageToResize, const WatermarkPtr &watermark, int firstRow, Mat &rows) const {
+  const int halo = mSharpenAmount ? (int) ceil(mSharpenRadius * 4.0) + 1 : 0;
+  const int top = max(firstRow - halo, 0);
+  const int bottom = min(firstRow + rows.rows + halo, mSize.height);
+
+  Mat resized;
+
+  if (mResampleFilter != ResampleFilterNone) {
+    Resampler::resizeRows(imageToResize, resized, mSize, mResampleFilter, mLinearLight, top, bottom - top);
+  } else if (!mImageResized.empty()) {
+    resized = mImageResized.rowRange(top, bottom);
+  } else {
+    // Widen the band to output rows that line up with source rows
+    const int period = getAreaBandPeriod(imageToResize.size());
+    const int alignedTop = top / period * period;
+    const int alignedBottom = min((bottom + period - 1) / period * period, mSize.height);
+
+    const int sourceTop = (int) ((long long) alignedTop * imageToResize.rows / mSize.height);
+    const int sourceBottom = (int) ((long long) alignedBottom * imageToResize.rows / mSize.height);
+
+    Mat aligned;
+    resizeImage(imageToResize.rowRange(sourceTop, sourceBottom), aligned, Size(mSize.width, alignedBottom - alignedTop));
+
+    resized = aligned.rowRange(top - alignedTop, bottom - alignedTop);
+  }
+
+  if (mSharpenAmount) {
+    sharpen(resized, rows, firstRow - top, rows.rows);
+  } else {
+    resized.rowRange(firstRow - top, firstRow - top + rows.rows).copyTo(rows);
+  }
+
+  applyWatermark(rows, watermark, firstRow);
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// OpenCV's area reduction weighs each source row by how much of it an output
+// row covers. Where an output row starts exactly on a source row, which
+// happens every period output rows, resizing the source rows from there on
+// gives the same output rows as resizing the whole image, so the resize can
+// be split into bands that start and end on such rows. Returns the period, or
+// 0 for other interpolations and for enlargements (which OpenCV interpolates
+// even when asked for INTER_AREA)
+//------------------------------------------------------------------------------
+int Resize::getAreaBandPeriod(const Size &sourceSize) const {
+  if (mResampleFilter != ResampleFilterNone || mInterpolation != INTER_AREA ||
+      sourceSize.width < mSize.width || sourceSize.height < mSize.height) {
+    return 0;
+  }
+
+  // Greatest common divisor of the source and output heights
+  int a = sourceSize.height;
+  int b = mSize.height;
+
+  while (b != 0) {
+    const int r = a % b;
+    a = b;
+    b = r;
+  }
+
+  return mSize.height / a;
+}
+
+//------------------------------------------------------------------------------
+// Unsharp mask rowCount rows of image starting at firstRow into sharpened.
+// The rows around them are only used by the blur
+//------------------------------------------------------------------------------
+void Resize::sharpen(const Mat &image, Mat &sharpened, int firstRow, int rowCount) const {
+  UnsharpMask::applyRows(image,
+                         sharpened,
+                         mSharpenAmount / 100.0,
+                         mSharpenRadius,
+                         mSharpenThreshold,
+                         firstRow,
+                         rowCount);
+}
+
+//------------------------------------------------------------------------------
+// The crop is mapped to the stored source and the output is oriented after
+// resizing, so only output sized pixels are rotated
+//------------------------------------------------------------------------------
+bool Resize::canApplyOrientation() const {
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Orientations 5-8 swap width and height (in either direction)
+//------------------------------------------------------------------------------
+Size Resize::orientSize(const Size &size) const {
+  if (mOrientation >= 5 && mOrientation <= 8) {
+    return Size(size.height, size.width);
+  }
+
+  return size;
+}
+
+//------------------------------------------------------------------------------
+// Hand over an image that has already been cropped and resized to the size
+// computed by computeGeometry. run() then skips straight to sharpening
+//------------------------------------------------------------------------------
+void Resize::setResizedImage(const Mat &image) {
+  mImageResized = image;
+  mPreResized = true;
+}
+
+//------------------------------------------------------------------------------
+// Map a region of the full resolution source onto the decoded image, which
+// may have been decoded at a reduced scale and may only cover part of the
+// source (see mSourceRegion). Source planes are mapped the same way using
+// their own size. The image may still be in its stored orientation, so both
+// regions are first taken back to the stored frame
+//------------------------------------------------------------------------------
+Rect Resize::mapToImage(const Rect &orientedRegion, const Size &imageSize) const {
+  const Size storedSize = orientSize(mSourceSize);
+
+  const Rect sourceRegion = Utils::unorientRect(orientedRegion, storedSize, mOrientation);
+  const Rect covered = Utils::unorientRect(mSourceRegion, storedSize, mOrientation);
+
+  if (imageSize == covered.size()) {
+    return Rect(sourceRegion.x - covered.x, sourceRegion.y - covered.y,
+                sourceRegion.width, sourceRegion.height) & Rect(Point(0, 0), imageSize);
+  }
+
+  const double sx = (double) imageSize.width / (double) covered.width;
+  const double sy = (double) imageSize.height / (double) covered.height;
+
+  int x0 = (int) round((sourceRegion.x - covered.x) * sx);
+  int y0 = (int) round((sourceRegion.y - covered.y) * sy);
+  int x1 = (int) round((sourceRegion.x + sourceRegion.width - covered.x) * sx);
+  int y1 = (int) round((sourceRegion.y + sourceRegion.height - covered.y) * sy);
+
+  x0 = min(max(x0, 0), imageSize.width - 1);
+  y0 = min(max(y0, 0), imageSize.height - 1);
+  x1 = min(max(x1, x0 + 1), imageSize.width);
+  y1 = min(max(y1, y0 + 1), imageSize.height);
+
+  return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+//------------------------------------------------------------------------------
+// Large reductions are done in two stages: the shared pyramid (cheap 2x2 box
+// reductions) brings the source close to the output size and the requested
+// interpolation finishes from there, so the cost of the kernel no longer
+// grows with the source. Returns the pyramid level to resize from, 0 meaning
+// a single resize from the source.
+//
+// Area resizes start from the smallest level at least twice the output size
+// since halving is itself an area reduction. On the example images this
+// differs from resizing the source directly by less than 2 (out of 255) on
+// average, with larger differences only at hard edges. In the automatic
+// strategy other kernels finish from at least three times the output size
+// and pre-filtered resizes are left alone. The fast strategy uses twice the
+// output size for everything and the exact strategy never uses the pyramid.
+// Nearest neighbour resizes are already cheap and the levels are averaged in
+// sRGB, so linear light resizes always start from the source
+//------------------------------------------------------------------------------
+unsigned Resize::selectPyramidLevel(const Rect &cropRegion, const Size &imageSize) const {
+  if (!mpPyramid || mpPyramid->empty() || mResizeStrategy == ResizeStrategyExact || mLinearLight ||
+      (mInterpolation == INTER_NEAREST && mResampleFilter == ResampleFilterNone)) {
+    return 0;
+  }
+
+  unsigned minRatio = 2;
+
+  if (mResizeStrategy == ResizeStrategyAuto) {
+    if (mPreFilter) {
+      return 0;
     }
 
-    // Don't attempt to resize an image to a size that's greater than our max
-    if (mHeight * mWidth > ARION_RESIZE_MAX_PIXELS) {
-      mStatus = ResizeStatusError;
-      mErrorMessage = "Desired resize dimensions exceed maximum";
-      return false;
+    if (mInterpolation != INTER_AREA || mResampleFilter != ResampleFilterNone) {
+      minRatio = 3;
     }
+  }
+
+  return mpPyramid->selectLevel(mapToImage(cropRegion, imageSize).size(), orientSize(mSize), minRatio);
+}
+
+//------------------------------------------------------------------------------
+// Resize with our own resampler when one of its filters was requested,
+// otherwise with OpenCV. Our resampler converts to linear light as it goes,
+// OpenCV needs the whole source converted first
+//------------------------------------------------------------------------------
+void Resize::resizeImage(const Mat &source, Mat &output, const Size &size) const {
+  if (mResampleFilter != ResampleFilterNone) {
+    Resampler::resize(source, output, size, mResampleFilter, mLinearLight);
+  } else if (mLinearLight) {
+    Mat linear;
+    LinearLight::toLinear(source, linear);
+
+    Mat resized;
+    resize(linear, resized, size, 0, 0, mInterpolation);
+
+    LinearLight::toSrgb(resized, output);
+  } else {
+    resize(source, output, size, 0, 0, mInterpolation);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Crop and resize each source plane on its own: luma to the output size and
+// chroma to the 4:2:0 chroma size of the output, whatever its source
+// subsampling. The planes are resized in their stored orientation and then
+// oriented
+//------------------------------------------------------------------------------
+void Resize::resizePlanes(const Rect &cropRegion) {
+  const Size chromaSize = orientSize(Size((mSize.width + 1) / 2, (mSize.height + 1) / 2));
+  const Size lumaSize = orientSize(mSize);
+
+  const vector<Mat> &planes = (mPyramidLevel > 0) ? mpPyramid->getLevel(mPyramidLevel) : mSourcePlanes;
+
+  mResizedPlanes.resize(planes.size());
+
+  for (size_t i = 0; i < planes.size(); i++) {
+    const Mat &plane = planes[i];
+    const Mat planeToResize = plane(mapToImage(cropRegion, plane.size()));
+    const Size size = (i == 0) ? lumaSize : chromaSize;
 
     if (mPreFilter) {
-      double sigma = (double) mImageToResize.cols / 1000.0;
+      double sigma = (double) orientSize(planeToResize.size()).width / 1000.0;
 
-      // Make sure we're not editing the original...
-      Mat imageToResizeFiltered;
+      Mat planeToResizeFiltered;
 
-      GaussianBlur(mImageToResize, imageToResizeFiltered, cv::Size(0, 0), sigma);
+      BoxBlur::gaussian(planeToResize, planeToResizeFiltered, sigma);
 
-      // Resize operation
-      resize(imageToResizeFiltered, mImageResized, mSize, 0, 0, mInterpolation);
+      resizeImage(planeToResizeFiltered, mResizedPlanes[i], size);
     } else {
-      // Resize operation
-      resize(mImageToResize, mImageResized, mSize, 0, 0, mInterpolation);
+      resizeImage(planeToResize, mResizedPlanes[i], size);
     }
 
-    if (mSharpenAmount) {
-      GaussianBlur(mImageResized, mImageResizedFinal, cv::Size(0, 0), mSharpenRadius);
+    Utils::orientImage(mResizedPlanes[i], mOrientation);
+  }
 
-      addWeighted(mImageResized,
-                  1.0 + (mSharpenAmount / 100.0),
-                  mImageResizedFinal,
-                  -(mSharpenAmount / 100.0),
-                  0,
-                  mImageResizedFinal);
-    } else {
-      // Assign by reference
-      mImageResizedFinal = mImageResized;
-    }
+  mImageResized = mResizedPlanes[0];
+}
 
-    if (mWatermarkFile.length()) {
-      applyWatermark();
-    }
+//------------------------------------------------------------------------------
+// Planes go straight to the libjpeg raw data encoder and tiled outputs are
+// already encoded, everything else goes through OpenCV
+//------------------------------------------------------------------------------
+bool Resize::writeOutput() {
+  vector<int> compression_params;
+  compression_params.push_back(IMWRITE_JPEG_QUALITY);
+  compression_params.push_back(mQuality);
+  compression_params.push_back(IMWRITE_JPEG_PROGRESSIVE);
+  compression_params.push_back(1);
+
+  if (mResizedPlanes.empty() && !mTiled) {
+    return imwrite(mOutputFile, mImageResizedFinal, compression_params);
   }
-  catch (boost::exception &e) {
-    mStatus = ResizeStatusError;
-    mErrorMessage = boost::diagnostic_information(e);
+
+  vector<unsigned char> planesData;
+
+  if (!mTiled && !JpegEncoder::encodePlanes(mResizedPlanes, mQuality, true, planesData)) {
     return false;
   }
 
-  if (!mOutputFile.empty()) {
-    vector<int> compression_params;
-    compression_params.push_back(IMWRITE_JPEG_QUALITY);
-    compression_params.push_back(mQuality);
-    compression_params.push_back(IMWRITE_JPEG_PROGRESSIVE);
-    compression_params.push_back(1);
+  const vector<unsigned char> &data = mTiled ? mJpegData : planesData;
+
+  ofstream output(mOutputFile.c_str(), ios::out | ios::binary);
+  output.write((const char *) data.data(), data.size());
+
+  return output.good();
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Resize::run() {
+
+  mStatus = ResizeStatusPending;
 
-    if (!imwrite(mOutputFile, mImageResizedFinal, compression_params)) {
+  mResizedPlanes.clear();
+  mJpegData.clear();
+  mTiled = false;
+  mWatermarkCached = false;
+  mWatermarkCacheHits = 0;
+  mWatermarkCacheMisses = 0;
+  mPixelsReused = false;
+
+  // Operations with an identical pipeline only encode the pixels again
+  if (!reusePixels() && !producePixels()) {
+    return false;
+  }
+
+  if (!mOutputFile.empty()) {
+    if (!writeOutput()) {
       mStatus = ResizeStatusError;
       mErrorMessage = "Failed to write output image";
       return false;
@@ -829,86 +1284,190 @@ bool Resize::run() {
 }
 
 //------------------------------------------------------------------------------
-// Apply the watermark in place
+// Crop, resize, sharpen and watermark the source into mImageResizedFinal (or
+// mResizedPlanes, or the encoded mJpegData when tiled). Returns false, with
+// mStatus and mErrorMessage set, on failure
 //------------------------------------------------------------------------------
-void Resize::applyWatermark() {
-  Mat watermark = imread(mWatermarkFile, IMREAD_UNCHANGED);
-
-  if (watermark.empty()) {
-    return;
+bool Resize::producePixels() {
+  if (mImage.empty() && mSourcePlanes.empty() && !mPreResized) {
+    mStatus = ResizeStatusError;
+    mErrorMessage = "Input image data is empty";
+    return false;
   }
 
-  double blend = mWatermarkAmount / 255.0;
-  const double blendMin = mWatermarkMin / 255.0;
-  const double blendMax = mWatermarkMax / 255.0;
-  const double blendDelta = blendMax - blendMin;
-  const double normFactor = 9.0 / 255.0;
+  //---------------------------------------------------
+  //        Perform the resize operation
+  //---------------------------------------------------
+  try {
 
-  // In case we can't compute brightness for adaptive watermark use the min blend specified
-  if (mWatermarkType == ResizeWatermarkTypeAdaptive) {
-    blend = blendMin;
-  }
+    Rect cropRegion;
 
-  int wx = 0;
-  int wy = 0;
+    if (!computeGeometry(mSourceSize, cropRegion, mSize)) {
+      mStatus = ResizeStatusError;
+      mErrorMessage = "Invalid resize type";
+      return false;
+    }
 
-  for (int y = 0; y < mImageResizedFinal.rows; ++y) {
-    // If the final image is taller than the watermark, repeat it
-    if (y >= watermark.rows) {
-      wy = y % watermark.rows;
-    } else {
-      wy = y;
+    if (mHeight == 0) {
+      mStatus = ResizeStatusError;
+      mErrorMessage = "Height cannot be 0";
+      return false;
     }
 
-    for (int x = 0; x < mImageResizedFinal.cols; ++x) {
-      // If the final image is wider than the watermark, repeat it
-      if (x >= watermark.cols) {
-        wx = x % watermark.cols;
-      } else {
-        wx = x;
-      }
+    if (mWidth == 0) {
+      mStatus = ResizeStatusError;
+      mErrorMessage = "Width cannot be 0";
+      return false;
+    }
 
-      int watermarkIdx = wy * watermark.step + wx * watermark.channels();
+    // Don't attempt to resize an image to a size that's greater than our max
+    if (mHeight * mWidth > ARION_RESIZE_MAX_PIXELS) {
+      mStatus = ResizeStatusError;
+      mErrorMessage = "Desired resize dimensions exceed maximum";
+      return false;
+    }
 
-      // determine the opacity of the foreground pixel, using its fourth (alpha) channel.
-      unsigned char alpha = watermark.data[watermarkIdx + 3];
+    mPyramidLevel = 0;
 
-      // Only apply watermark if alpha is non-zero
-      if (alpha) {
-        int i = y * mImageResizedFinal.step + x * mImageResizedFinal.channels();
+    // A streamed source has already been resized
+    if (!mSourcePlanes.empty()) {
+      mPyramidLevel = selectPyramidLevel(cropRegion, mSourcePlanes[0].size());
 
-        if ((mWatermarkType == ResizeWatermarkTypeAdaptive) && mImageResizedFinal.channels() >= 3) {
-          unsigned char b = mImageResizedFinal.data[i];
-          unsigned char g = mImageResizedFinal.data[i + 1];
-          unsigned char r = mImageResizedFinal.data[i + 2];
+      resizePlanes(cropRegion);
+    } else if (!mPreResized) {
+      mPyramidLevel = selectPyramidLevel(cropRegion, mImage.size());
 
-          // Use a fast approximation for brightness
-          // http://stackoverflow.com/questions/596216/formula-to-determine-brightness-of-rgb-color
-          unsigned brightness = (r + r + r + b + g + g + g + g) >> 3;
+      const Mat image = (mPyramidLevel > 0) ? mpPyramid->getLevel(mPyramidLevel)[0] : mImage;
 
-          // Log-based blend
-          // blend = (blendMax - blendMin) * log10 ( 9*(brightness / 255) + 1) + blendMin
-          blend = blendDelta * log10(1.0 + normFactor * (double) brightness) + blendMin;
+      mImageToResize = image(mapToImage(cropRegion, image.size()));
 
-          // Linear blend - for reference...
-          // blend = (blendMax - blendMin) * ((double)brightness/255.0) + blendMin;
+      Mat imageToResizeFiltered;
+
+      if (mPreFilter) {
+        double sigma = (double) orientSize(mImageToResize.size()).width / 1000.0;
+
+        // Make sure we're not editing the original...
+        BoxBlur::gaussian(mImageToResize, imageToResizeFiltered, sigma);
+      } else {
+        imageToResizeFiltered = mImageToResize;
+      }
 
+      if (canTile(imageToResizeFiltered)) {
+        // Sharpened, watermarked and encoded along with the resize
+        if (!runTiled(imageToResizeFiltered)) {
+          mStatus = ResizeStatusError;
+          mErrorMessage = "Failed to encode output image";
+          return false;
         }
+      } else {
+        // Resize operation
+        resizeImage(imageToResizeFiltered, mImageResized, orientSize(mSize));
 
-        double opacity = blend * ((double) alpha);
+        // Orienting the output is much cheaper than orienting the source
+        Utils::orientImage(mImageResized, mOrientation);
+      }
+    }
 
-        // Combine the background and watermark pixel, using the opacity, 
-        for (int c = 0; c < mImageResizedFinal.channels(); ++c) {
-          int finalOffset = i + c;
-          unsigned char foregroundPx = watermark.data[watermarkIdx + c];
-          unsigned char backgroundPx = mImageResizedFinal.data[finalOffset];
+    if (!mTiled) {
+      if (mSharpenAmount) {
+        sharpen(mImageResized, mImageResizedFinal, 0, mImageResized.rows);
+      } else {
+        // Assign by reference
+        mImageResizedFinal = mImageResized;
+      }
 
-          // Apply in place
-          mImageResizedFinal.data[finalOffset] = backgroundPx * (1.0 - opacity) + foregroundPx * opacity;
-        }
+      if (!mResizedPlanes.empty()) {
+        mResizedPlanes[0] = mImageResizedFinal;
       }
+
+      applyWatermark(mImageResizedFinal, loadWatermark(), 0);
     }
   }
+  catch (boost::exception &e) {
+    mStatus = ResizeStatusError;
+    mErrorMessage = boost::diagnostic_information(e);
+    return false;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Take the finished pixels of the pixel source, if it has any. A tiled source
+// only kept its encoded output, and a failed one has nothing to offer, so
+// those are computed again
+//------------------------------------------------------------------------------
+bool Resize::reusePixels() {
+  const Resize *source = dynamic_cast<const Resize *>(mpPixelSource);
+
+  if (!source || source->mStatus != ResizeStatusSuccess || source->mTiled) {
+    return false;
+  }
+
+  mSize = source->mSize;
+  mImageResized = source->mImageResized;
+  mImageResizedFinal = source->mImageResizedFinal;
+  mResizedPlanes = source->mResizedPlanes;
+  mPyramidLevel = source->mPyramidLevel;
+  mPreResized = source->mPreResized;
+  mWatermarkCached = source->mWatermarkCached;
+  mWatermarkCacheHits = source->mWatermarkCacheHits;
+  mWatermarkCacheMisses = source->mWatermarkCacheMisses;
+  mPixelsReused = true;
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Everything that goes into the pixels before encoding. Quality, output file
+// and metadata only affect the encode and write
+//------------------------------------------------------------------------------
+string Resize::getPipelineKey() const {
+  // A tiled output is encoded band by band and never holds its pixels, so
+  // there is nothing to share and sharing would cost it the tiling
+  if (willTile()) {
+    return string();
+  }
+
+  ostringstream key;
+
+  key << "resize:" << mType << ':' << mWidth << 'x' << mHeight << ':' << mGravity
+      << ':' << mInterpolation << ':' << mResampleFilter << ':' << mResizeStrategy
+      << ':' << mPreFilter << ':' << mLinearLight
+      << ':' << mSharpenAmount << ':' << mSharpenRadius << ':' << mSharpenThreshold
+      << ':' << mWatermarkFile << ':' << mWatermarkType << ':' << mWatermarkAmount
+      << ':' << mWatermarkMin << ':' << mWatermarkMax;
+
+  return key.str();
+}
+
+//------------------------------------------------------------------------------
+// Returns null if there is no watermark or it can't be read. Prepared
+// watermarks are shared through the cache, so only the first resize that
+// uses a file reads it
+//------------------------------------------------------------------------------
+WatermarkPtr Resize::loadWatermark() {
+  if (mWatermarkFile.empty()) {
+    return WatermarkPtr();
+  }
+
+  return WatermarkCache::get(mWatermarkFile, mWatermarkCached, mWatermarkCacheHits, mWatermarkCacheMisses);
+}
+
+//------------------------------------------------------------------------------
+// Apply the watermark in place. The image may be a band of the output that
+// starts at firstRow, which is where the watermark pattern is picked up from
+//------------------------------------------------------------------------------
+void Resize::applyWatermark(Mat &image, const WatermarkPtr &watermark, int firstRow) const {
+  if (!watermark) {
+    return;
+  }
+
+  if (mWatermarkType == ResizeWatermarkTypeAdaptive) {
+    watermark->applyAdaptive(image, firstRow, mWatermarkMin, mWatermarkMax);
+  } else {
+    watermark->applyFixed(image, firstRow, mWatermarkAmount);
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -936,9 +1495,39 @@ void Resize::serialize(rapidjson::Writer<rapidjson::StringBuffer> &writer) const
 
     // Dimensions
     writer.String("output_height");
-    writer.Uint(mImageResized.rows);
+    writer.Uint(mTiled ? mSize.height : mImageResized.rows);
     writer.String("output_width");
-    writer.Uint(mImageResized.cols);
+    writer.Uint(mTiled ? mSize.width : mImageResized.cols);
+
+    // Either a single resize from the source or two stages through the
+    // pyramid
+    writer.String("resize_strategy");
+    writer.String((mPyramidLevel > 0) ? "fast" : "exact");
+
+    writer.String("pyramid_level");
+    writer.Uint(mPyramidLevel);
+
+    writer.String("linear_light");
+    writer.Bool(mLinearLight && !mPreResized);
+
+    // Resized, sharpened, watermarked and encoded a band at a time
+    writer.String("tiled");
+    writer.Bool(mTiled);
+
+    // Encoded from the pixels of an earlier operation with the same pipeline
+    writer.String("shared_pipeline");
+    writer.Bool(mPixelsReused);
+
+    if (!mWatermarkFile.empty()) {
+      // Process wide counts as of this resize's lookup, which carry over
+      // between carion calls
+      writer.String("watermark_cached");
+      writer.Bool(mWatermarkCached);
+      writer.String("watermark_cache_hits");
+      writer.Uint64(mWatermarkCacheHits);
+      writer.String("watermark_cache_misses");
+      writer.Uint64(mWatermarkCacheMisses);
+    }
 
   } else {
     // Result
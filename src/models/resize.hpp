@@ -45,6 +45,7 @@
 
 // Local
 #include "./operation.hpp"
+#include "../imgproc/watermark_cache.hpp"
 
 // Resize images that are maximum 10,000 x 10,000 pixels
 // At the max this will use 3.2GB of memory (a 100MP image)
@@ -52,6 +53,17 @@
 #ifndef ARION_RESIZE_MAX_PIXELS
 #define ARION_RESIZE_MAX_PIXELS 100000000
 #endif
+
+// JPEG outputs of at least this many pixels are resized, sharpened,
+// watermarked and encoded a band of rows at a time (see Resize::runTiled)
+// This can be overridden at build time or with the "tile_min_pixels"
+// parameter (0 never tiles)
+#ifndef ARION_RESIZE_TILE_MIN_PIXELS
+#define ARION_RESIZE_TILE_MIN_PIXELS 2000000
+#endif
+
+// Approximate size of one band in bytes, small enough to stay in L2
+#define ARION_RESIZE_TILE_BYTES (256 * 1024)
 enum {
   ResizeTypeInvalid = -1,
   ResizeTypeFixedWidth = 0,
@@ -84,6 +96,12 @@ enum {
   ResizeWatermarkTypeAdaptive = 1,
 };
 
+enum {
+  ResizeStrategyAuto = 0,
+  ResizeStrategyExact = 1,
+  ResizeStrategyFast = 2
+};
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 class Resize : public Operation {
@@ -95,16 +113,29 @@ class Resize : public Operation {
   virtual void setup(const boost::property_tree::ptree &params);
   virtual bool run();
   virtual bool getJpeg(std::vector<unsigned char> &data);
+  virtual double getMaxSourceReduction(const cv::Size &sourceSize) const;
+  virtual cv::Rect getSourceRegion(const cv::Size &sourceSize) const;
+  virtual bool canStream(const cv::Size &sourceSize) const;
+  virtual bool canUsePlanes() const;
+  virtual bool canApplyOrientation() const;
+  virtual std::string getPipelineKey() const;
+
+  bool computeGeometry(const cv::Size &sourceSize, cv::Rect &cropRegion, cv::Size &size) const;
+  void setResizedImage(const cv::Mat &image);
 
   void setType(const std::string &type);
   void setHeight(unsigned height);
   void setWidth(unsigned width);
   void setQuality(unsigned quality);
   void setInterpolation(const std::string &interpolation);
+  void setResizeStrategy(const std::string &resizeStrategy);
   void setGravity(std::string gravity);
   void setSharpenAmount(unsigned sharpenAmount);
   void setSharpenRadius(float radius);
+  void setSharpenThreshold(unsigned threshold);
   void setPreserveMeta(bool preserveMeta);
+  void setLinearLight(bool linearLight);
+  void setTileMinPixels(unsigned long tileMinPixels);
   void setWatermarkUrl(const std::string &watermarkUrl);
   void setWatermarkType(const std::string &watermarkType);
   void setWatermarkAmount(float watermarkAmount);
@@ -127,10 +158,26 @@ class Resize : public Operation {
   int getAspectHeight(int resizeWidth, double aspect) const;
   int getAspectWidth(int resizeHeight, double aspect) const;
 
-  void computeSizeSquare();
-  void computeSizeWidth();
-  void computeSizeHeight();
-  void computeSizeFill();
+  void computeSizeSquare(const cv::Size &sourceSize, cv::Rect &cropRegion, cv::Size &size) const;
+  void computeSizeWidth(const cv::Size &sourceSize, cv::Rect &cropRegion, cv::Size &size) const;
+  void computeSizeHeight(const cv::Size &sourceSize, cv::Rect &cropRegion, cv::Size &size) const;
+  void computeSizeFill(const cv::Size &sourceSize, cv::Rect &cropRegion, cv::Size &size) const;
+
+  cv::Rect mapToImage(const cv::Rect &orientedRegion, const cv::Size &imageSize) const;
+  cv::Size orientSize(const cv::Size &size) const;
+  unsigned selectPyramidLevel(const cv::Rect &cropRegion, const cv::Size &imageSize) const;
+  void resizeImage(const cv::Mat &source, cv::Mat &output, const cv::Size &size) const;
+  void resizePlanes(const cv::Rect &cropRegion);
+  bool isJpegOutput() const;
+  bool willTile() const;
+  bool canTile(const cv::Mat &imageToResize) const;
+  bool runTiled(const cv::Mat &imageToResize);
+  int getAreaBandPeriod(const cv::Size &sourceSize) const;
+  bool produceTile(const cv::Mat &imageToResize, const WatermarkPtr &watermark, int firstRow, cv::Mat &rows) const;
+  void sharpen(const cv::Mat &image, cv::Mat &sharpened, int firstRow, int rowCount) const;
+  bool producePixels();
+  bool reusePixels();
+  bool writeOutput();
 
   void readType(const boost::property_tree::ptree &params);
   void readGravity(const boost::property_tree::ptree &params);
@@ -145,18 +192,37 @@ class Resize : public Operation {
   void validateQuality(unsigned quality);
   void validateSharpenAmount(unsigned sharpenAmount);
   void validateSharpenRadius(float sharpenRadius);
+  void validateSharpenThreshold(unsigned sharpenThreshold);
 
-  void applyWatermark();
+  WatermarkPtr loadWatermark();
+  void applyWatermark(cv::Mat &image, const WatermarkPtr &watermark, int firstRow) const;
 
   int mType;
   unsigned mHeight;
   unsigned mWidth;
   unsigned mQuality;
   int mInterpolation;
+
+  // Filter of our own resampler, used instead of mInterpolation when set
+  int mResampleFilter;
+
+  // Whether large reductions may start from a reduced pyramid level (see
+  // selectPyramidLevel)
+  int mResizeStrategy;
   unsigned mGravity;
   bool mPreFilter;
+
+  // Resample in linear light instead of on the gamma encoded values
+  bool mLinearLight;
+
+  // Smallest JPEG output (in pixels) that is produced a band at a time
+  unsigned long mTileMinPixels;
   unsigned mSharpenAmount;
   float mSharpenRadius;
+
+  // Pixels that differ from their blur by less than this (0-255) are not
+  // sharpened
+  unsigned mSharpenThreshold;
   bool mPreserveMeta;
   std::string mWatermarkFile;
   unsigned mWatermarkType;
@@ -171,6 +237,32 @@ class Resize : public Operation {
   cv::Size mSize;
   cv::Mat mImageToResize;
 
+  // Set when the resized image was produced while streaming the source
+  bool mPreResized;
+
+  // Resized Y, Cb and Cr planes when running on a planar source. The luma
+  // plane is also mImageResized so sharpening only touches luma
+  std::vector<cv::Mat> mResizedPlanes;
+
+  // Pyramid level the output was resized from (0 is the decoded source)
+  unsigned mPyramidLevel;
+
+  // Set when the output went through runTiled, in which case only the
+  // encoded JPEG is kept (mImageResizedFinal is empty)
+  bool mTiled;
+  std::vector<unsigned char> mJpegData;
+
+  // Set when the watermark was already in the cache, along with the cache
+  // counters as of the lookup (the cache is shared with concurrent
+  // operations, so they are read when the watermark is)
+  bool mWatermarkCached;
+  unsigned long mWatermarkCacheHits;
+  unsigned long mWatermarkCacheMisses;
+
+  // Set when the output encodes the pixels of an earlier operation with the
+  // same pipeline (see Operation::setPixelSource)
+  bool mPixelsReused;
+
   int mStatus;
   std::string mErrorMessage;
 
@@ -0,0 +1,331 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./executor.hpp"
+
+#include <algorithm>
+#include <system_error>
+
+// Boost
+#include <boost/bind.hpp>
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+// The pool of the task running on this thread and the deque it owns
+thread_local Executor *currentExecutor = 0;
+thread_local unsigned currentIndex = 0;
+
+//------------------------------------------------------------------------------
+// One band of a parallelFor
+//------------------------------------------------------------------------------
+void runBand(const ParallelLoopBody &body, int band) {
+  body(Range(band, band + 1));
+}
+
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+Executor::Group::Group(int count) :
+    remaining(count),
+    error() {
+}
+
+//------------------------------------------------------------------------------
+// The calling thread is one of the threads, it works while it waits in run
+//------------------------------------------------------------------------------
+Executor::Executor(unsigned threads) :
+    mQueues(max(threads, 1u)),
+    mThreads(),
+    mQueued(0),
+    mStop(false) {
+  mThreads.reserve(mQueues.size() - 1);
+
+  for (unsigned i = 1; i < mQueues.size(); i++) {
+    try {
+      mThreads.push_back(thread(&Executor::work, this, i));
+    }
+    catch (system_error &) {
+      // Out of threads, run on the ones there are. The queues without a
+      // thread stay empty since only their own thread pushes to them
+      break;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+Executor::~Executor() {
+  {
+    lock_guard<mutex> lock(mMutex);
+    mStop = true;
+  }
+
+  mWake.notify_all();
+
+  for (size_t i = 0; i < mThreads.size(); i++) {
+    mThreads[i].join();
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+unsigned Executor::getThreadCount() const {
+  return mThreads.size() + 1;
+}
+
+//------------------------------------------------------------------------------
+// Run the tasks on the pool and return once all of them are done. Rethrows
+// the first exception any of them threw
+//------------------------------------------------------------------------------
+void Executor::run(const vector<Task> &tasks) {
+  Executor *previousExecutor = currentExecutor;
+  const unsigned previousIndex = currentIndex;
+
+  currentExecutor = this;
+  currentIndex = 0;
+
+  Group group(tasks.size());
+
+  for (size_t i = 0; i < tasks.size(); i++) {
+    push(0, tasks[i], &group);
+  }
+
+  try {
+    wait(0, group, true);
+  }
+  catch (...) {
+    currentExecutor = previousExecutor;
+    currentIndex = previousIndex;
+    throw;
+  }
+
+  currentExecutor = previousExecutor;
+  currentIndex = previousIndex;
+}
+
+//------------------------------------------------------------------------------
+// Number of bands worth splitting a kernel into
+//------------------------------------------------------------------------------
+int Executor::getNumThreads() {
+  return currentExecutor ? (int) currentExecutor->getThreadCount() : cv::getNumThreads();
+}
+
+//------------------------------------------------------------------------------
+// Drop in replacement for cv::parallel_for_ over a range of bands. Every band
+// but the first is pushed to this thread's deque for idle threads to steal,
+// and this thread runs whatever is left of them itself
+//------------------------------------------------------------------------------
+void Executor::parallelFor(const Range &range, const ParallelLoopBody &body) {
+  Executor *executor = currentExecutor;
+
+  if (!executor) {
+    parallel_for_(range, body);
+    return;
+  }
+
+  if (range.end - range.start < 2) {
+    body(range);
+    return;
+  }
+
+  const unsigned index = currentIndex;
+  Group group(range.end - range.start - 1);
+
+  for (int band = range.end - 1; band > range.start; band--) {
+    executor->push(index, boost::bind(&runBand, boost::cref(body), band), &group);
+  }
+
+  exception_ptr error;
+
+  try {
+    body(Range(range.start, range.start + 1));
+  }
+  catch (...) {
+    error = current_exception();
+  }
+
+  // The other bands still use body, so wait for them even after a failure
+  executor->wait(index, group, false);
+
+  if (error) {
+    rethrow_exception(error);
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Executor::push(unsigned index, const Task &task, Group *group) {
+  Job job;
+  job.task = task;
+  job.group = group;
+
+  {
+    lock_guard<mutex> lock(mQueues[index].mutex);
+    mQueues[index].jobs.push_back(job);
+  }
+
+  {
+    lock_guard<mutex> lock(mMutex);
+    mQueued++;
+  }
+
+  mWake.notify_all();
+}
+
+//------------------------------------------------------------------------------
+// Take the newest task from a thread's own deque, only if it belongs to group
+// when one is given
+//------------------------------------------------------------------------------
+bool Executor::pop(unsigned index, const Group *group, Job &job) {
+  Queue &queue = mQueues[index];
+  lock_guard<mutex> lock(queue.mutex);
+
+  if (queue.jobs.empty() || (group && queue.jobs.back().group != group)) {
+    return false;
+  }
+
+  job = queue.jobs.back();
+  queue.jobs.pop_back();
+  mQueued--;
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Take the oldest task of the first other thread that has any
+//------------------------------------------------------------------------------
+bool Executor::steal(unsigned index, Job &job) {
+  for (size_t i = 1; i < mQueues.size(); i++) {
+    Queue &queue = mQueues[(index + i) % mQueues.size()];
+    lock_guard<mutex> lock(queue.mutex);
+
+    if (!queue.jobs.empty()) {
+      job = queue.jobs.front();
+      queue.jobs.pop_front();
+      mQueued--;
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Executor::execute(const Job &job) {
+  exception_ptr error;
+
+  try {
+    job.task();
+  }
+  catch (...) {
+    error = current_exception();
+  }
+
+  {
+    lock_guard<mutex> lock(mMutex);
+
+    if (error && !job.group->error) {
+      swap(job.group->error, error);
+    }
+
+    // Whoever waits on the group owns the exception from here on
+    error = exception_ptr();
+
+    job.group->remaining--;
+  }
+
+  mWake.notify_all();
+}
+
+//------------------------------------------------------------------------------
+// Work until every task of group is done. Waiting on bands only runs those
+// bands, so a short kernel isn't held up behind a whole operation, while the
+// top level wait also steals anything
+//------------------------------------------------------------------------------
+void Executor::wait(unsigned index, Group &group, bool stealing) {
+  Job job;
+
+  for (;;) {
+    if (pop(index, stealing ? 0 : &group, job) || (stealing && steal(index, job))) {
+      execute(job);
+      continue;
+    }
+
+    unique_lock<mutex> lock(mMutex);
+
+    if (group.remaining == 0) {
+      break;
+    }
+
+    if (!stealing || mQueued == 0) {
+      mWake.wait(lock);
+    }
+  }
+
+  if (group.error) {
+    rethrow_exception(group.error);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Body of the pool threads
+//------------------------------------------------------------------------------
+void Executor::work(unsigned index) {
+  currentExecutor = this;
+  currentIndex = index;
+
+  Job job;
+
+  for (;;) {
+    if (pop(index, 0, job) || steal(index, job)) {
+      execute(job);
+      continue;
+    }
+
+    unique_lock<mutex> lock(mMutex);
+
+    if (mStop) {
+      return;
+    }
+
+    if (mQueued == 0) {
+      mWake.wait(lock);
+    }
+  }
+}
@@ -0,0 +1,123 @@
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Boost
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+
+//------------------------------------------------------------------------------
+// Work-stealing thread pool that runs the independent tasks of a job (its
+// operations) and the row bands the heavy kernels split into, so a job never
+// uses more than its thread count.
+//
+// Every thread (the one that calls run included) has its own deque of tasks.
+// It takes the newest task from its own deque, so the bands a task forks run
+// where they were forked while their data is still in cache. When its deque
+// is empty it steals the oldest task from the other threads. Kernels fork
+// bands with Executor::parallelFor, which uses the pool of the task it is
+// called from and falls back to cv::parallel_for_ outside of one
+//------------------------------------------------------------------------------
+class Executor : boost::noncopyable {
+ public:
+
+  typedef boost::function<void()> Task;
+
+  explicit Executor(unsigned threads);
+  ~Executor();
+
+  unsigned getThreadCount() const;
+
+  void run(const std::vector<Task> &tasks);
+
+  static int getNumThreads();
+  static void parallelFor(const cv::Range &range, const cv::ParallelLoopBody &body);
+
+ private:
+
+  // Tasks that someone waits on together
+  struct Group {
+    Group(int count);
+
+    // Unfinished tasks (guarded by mMutex)
+    int remaining;
+
+    // First exception thrown by any of them
+    std::exception_ptr error;
+  };
+
+  struct Job {
+    Task task;
+    Group *group;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+  };
+
+  void push(unsigned index, const Task &task, Group *group);
+  bool pop(unsigned index, const Group *group, Job &job);
+  bool steal(unsigned index, Job &job);
+  void execute(const Job &job);
+  void wait(unsigned index, Group &group, bool stealing);
+  void work(unsigned index);
+
+  std::vector<Queue> mQueues;
+  std::vector<std::thread> mThreads;
+
+  // Signalled when tasks are pushed, when a task finishes and on shutdown
+  std::mutex mMutex;
+  std::condition_variable mWake;
+
+  // Tasks waiting in any of the deques
+  std::atomic<int> mQueued;
+  bool mStop;
+
+};
+
+#endif // EXECUTOR_HPP
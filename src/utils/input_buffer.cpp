@@ -0,0 +1,170 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "./input_buffer.hpp"
+
+#include <fstream>
+
+// POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+InputBuffer::InputBuffer() :
+    mpMapped(0),
+    mMappedSize(0),
+    mBuffer() {
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+InputBuffer::~InputBuffer() {
+  release();
+}
+
+//------------------------------------------------------------------------------
+// Map the file if possible, otherwise fall back to reading it
+//------------------------------------------------------------------------------
+bool InputBuffer::open(const string &path) {
+  release();
+
+  if (map(path)) {
+    return true;
+  }
+
+  return read(path);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void InputBuffer::release() {
+  if (mpMapped) {
+    munmap(mpMapped, mMappedSize);
+    mpMapped = 0;
+    mMappedSize = 0;
+  }
+
+  vector<char>().swap(mBuffer);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+const char *InputBuffer::data() const {
+  if (mpMapped) {
+    return static_cast<const char *>(mpMapped);
+  }
+
+  return mBuffer.empty() ? 0 : &mBuffer.front();
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+size_t InputBuffer::size() const {
+  if (mpMapped) {
+    return mMappedSize;
+  }
+
+  return mBuffer.size();
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool InputBuffer::empty() const {
+  return size() == 0;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool InputBuffer::isMapped() const {
+  return mpMapped != 0;
+}
+
+//------------------------------------------------------------------------------
+// Only regular, non-empty files are mapped
+//------------------------------------------------------------------------------
+bool InputBuffer::map(const string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+
+  void *mapped = mmap(0, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  // The mapping keeps its own reference to the file
+  close(fd);
+
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+
+  // Decoders read the file front to back so let the kernel read ahead
+  madvise(mapped, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+  mpMapped = mapped;
+  mMappedSize = (size_t) st.st_size;
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Fallback for sources that cannot be mapped. The size may not be known up
+// front so read in large chunks
+//------------------------------------------------------------------------------
+bool InputBuffer::read(const string &path) {
+  std::ifstream input(path.c_str(), std::ios::binary);
+
+  if (!input) {
+    return false;
+  }
+
+  char chunk[64 * 1024];
+
+  while (input.read(chunk, sizeof(chunk)) || input.gcount() > 0) {
+    mBuffer.insert(mBuffer.end(), chunk, chunk + input.gcount());
+  }
+
+  return !mBuffer.empty();
+}
@@ -0,0 +1,74 @@
+#ifndef INPUT_BUFFER_HPP
+#define INPUT_BUFFER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2018 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+//------------------------------------------------------------------------------
+// Read-only view of an input file. Local files are memory mapped so the same
+// bytes can be handed to LibRaw, OpenCV and Exiv2 without copying. Sources
+// that cannot be mapped (pipes, empty or special files) are read into memory
+//------------------------------------------------------------------------------
+class InputBuffer : boost::noncopyable {
+ public:
+
+  InputBuffer();
+  ~InputBuffer();
+
+  bool open(const std::string &path);
+  void release();
+
+  const char *data() const;
+  size_t size() const;
+  bool empty() const;
+  bool isMapped() const;
+
+ private:
+
+  bool map(const std::string &path);
+  bool read(const std::string &path);
+
+  void *mpMapped;
+  size_t mMappedSize;
+  std::vector<char> mBuffer;
+
+};
+
+#endif // INPUT_BUFFER_HPP
@@ -95,6 +95,143 @@ static char *computeMd5(const char *str, int length) {
   return out;
 }
 
+//----------------------------------------------------------------------------
+// Read the dimensions (and optionally the number of components) of a JPEG
+// from its start of frame marker without decoding any pixels. Returns false
+// if the data is not a JPEG
+//----------------------------------------------------------------------------
+static bool readJpegSize(const unsigned char *data,
+                         size_t length,
+                         unsigned &width,
+                         unsigned &height,
+                         unsigned *components = 0) {
+  if (length < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    return false;
+  }
+
+  size_t pos = 2;
+
+  while (pos + 4 <= length) {
+    if (data[pos] != 0xFF) {
+      return false;
+    }
+
+    unsigned char marker = data[pos + 1];
+
+    // Skip fill bytes
+    if (marker == 0xFF) {
+      pos++;
+      continue;
+    }
+
+    // Standalone markers have no length
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      pos += 2;
+      continue;
+    }
+
+    // Start of scan or end of image before a frame header
+    if (marker == 0xDA || marker == 0xD9) {
+      return false;
+    }
+
+    const size_t segmentLength = (data[pos + 2] << 8) | data[pos + 3];
+
+    // SOF0-SOF15 except DHT (C4), JPG (C8) and DAC (CC)
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      if (pos + 10 > length) {
+        return false;
+      }
+
+      height = (data[pos + 5] << 8) | data[pos + 6];
+      width = (data[pos + 7] << 8) | data[pos + 8];
+
+      if (components) {
+        *components = data[pos + 9];
+      }
+
+      return (width > 0) && (height > 0);
+    }
+
+    pos += 2 + segmentLength;
+  }
+
+  return false;
+}
+
+//----------------------------------------------------------------------------
+// Map a rectangle from stored image coordinates to the coordinates of the
+// image after the EXIF orientation has been corrected
+//----------------------------------------------------------------------------
+static cv::Rect orientRect(const cv::Rect &r, const cv::Size &stored, long orientation) {
+  const int w = stored.width;
+  const int h = stored.height;
+
+  switch (orientation) {
+    case 2: return cv::Rect(w - r.x - r.width, r.y, r.width, r.height);
+    case 3: return cv::Rect(w - r.x - r.width, h - r.y - r.height, r.width, r.height);
+    case 4: return cv::Rect(r.x, h - r.y - r.height, r.width, r.height);
+    case 5: return cv::Rect(r.y, r.x, r.height, r.width);
+    case 6: return cv::Rect(h - r.y - r.height, r.x, r.height, r.width);
+    case 7: return cv::Rect(h - r.y - r.height, w - r.x - r.width, r.height, r.width);
+    case 8: return cv::Rect(r.y, w - r.x - r.width, r.height, r.width);
+    default: return r;
+  }
+}
+
+//----------------------------------------------------------------------------
+// Inverse of orientRect: map a rectangle in oriented coordinates back to the
+// stored image
+//----------------------------------------------------------------------------
+static cv::Rect unorientRect(const cv::Rect &r, const cv::Size &stored, long orientation) {
+  const int w = stored.width;
+  const int h = stored.height;
+
+  switch (orientation) {
+    case 2: return cv::Rect(w - r.x - r.width, r.y, r.width, r.height);
+    case 3: return cv::Rect(w - r.x - r.width, h - r.y - r.height, r.width, r.height);
+    case 4: return cv::Rect(r.x, h - r.y - r.height, r.width, r.height);
+    case 5: return cv::Rect(r.y, r.x, r.height, r.width);
+    case 6: return cv::Rect(r.y, h - r.x - r.width, r.height, r.width);
+    case 7: return cv::Rect(w - r.y - r.height, h - r.x - r.width, r.height, r.width);
+    case 8: return cv::Rect(w - r.y - r.height, r.x, r.height, r.width);
+    default: return r;
+  }
+}
+
+//----------------------------------------------------------------------------
+// Apply an EXIF orientation to an image. Each rotation is a single cv::rotate
+// (or a transpose for the mirrored ones) so the image is only walked once or
+// twice
+//----------------------------------------------------------------------------
+static bool orientImage(cv::Mat &image, long orientation) {
+  switch (orientation) {
+    case 2: cv::flip(image, image, 1);
+      return true;
+
+    case 3: cv::rotate(image, image, cv::ROTATE_180);
+      return true;
+
+    case 4: cv::flip(image, image, 0);
+      return true;
+
+    case 5: cv::transpose(image, image);
+      return true;
+
+    case 6: cv::rotate(image, image, cv::ROTATE_90_CLOCKWISE);
+      return true;
+
+    case 7: cv::transpose(image, image);
+      cv::flip(image, image, -1);
+      return true;
+
+    case 8: cv::rotate(image, image, cv::ROTATE_90_COUNTERCLOCKWISE);
+      return true;
+
+    default: return false;
+  }
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 static void exifDebug(Exiv2::ExifData &exifData) {
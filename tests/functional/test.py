@@ -2,6 +2,7 @@
 # -*- coding: utf-8 -*-
 
 import os
+import multiprocessing
 import unittest
 import json
 from subprocess import Popen, PIPE
@@ -81,6 +82,74 @@ class TestArion(unittest.TestCase):
 
         return self.call_arion(input_url, [operation])
 
+    # -------------------------------------------------------------------------------
+    #  Helper function for reading the pixels of a PPM (or PGM) written by Arion.
+    #  Returns the width, height, channels and the pixels as a bytearray
+    # -------------------------------------------------------------------------------
+    def read_pixels(self, path):
+
+        with open(path, 'rb') as image_file:
+            data = bytearray(image_file.read())
+
+        fields = []
+        pos = 0
+
+        # Magic number, width, height and maximum value, with comments
+        while len(fields) < 4:
+            if data[pos] == ord('#'):
+                while data[pos] != ord('\n'):
+                    pos += 1
+            elif chr(data[pos]).isspace():
+                pos += 1
+            else:
+                start = pos
+
+                while not chr(data[pos]).isspace():
+                    pos += 1
+
+                fields.append(data[start:pos].decode('ascii'))
+
+        # One whitespace character separates the header from the pixels
+        pos += 1
+
+        channels = 3 if fields[0] == 'P6' else 1
+
+        return int(fields[1]), int(fields[2]), channels, data[pos:]
+
+    # -------------------------------------------------------------------------------
+    #  Helper function for decoding an image (such as a JPEG output) to pixels.
+    #  Resizing to the same size only copies the decoded pixels
+    # -------------------------------------------------------------------------------
+    def decode_pixels(self, input_url, width, height):
+
+        output_url = input_url + '.ppm'
+
+        operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': width,
+                    'height': height,
+                    'type': 'width',
+                    'output_url': output_url
+                }
+        }
+
+        output = self.call_arion(input_url, [operation])
+
+        self.verifySuccess(output, width, height)
+
+        return self.read_pixels(output_url)[3]
+
+    # -------------------------------------------------------------------------------
+    #  Helper function for the largest difference between two sets of pixels
+    # -------------------------------------------------------------------------------
+    def max_difference(self, pixels_1, pixels_2):
+
+        self.assertEqual(len(pixels_1), len(pixels_2))
+
+        return max(abs(a - b) for a, b in zip(pixels_1, pixels_2))
+
     # -------------------------------------------------------------------------------
     #  Helper function for checking for successful output
     # -------------------------------------------------------------------------------
@@ -179,6 +248,7 @@ class TestArion(unittest.TestCase):
         output = self.call_arion(input_url, operations)
 
         self.verifySuccess(output);
+        self.assertEqual(output['format'], 'jpeg')
 
         # -----------------------------------------
         #                  PNG
@@ -208,6 +278,7 @@ class TestArion(unittest.TestCase):
         output = self.call_arion(input_url, operations)
 
         self.verifySuccess(output);
+        self.assertEqual(output['format'], 'png')
 
         # -----------------------------------------
         #                  TIFF
@@ -237,6 +308,7 @@ class TestArion(unittest.TestCase):
         output = self.call_arion(input_url, operations)
 
         self.verifySuccess(output);
+        self.assertEqual(output['format'], 'tiff')
 
     # -------------------------------------------------------------------------------
     # -------------------------------------------------------------------------------
@@ -1117,6 +1189,52 @@ class TestArion(unittest.TestCase):
         output = self.copy_image(self.LANDSCAPE_8_PATH, self.outputUrlHelper('Landscape_8.jpg'))
         self.verifySuccess(output);
 
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_jpg_orientation_resize(self):
+
+        landscapes = [self.LANDSCAPE_1_PATH, self.LANDSCAPE_2_PATH, self.LANDSCAPE_3_PATH, self.LANDSCAPE_4_PATH,
+                      self.LANDSCAPE_5_PATH, self.LANDSCAPE_6_PATH, self.LANDSCAPE_7_PATH, self.LANDSCAPE_8_PATH]
+
+        # The resizes orient their outputs, every output is landscape
+        for i, landscape in enumerate(landscapes):
+            output_url = self.outputUrlHelper('Landscape_resize_%d.jpg' % (i + 1))
+
+            resize_operation = {
+                'type': 'resize',
+                'params':
+                    {
+                        'width': 120,
+                        'height': 1000,
+                        'type': 'width',
+                        'output_url': output_url
+                    }
+            }
+
+            output = self.call_arion(landscape, [resize_operation])
+
+            self.verifySuccess(output, 600, 450)
+            self.verifySuccess(self.read_image(output_url), 120, 90)
+
+            output_url = self.outputUrlHelper('Landscape_fill_%d.jpg' % (i + 1))
+
+            fill_operation = {
+                'type': 'resize',
+                'params':
+                    {
+                        'width': 120,
+                        'height': 40,
+                        'type': 'fill',
+                        'gravity': 'north',
+                        'output_url': output_url
+                    }
+            }
+
+            output = self.call_arion(landscape, [fill_operation])
+
+            self.verifySuccess(output, 600, 450)
+            self.verifySuccess(self.read_image(output_url), 120, 40)
+
     # -------------------------------------------------------------------------------
     # -------------------------------------------------------------------------------
     def test_invalid_operation(self):
@@ -1178,6 +1296,367 @@ class TestArion(unittest.TestCase):
         self.assertEqual(output['info'][0]['md5'], 'a0c5cee72d1a59a6d0f3f6e76b73cecc')  # new libJpeg
 
     #  self.assertEqual(output['info'][0]['md5'], 'c8d342a627da420e77c2e90a10f75689')
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_decode_scale(self):
+
+        output_url = self.outputUrlHelper('test_decode_scale.jpg')
+
+        resize_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 150,
+                    'height': 1000,
+                    'type': 'width',
+                    'output_url': output_url
+                }
+        }
+
+        # 1296 / 150 allows the JPEG to be decoded at 1/8 scale
+        output = self.call_arion(self.IMAGE_1_PATH, [resize_operation])
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertEqual(output['decode_scale'], 8)
+
+        output = self.read_image(output_url)
+
+        self.verifySuccess(output, 150, 100)
+
+        # Fingerprints need every source pixel
+        fingerprint_operation = {
+            'type': 'fingerprint',
+            'params':
+                {
+                    'type': 'md5'
+                }
+        }
+
+        output = self.call_arion(self.IMAGE_1_PATH, [resize_operation, fingerprint_operation])
+
+        self.assertTrue(output['result'])
+        self.assertEqual(output['decode_scale'], 1)
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_embedded_preview(self):
+
+        output_url = self.outputUrlHelper('test_embedded_preview.jpg')
+
+        resize_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 200,
+                    'height': 1000,
+                    'type': 'width',
+                    'output_url': output_url
+                }
+        }
+
+        additional_params = {
+            'use_embedded_preview': True
+        }
+
+        # The 256x171 EXIF thumbnail is large enough
+        output = self.call_arion(self.IMAGE_1_PATH, [resize_operation], additional_params)
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertTrue(output['embedded_preview'])
+
+        output = self.read_image(output_url)
+
+        self.verifySuccess(output, 200, 133)
+
+        # ...but not for a larger output
+        resize_operation['params']['width'] = 400
+
+        output = self.call_arion(self.IMAGE_1_PATH, [resize_operation], additional_params)
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertFalse(output['embedded_preview'])
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_region_decode(self):
+
+        region_url = self.outputUrlHelper('test_region_decode_region.jpg')
+        full_url = self.outputUrlHelper('test_region_decode_full.jpg')
+
+        fill_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 800,
+                    'height': 800,
+                    'type': 'fill',
+                    'output_url': region_url
+                }
+        }
+
+        # Only the 864x864 center crop is decoded
+        output = self.call_arion(self.IMAGE_1_PATH, [fill_operation])
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertTrue(output['region_decode'])
+
+        # A width resize needs the whole source
+        width_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 1000,
+                    'height': 1000,
+                    'type': 'width',
+                    'output_url': self.outputUrlHelper('test_region_decode_width.jpg')
+                }
+        }
+
+        fill_operation['params']['output_url'] = full_url
+
+        output = self.call_arion(self.IMAGE_1_PATH, [fill_operation, width_operation])
+
+        self.assertTrue(output['result'])
+        self.assertEqual(output['failed_operations'], 0)
+        self.assertFalse(output['region_decode'])
+
+        # The crop must not change
+        with open(region_url, 'rb') as region_file, open(full_url, 'rb') as full_file:
+            self.assertEqual(region_file.read(), full_file.read())
+
+    # -------------------------------------------------------------------------------
+    # Compare a fill of a TIFF read by TiffReader (a region or a reduced level)
+    # with one from a full decode, which a second operation that needs the
+    # whole source at full resolution forces
+    # -------------------------------------------------------------------------------
+    def verifyTiffRegion(self, input_url, full_width, name):
+
+        region_url = self.outputUrlHelper(name + '_region.png')
+        full_url = self.outputUrlHelper(name + '_full.png')
+
+        fill_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 100,
+                    'height': 100,
+                    'type': 'fill',
+                    'output_url': region_url
+                }
+        }
+
+        output = self.call_arion(input_url, [fill_operation])
+
+        self.verifySuccess(output)
+        self.assertEqual(output['format'], 'tiff')
+        self.assertTrue(output['region_decode'])
+        self.assertEqual(output['decode_scale'], 1)
+
+        width_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': full_width,
+                    'height': 1000,
+                    'type': 'width',
+                    'output_url': self.outputUrlHelper(name + '_width.png')
+                }
+        }
+
+        fill_operation['params']['output_url'] = full_url
+
+        output = self.call_arion(input_url, [fill_operation, width_operation])
+
+        self.assertTrue(output['result'])
+        self.assertEqual(output['failed_operations'], 0)
+        self.assertFalse(output['region_decode'])
+
+        with open(region_url, 'rb') as region_file, open(full_url, 'rb') as full_file:
+            self.assertEqual(region_file.read(), full_file.read())
+
+    # -------------------------------------------------------------------------------
+    # small_input.tif is stored in one strip
+    # -------------------------------------------------------------------------------
+    def test_tiff_strips(self):
+
+        self.verifyTiffRegion('../images/small_input.tif', 200, 'test_tiff_strips')
+
+    # -------------------------------------------------------------------------------
+    # pyramid_tiled.tif is a 256x192 image in 32x32 tiles with reduced
+    # resolution subfiles of 128x96 and 64x48
+    # -------------------------------------------------------------------------------
+    def test_tiff_pyramid(self):
+
+        input_url = '../images/pyramid_tiled.tif'
+
+        self.verifyTiffRegion(input_url, 256, 'test_tiff_pyramid')
+
+        # Each output only needs the smallest level that is still large enough
+        for width, decode_scale in [(64, 4), (100, 2), (200, 1)]:
+            resize_operation = {
+                'type': 'resize',
+                'params':
+                    {
+                        'width': width,
+                        'height': 1000,
+                        'type': 'width',
+                        'output_url': self.outputUrlHelper('test_tiff_pyramid_%d.jpg' % width)
+                    }
+            }
+
+            output = self.call_arion(input_url, [resize_operation])
+
+            self.verifySuccess(output, 256, 192)
+            self.assertEqual(output['decode_scale'], decode_scale)
+            self.assertEqual(output['info'][0]['output_width'], width)
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_streaming(self):
+
+        output_url = self.outputUrlHelper('test_streaming.jpg')
+
+        resize_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 200,
+                    'height': 1000,
+                    'type': 'width',
+                    'output_url': output_url
+                }
+        }
+
+        # Lower the threshold so the test image gets streamed
+        additional_params = {
+            'stream_min_pixels': 1000
+        }
+
+        output = self.call_arion(self.IMAGE_1_PATH, [resize_operation], additional_params)
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertTrue(output['streamed'])
+
+        output = self.read_image(output_url)
+
+        self.verifySuccess(output, 200, 133)
+
+        # Fingerprints need the decoded source
+        fingerprint_operation = {
+            'type': 'fingerprint',
+            'params':
+                {
+                    'type': 'md5'
+                }
+        }
+
+        output = self.call_arion(self.IMAGE_1_PATH, [resize_operation, fingerprint_operation], additional_params)
+
+        self.assertTrue(output['result'])
+        self.assertFalse(output['streamed'])
+
+        # Streaming resamples by area, other interpolations decode the source
+        resize_operation['params']['interpolation'] = 'lanczos3'
+
+        output = self.call_arion(self.IMAGE_1_PATH, [resize_operation], additional_params)
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertFalse(output['streamed'])
+
+        # Progressive JPEGs (such as our outputs) would be buffered whole by
+        # libjpeg, so they are decoded the usual way
+        progressive_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 100,
+                    'height': 1000,
+                    'type': 'width',
+                    'output_url': self.outputUrlHelper('test_streaming_progressive.jpg')
+                }
+        }
+
+        output = self.call_arion(output_url, [progressive_operation], additional_params)
+
+        self.verifySuccess(output, 200, 133)
+        self.assertFalse(output['streamed'])
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_grayscale(self):
+
+        output_url = self.outputUrlHelper('test_grayscale.jpg')
+
+        resize_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 100,
+                    'height': 400,
+                    'type': 'width',
+                    'sharpen_amount': 50,
+                    'watermark_url': '../images/watermark.png',
+                    'watermark_type': 'adaptive',
+                    'output_url': output_url
+                }
+        }
+
+        output = self.call_arion('../images/small_input_gray.jpg', [resize_operation])
+
+        self.verifySuccess(output, 200, 133)
+        self.assertTrue(output['grayscale'])
+
+        output = self.read_image(output_url)
+
+        self.verifySuccess(output, 100, 67)
+
+        # Color sources are unaffected
+        output = self.call_arion('../images/small_input.jpg', [resize_operation])
+
+        self.verifySuccess(output, 200, 133)
+        self.assertFalse(output['grayscale'])
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_planar(self):
+
+        output_url = self.outputUrlHelper('test_planar.jpg')
+
+        resize_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 201,
+                    'height': 1000,
+                    'type': 'width',
+                    'sharpen_amount': 50,
+                    'output_url': output_url
+                }
+        }
+
+        output = self.call_arion(self.IMAGE_1_PATH, [resize_operation])
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertTrue(output['planar'])
+
+        output = self.read_image(output_url)
+
+        self.verifySuccess(output, 201, 134)
+
+        # Grayscale sources and PNG outputs go through OpenCV
+        output = self.call_arion('../images/small_input_gray.jpg', [resize_operation])
+
+        self.verifySuccess(output, 200, 133)
+        self.assertFalse(output['planar'])
+
+        resize_operation['params']['output_url'] = self.outputUrlHelper('test_planar.png')
+
+        output = self.call_arion(self.IMAGE_1_PATH, [resize_operation])
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertFalse(output['planar'])
+
     # -------------------------------------------------------------------------------
     # -------------------------------------------------------------------------------
     def testInvalidCopyParams(self):
@@ -1279,6 +1758,736 @@ class TestArion(unittest.TestCase):
         self.assertFalse('height' in output)
         self.assertFalse('width' in output)
 
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_decode_on_demand(self):
+
+        # Metadata only jobs report the dimensions from the header
+        output = self.read_image(self.IMAGE_1_PATH)
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertFalse('decode_scale' in output)
+
+        # Copy only jobs don't decode either
+        output = self.copy_image(self.IMAGE_1_PATH, self.outputUrlHelper('test_decode_on_demand.jpg'))
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertFalse('decode_scale' in output)
+
+        # Neither do they when the header can't be read (OpenCV can't decode
+        # GIFs), the dimensions are left out instead
+        gif_url = 'file://../images/single_pixel.gif'
+
+        output = self.read_image(gif_url)
+
+        self.verifySuccess(output)
+        self.assertFalse('height' in output)
+        self.assertFalse('width' in output)
+        self.assertFalse('decode_scale' in output)
+
+        output = self.copy_image(gif_url, self.outputUrlHelper('test_decode_on_demand.gif'))
+
+        self.verifySuccess(output)
+        self.assertFalse('decode_scale' in output)
+
+        # Resizes decode whatever flags are passed
+        resize_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 200,
+                    'height': 1000,
+                    'type': 'width',
+                    'output_url': self.outputUrlHelper('test_decode_on_demand_resize.jpg')
+                }
+        }
+
+        additional_params = {
+            'allow_skip_decode_image': True
+        }
+
+        output = self.call_arion(self.IMAGE_1_PATH, [resize_operation], additional_params)
+
+        self.verifySuccess(output, 1296, 864)
+        self.assertTrue('decode_scale' in output)
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_pyramid(self):
+
+        operations = [
+            {
+                'type': 'fingerprint',
+                'params':
+                    {
+                        'type': 'md5'
+                    }
+            }
+        ]
+
+        for width, interpolation in [(600, 'area'), (100, 'area'), (100, 'nearest')]:
+            operations.append({
+                'type': 'resize',
+                'params':
+                    {
+                        'width': width,
+                        'height': 1000,
+                        'type': 'width',
+                        'interpolation': interpolation,
+                        'output_url': self.outputUrlHelper('test_pyramid_{}_{}.jpg'.format(width, interpolation))
+                    }
+            })
+
+        # The fingerprint keeps the source at full resolution
+        output = self.call_arion(self.IMAGE_1_PATH, operations)
+
+        self.assertTrue(output['result'])
+        self.assertEqual(output['decode_scale'], 1)
+
+        # 1296 / 4 is still at least twice 100 but 1296 / 2 is less than twice 600
+        self.assertEqual(output['info'][1]['pyramid_level'], 0)
+        self.assertEqual(output['info'][2]['pyramid_level'], 2)
+
+        # Nearest neighbour resizes never use the pyramid
+        self.assertEqual(output['info'][3]['pyramid_level'], 0)
+
+        self.assertEqual(output['info'][1]['output_width'], 600)
+        self.assertEqual(output['info'][1]['output_height'], 400)
+        self.assertEqual(output['info'][2]['output_width'], 100)
+        self.assertEqual(output['info'][2]['output_height'], 67)
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_resize_strategy(self):
+
+        operations = [
+            {
+                'type': 'fingerprint',
+                'params':
+                    {
+                        'type': 'md5'
+                    }
+            }
+        ]
+
+        for strategy in ['auto', 'fast', 'exact']:
+            operations.append({
+                'type': 'resize',
+                'params':
+                    {
+                        'width': 150,
+                        'height': 1000,
+                        'type': 'width',
+                        'interpolation': 'cubic',
+                        'resize_strategy': strategy,
+                        'output_url': self.outputUrlHelper('test_resize_strategy_{}.jpg'.format(strategy))
+                    }
+            })
+
+        output = self.call_arion(self.IMAGE_1_PATH, operations)
+
+        self.assertTrue(output['result'])
+        self.assertEqual(output['decode_scale'], 1)
+
+        # Cubic finishes from at least 3x the output in the automatic strategy
+        # (1296 / 2 >= 450) and 2x in the fast one (1296 / 4 >= 300)
+        self.assertEqual(output['info'][1]['resize_strategy'], 'fast')
+        self.assertEqual(output['info'][1]['pyramid_level'], 1)
+        self.assertEqual(output['info'][2]['resize_strategy'], 'fast')
+        self.assertEqual(output['info'][2]['pyramid_level'], 2)
+        self.assertEqual(output['info'][3]['resize_strategy'], 'exact')
+        self.assertEqual(output['info'][3]['pyramid_level'], 0)
+
+        for info in output['info'][1:]:
+            self.assertEqual(info['output_width'], 150)
+            self.assertEqual(info['output_height'], 100)
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_resample_filters(self):
+
+        for interpolation in ['box', 'catmull_rom', 'mitchell', 'lanczos3', 'lanczos4']:
+            output_url = self.outputUrlHelper('test_resample_filters_{}.jpg'.format(interpolation))
+
+            resize_operation = {
+                'type': 'resize',
+                'params':
+                    {
+                        'width': 200,
+                        'height': 1000,
+                        'type': 'width',
+                        'interpolation': interpolation,
+                        'output_url': output_url
+                    }
+            }
+
+            output = self.call_arion(self.IMAGE_1_PATH, [resize_operation])
+
+            self.verifySuccess(output, 1296, 864)
+
+            output = self.read_image(output_url)
+
+            self.verifySuccess(output, 200, 133)
+
+        # A flat image stays flat whatever the filter, reduced or enlarged
+        for interpolation in ['box', 'catmull_rom', 'mitchell', 'lanczos3', 'lanczos4']:
+            for width in [40, 150]:
+                output_url = self.outputUrlHelper('test_resample_filters_flat_{}_{}.ppm'.format(interpolation, width))
+
+                resize_operation = {
+                    'type': 'resize',
+                    'params':
+                        {
+                            'width': width,
+                            'height': 1000,
+                            'type': 'width',
+                            'interpolation': interpolation,
+                            'output_url': output_url
+                        }
+                }
+
+                output = self.call_arion('file://../images/flat.png', [resize_operation])
+
+                self.verifySuccess(output, 97, 61)
+
+                output_width, output_height, channels, pixels = self.read_pixels(output_url)
+
+                self.assertEqual(pixels, pixels[0:channels] * (output_width * output_height))
+
+        # At an integer ratio box averages the same pixels as area, but rounds
+        # after each pass
+        pixels = {}
+
+        for interpolation in ['box', 'area']:
+            output_url = self.outputUrlHelper('test_resample_filters_half_{}.ppm'.format(interpolation))
+
+            resize_operation = {
+                'type': 'resize',
+                'params':
+                    {
+                        'width': 48,
+                        'height': 32,
+                        'type': 'width',
+                        'interpolation': interpolation,
+                        'output_url': output_url
+                    }
+            }
+
+            output = self.call_arion('file://../images/sharpen_source.png', [resize_operation])
+
+            self.verifySuccess(output, 96, 64)
+
+            pixels[interpolation] = self.read_pixels(output_url)[3]
+
+        self.assertLessEqual(self.max_difference(pixels['box'], pixels['area']), 1)
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_linear_light(self):
+
+        operations = []
+
+        for interpolation in ['area', 'lanczos3']:
+            operations.append({
+                'type': 'resize',
+                'params':
+                    {
+                        'width': 200,
+                        'height': 1000,
+                        'type': 'width',
+                        'interpolation': interpolation,
+                        'linear_light': True,
+                        'output_url': self.outputUrlHelper('test_linear_light_{}.jpg'.format(interpolation))
+                    }
+            })
+
+        output = self.call_arion(self.IMAGE_1_PATH, operations)
+
+        self.assertTrue(output['result'])
+
+        for info in output['info']:
+            self.assertTrue(info['linear_light'])
+            self.assertEqual(info['pyramid_level'], 0)
+            self.assertEqual(info['output_width'], 200)
+            self.assertEqual(info['output_height'], 133)
+
+        # Linear light needs RGB so the planes are not used
+        self.assertFalse(output['planar'])
+
+        # Halving a black and white checkerboard averages to half the light,
+        # which is 188 in sRGB rather than the 128 of averaging sRGB values
+        for interpolation in ['area', 'box']:
+            for linear_light, expected in [(False, 128), (True, 188)]:
+                output_url = self.outputUrlHelper('test_linear_light_checkerboard_{}_{}.ppm'.format(interpolation, linear_light))
+
+                resize_operation = {
+                    'type': 'resize',
+                    'params':
+                        {
+                            'width': 48,
+                            'height': 32,
+                            'type': 'width',
+                            'interpolation': interpolation,
+                            'linear_light': linear_light,
+                            'output_url': output_url
+                        }
+                }
+
+                output = self.call_arion('file://../images/checkerboard.png', [resize_operation])
+
+                self.verifySuccess(output, 96, 64)
+
+                pixels = self.read_pixels(output_url)[3]
+
+                self.assertLessEqual(self.max_difference(pixels, bytearray([expected]) * len(pixels)), 1)
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_tiled(self):
+
+        operations = []
+
+        for interpolation, extension in [('area', 'jpg'), ('lanczos3', 'jpg'), ('lanczos3', 'png')]:
+            operations.append({
+                'type': 'resize',
+                'params':
+                    {
+                        'width': 2000,
+                        'height': 2000,
+                        'type': 'width',
+                        'interpolation': interpolation,
+                        'sharpen_amount': 50,
+                        'sharpen_radius': 1.0,
+                        'watermark_url': '../images/watermark.png',
+                        'watermark_amount': 0.2,
+                        'output_url': self.outputUrlHelper('test_tiled_{}.{}'.format(interpolation, extension))
+                    }
+            })
+
+        output = self.call_arion(self.IMAGE_1_PATH, operations)
+
+        self.assertTrue(output['result'])
+
+        for info in output['info']:
+            self.assertTrue(info['result'])
+            self.assertEqual(info['output_width'], 2000)
+            self.assertEqual(info['output_height'], 1333)
+
+        # Only large JPEG outputs are encoded a band at a time
+        self.assertTrue(output['info'][0]['tiled'])
+        self.assertTrue(output['info'][1]['tiled'])
+        self.assertFalse(output['info'][2]['tiled'])
+
+        # Tiled outputs have the pixels of the untiled path. Area reductions
+        # (600x400 is banded every 25 rows) and our resampler are resized a
+        # band at a time. The encoder may link a different libjpeg than
+        # OpenCV's, so the decoded pixels may differ by rounding
+        for interpolation in ['area', 'lanczos3']:
+            output_urls = []
+            operations = []
+
+            for tile_min_pixels in [1000, 0]:
+                output_url = self.outputUrlHelper('test_tiled_{}_{}.jpg'.format(interpolation, tile_min_pixels))
+                output_urls.append(output_url)
+
+                operations.append({
+                    'type': 'resize',
+                    'params':
+                        {
+                            'width': 600,
+                            'height': 600,
+                            'type': 'width',
+                            'interpolation': interpolation,
+                            'sharpen_amount': 80,
+                            'sharpen_radius': 1.5,
+                            'watermark_url': '../images/watermark.png',
+                            'watermark_amount': 0.2,
+                            'tile_min_pixels': tile_min_pixels,
+                            'output_url': output_url
+                        }
+                })
+
+            output = self.call_arion(self.IMAGE_1_PATH, operations)
+
+            self.assertTrue(output['result'])
+            self.assertTrue(output['info'][0]['tiled'])
+            self.assertFalse(output['info'][1]['tiled'])
+
+            tiled = self.decode_pixels(output_urls[0], 600, 400)
+            untiled = self.decode_pixels(output_urls[1], 600, 400)
+
+            self.assertLessEqual(self.max_difference(tiled, untiled), 1)
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_sharpen_threshold(self):
+
+        input_url = 'file://../images/sharpen_source.png'
+        operations = []
+
+        # Same size, so only the sharpen changes the pixels
+        for threshold in [0, 10, 255]:
+            operations.append({
+                'type': 'resize',
+                'params':
+                    {
+                        'width': 96,
+                        'height': 64,
+                        'type': 'width',
+                        'sharpen_amount': 100,
+                        'sharpen_radius': 1.5,
+                        'sharpen_threshold': threshold,
+                        'output_url': self.outputUrlHelper('test_sharpen_threshold_{}.ppm'.format(threshold))
+                    }
+            })
+
+        # And the source pixels without sharpening
+        operations.append({
+            'type': 'resize',
+            'params':
+                {
+                    'width': 96,
+                    'height': 64,
+                    'type': 'width',
+                    'output_url': self.outputUrlHelper('test_sharpen_threshold_source.ppm')
+                }
+        })
+
+        output = self.call_arion(input_url, operations)
+
+        self.assertTrue(output['result'])
+
+        for info in output['info']:
+            self.assertTrue(info['result'])
+            self.assertEqual(info['output_width'], 96)
+            self.assertEqual(info['output_height'], 64)
+
+        source = self.read_pixels(self.outputUrlHelper('test_sharpen_threshold_source.ppm'))[3]
+        sharpened = {}
+
+        for threshold in [0, 10, 255]:
+            sharpened[threshold] = self.read_pixels(self.outputUrlHelper('test_sharpen_threshold_{}.ppm'.format(threshold)))[3]
+
+        # Nothing differs from its blur by 255 or more
+        self.assertEqual(sharpened[255], source)
+
+        # GaussianBlur and addWeighted, which sharpened before the fixed-point
+        # unsharp mask (generated with OpenCV)
+        expected = self.read_pixels('../images/sharpen_expected.ppm')[3]
+
+        self.assertLessEqual(self.max_difference(sharpened[0], expected), 1)
+
+        # A threshold leaves the flatter pixels alone
+        changed_0 = sum(a != b for a, b in zip(sharpened[0], source))
+        changed_10 = sum(a != b for a, b in zip(sharpened[10], source))
+
+        self.assertGreater(changed_10, 0)
+        self.assertLess(changed_10, changed_0)
+
+    # -------------------------------------------------------------------------------
+    # -------------------------------------------------------------------------------
+    def test_pre_filter(self):
+
+        output_url = self.outputUrlHelper('test_pre_filter.jpg')
+
+        resize_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 230,
+                    'height': 2000,
+                    'type': 'width',
+                    'pre_filter': True,
+                    'sharpen_amount': 100,
+                    'sharpen_radius': 0.5,
+                    'output_url': output_url
+                }
+        }
+
+        # Both the planes and the BGR path are pre-filtered
+        for input_url in [self.IMAGE_1_PATH, '../images/small_input_gray.jpg']:
+            output = self.call_arion(input_url, [resize_operation])
+
+            self.assertTrue(output['result'])
+            self.assertTrue(output['info'][0]['result'])
+            self.assertEqual(output['info'][0]['output_width'], 230)
+
+        output = self.read_image(output_url)
+
+        self.verifySuccess(output, 230, 153)
+
+    # -------------------------------------------------------------------------------
+    # The fill crops the black center of an image that is white on either side.
+    # The pre-filter blurs the crop with the white pixels around it, so its
+    # edges come out lighter than without the pre-filter
+    # -------------------------------------------------------------------------------
+    def test_pre_filter_crop(self):
+
+        outputs = []
+
+        for pre_filter in [False, True]:
+            output_url = self.outputUrlHelper('test_pre_filter_crop_%d.png' % pre_filter)
+            outputs.append(output_url)
+
+            resize_operation = {
+                'type': 'resize',
+                'params':
+                    {
+                        'width': 300,
+                        'height': 300,
+                        'type': 'fill',
+                        'pre_filter': pre_filter,
+                        'output_url': output_url
+                    }
+            }
+
+            output = self.call_arion('../images/crop_edges.png', [resize_operation])
+
+            self.assertTrue(output['result'])
+            self.assertTrue(output['info'][0]['result'])
+            self.assertEqual(output['info'][0]['output_width'], 300)
+            self.assertEqual(output['info'][0]['output_height'], 300)
+
+        with open(outputs[0], 'rb') as plain_file, open(outputs[1], 'rb') as filtered_file:
+            self.assertNotEqual(plain_file.read(), filtered_file.read())
+
+    # -------------------------------------------------------------------------------
+    def test_watermark_gray(self):
+
+        output_url = self.outputUrlHelper('test_watermark_gray.jpg')
+
+        resize_operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 300,
+                    'height': 300,
+                    'type': 'fill',
+                    'watermark_url': '../images/watermark.png',
+                    'watermark_amount': 0.3,
+                    'output_url': output_url
+                }
+        }
+
+        # Single channel outputs get the brightness of the watermark
+        for watermark_type in ['standard', 'adaptive']:
+            resize_operation['params']['watermark_type'] = watermark_type
+
+            output = self.call_arion('../images/small_input_gray.jpg', [resize_operation])
+
+            self.assertTrue(output['result'])
+            self.assertTrue(output['info'][0]['result'])
+
+            output = self.read_image(output_url)
+
+            self.verifySuccess(output, 300, 300)
+
+    # -------------------------------------------------------------------------------
+    def test_watermark_cache(self):
+
+        operations = []
+
+        for size in [200, 300]:
+            operations.append({
+                'type': 'resize',
+                'params':
+                    {
+                        'width': size,
+                        'height': size,
+                        'type': 'fill',
+                        'watermark_url': '../images/watermark2.png',
+                        'watermark_amount': 0.2,
+                        'output_url': self.outputUrlHelper('test_watermark_cache_%d.jpg' % size)
+                    }
+            })
+
+        for threads in [1, 4]:
+            output = self.call_arion(self.IMAGE_1_PATH, operations, {'threads': threads})
+
+            self.assertTrue(output['result'])
+
+            # The resizes may run in either order (or at once), so order them
+            # by when they looked the watermark up
+            infos = sorted(output['info'],
+                           key=lambda info: info['watermark_cache_hits'] + info['watermark_cache_misses'])
+
+            self.assertEqual(infos[0]['watermark_cache_hits'] + infos[0]['watermark_cache_misses'], 1)
+            self.assertEqual(infos[1]['watermark_cache_hits'] + infos[1]['watermark_cache_misses'], 2)
+
+            # The first lookup of a process always reads the file
+            self.assertFalse(infos[0]['watermark_cached'])
+            self.assertEqual(infos[0]['watermark_cache_misses'], 1)
+
+            # One at a time the second resize reuses the watermark the first
+            # one read. At once both may have read it
+            if threads == 1:
+                self.assertTrue(infos[1]['watermark_cached'])
+                self.assertEqual(infos[1]['watermark_cache_hits'], 1)
+
+    # -------------------------------------------------------------------------------
+    def test_threads(self):
+
+        operations = []
+        widths = [1200, 100, 800, 200, 600, 300]
+
+        for width in widths:
+            operations.append({
+                'type': 'resize',
+                'params':
+                    {
+                        'width': width,
+                        'height': width,
+                        'type': 'width',
+                        'sharpen_amount': 50,
+                        'output_url': self.outputUrlHelper('test_threads_%d.jpg' % width)
+                    }
+            })
+
+        operations.append({'type': 'fingerprint', 'params': {'type': 'md5'}})
+
+        for threads in [1, 4]:
+            output = self.call_arion(self.IMAGE_1_PATH, operations, {'threads': threads})
+
+            self.assertTrue(output['result'])
+            self.assertEqual(output['threads'], min(threads, multiprocessing.cpu_count()))
+            self.assertEqual(output['total_operations'], len(operations))
+
+            # Results are in the order of the operations, however they ran
+            for i in range(len(widths)):
+                self.assertTrue(output['info'][i]['result'])
+                self.assertEqual(output['info'][i]['output_width'], widths[i])
+
+            self.assertEqual(output['info'][len(widths)]['md5'], 'a0c5cee72d1a59a6d0f3f6e76b73cecc')
+
+        # More threads than cores are capped and 0 is ignored
+        output = self.call_arion(self.IMAGE_1_PATH, operations, {'threads': 100000})
+
+        self.assertTrue(output['result'])
+        self.assertEqual(output['threads'], multiprocessing.cpu_count())
+
+        output = self.call_arion(self.IMAGE_1_PATH, operations, {'threads': 0})
+
+        self.assertTrue(output['result'])
+        self.assertGreaterEqual(output['threads'], 1)
+
+    # -------------------------------------------------------------------------------
+    # image-1.jpg has XMP, which every output writes at the same time
+    # -------------------------------------------------------------------------------
+    def test_preserve_meta_threads(self):
+
+        operations = []
+        widths = [400, 300, 250, 200, 150, 100]
+
+        for width in widths:
+            operations.append({
+                'type': 'resize',
+                'params':
+                    {
+                        'width': width,
+                        'height': width,
+                        'type': 'width',
+                        'preserve_meta': True,
+                        'output_url': self.outputUrlHelper('test_preserve_meta_threads_%d.jpg' % width)
+                    }
+            })
+
+        output = self.call_arion(self.IMAGE_1_PATH, operations, {'threads': 4})
+
+        self.assertTrue(output['result'])
+        self.assertEqual(output['failed_operations'], 0)
+
+        for width in widths:
+            output_url = self.outputUrlHelper('test_preserve_meta_threads_%d.jpg' % width)
+
+            with open(output_url, 'rb') as output_file:
+                data = output_file.read()
+
+            self.assertIn(b'<x:xmpmeta', data)
+            self.assertIn(b'photoshop:City="Bol"', data)
+
+            output = self.read_image(output_url)
+
+            self.assertTrue(output['result'])
+            self.assertEqual(output['info'][0]['copyright'], 'Paul Filitchkin')
+
+    # -------------------------------------------------------------------------------
+    # The restart interval spans two MCU rows and the image has an odd number of
+    # MCU rows, so the last slice ends half way into its restart interval
+    # -------------------------------------------------------------------------------
+    def test_restart_decode(self):
+
+        # The same coefficients without restart markers, decoded in one go
+        plain_url = self.outputUrlHelper('test_restart_decode_plain.png')
+
+        operation = {
+            'type': 'resize',
+            'params':
+                {
+                    'width': 600,
+                    'height': 450,
+                    'type': 'width',
+                    'output_url': plain_url
+                }
+        }
+
+        output = self.call_arion('file://../images/restart_rows_plain.jpg', [operation])
+
+        self.verifySuccess(output, 600, 450)
+        self.assertEqual(output['restart_slices'], 0)
+
+        with open(plain_url, 'rb') as plain_file:
+            plain = plain_file.read()
+
+        # Sliced even on one thread, so this runs on single core machines too
+        for threads in [1, 4]:
+            output_url = self.outputUrlHelper('test_restart_decode_%d.png' % threads)
+
+            operation['params']['output_url'] = output_url
+
+            output = self.call_arion('file://../images/restart_rows.jpg', [operation], {'threads': threads})
+
+            self.verifySuccess(output, 600, 450)
+            self.assertGreater(output['restart_slices'], 1)
+
+            with open(output_url, 'rb') as sliced_file:
+                self.assertEqual(sliced_file.read(), plain)
+
+    # -------------------------------------------------------------------------------
+    def test_shared_pipeline(self):
+
+        operations = []
+
+        # The first three only differ in quality, the last one in size
+        outputs = [(400, 92, 'a'), (400, 70, 'b'), (400, 50, 'c'), (300, 92, 'd')]
+
+        for width, quality, name in outputs:
+            operations.append({
+                'type': 'resize',
+                'params':
+                    {
+                        'width': width,
+                        'height': 300,
+                        'type': 'fill',
+                        'quality': quality,
+                        'sharpen_amount': 80,
+                        'watermark_url': '../images/watermark.png',
+                        'output_url': self.outputUrlHelper('test_shared_pipeline_%s.jpg' % name)
+                    }
+            })
+
+        output = self.call_arion(self.IMAGE_1_PATH, operations)
+
+        self.assertTrue(output['result'])
+
+        shared = [info['shared_pipeline'] for info in output['info']]
+
+        self.assertEqual(shared, [False, True, True, False])
+
+        for width, quality, name in outputs:
+            output = self.read_image(self.outputUrlHelper('test_shared_pipeline_%s.jpg' % name))
+
+            self.verifySuccess(output, width, 300)
+
     # -------------------------------------------------------------------------------
     #  Helper to merge dicts
     # -------------------------------------------------------------------------------